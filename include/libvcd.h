@@ -40,33 +40,169 @@
 extern "C" {
 #endif
 
+typedef void (*vcd_print_callback)( void* obj, const char *buffer, size_t len );
+
+
+/** Block of text in an extracted signal trace. Blocks are chained
+    together such that appending to a trace never moves the text
+    already written.
+ */
+typedef struct text_chunk_t {
+    struct text_chunk_t *next;
+    size_t length;
+    size_t capacity;
+    char text[];
+} text_chunk;
+
+
+/** A (timestamp, value) pair kept aside while filtering a trace.
+ */
+typedef struct change_record_t {
+    size_t timestamp;
+    size_t length;
+    size_t capacity;
+    char *value_change;
+} change_record;
+
+
+/** Copies *length* bytes of *value_change* and *timestamp* into *record*.
+    This function returns 0 on success and 1 if memory could not
+    be allocated.
+ */
+int set_change_record( change_record *record,
+    size_t timestamp, const char *value_change, size_t length );
+
+
 /** Buffer used to store an extracted signal trace.
+
+    When the trace is decimated, *bucket* is the pixel the last record
+    printed falls into, *bucket_changes* the number of value changes
+    seen in that pixel so far, *bucket_unknown* whether one of them set
+    a bit to x or z, and *last_change_record* the latest of those changes,
+    not printed yet.
+
+    A signal whose *name* contains '*' or '?' is a pattern that selects
+    the signals it matches (see insert_short_key). It never has a trace.
+
+    Names declared with the same identifier code share a single trace:
+    the first name captures the value changes, the others point to it
+    through *alias_of* and are chained from it through *next_alias*.
  */
 typedef struct signal_buf_t {
     struct signal_buf_t *next;
     const char *name;
+    bool is_pattern;
+    struct signal_buf_t *alias_of;
+    struct signal_buf_t *next_alias;
+    size_t position;
     bool not_first_record;
-    size_t initial_change_record_timestamp;
-    size_t initial_change_record_length;
-    char initial_change_record_value_change[BUFFER_SIZE];
-    char text[BUFFER_SIZE];
+    change_record initial_change_record;
+    size_t bucket;
+    size_t bucket_changes;
+    bool bucket_unknown;
+    change_record last_change_record;
+    text_chunk *text_head;
+    text_chunk *text_tail;
 } signal_buf;
 
-/** Insert a new *name*d signal into an alphabetically-ordered linked list.
+/** Insert a new *name*d signal at the front of a linked list, in constant
+    time. The list is put in order once the definitions have been parsed
+    (see remove_signal_patterns).
     This function returns a pointer to the head of the list.
  */
 signal_buf *insert_signal( signal_buf *head, char *name );
 
+/** Append *len* bytes of *text* at the end of the *timeline* trace.
+    This function returns 0 on success and 1 if memory could not
+    be allocated.
+ */
+int signal_buf_append( signal_buf *timeline, const char *text, size_t len );
+
+/** Prints the text accumulated in the *timeline* trace using
+    the *print* callback.
+ */
+void signal_buf_print( const signal_buf *timeline,
+    vcd_print_callback print, void *obj );
+
+
+/** Coalesces the fragments printed while parsing (a quote, a tab,
+    a character of an identifier code, ...) into blocks of up to
+    VCD_EMITTER_SIZE bytes before they reach *print*. Large spans,
+    like the text of a trace, are passed through without a copy.
+ */
+#define VCD_EMITTER_SIZE      (1 << 16)
+
+struct vcd_emitter_t {
+    vcd_print_callback print;
+    void *obj;
+    char *buffer;              /* allocated on the first print */
+    size_t length;
+};
+
+void vcd_emitter_init( struct vcd_emitter_t *emitter,
+    vcd_print_callback print, void *obj );
+
+/** The vcd_print_callback of an emitter *obj*.
+ */
+void vcd_emitter_print( void *obj, const char *buffer, size_t len );
+
+/** Passes the bytes buffered in *emitter* to its print callback.
+ */
+void vcd_emitter_flush( struct vcd_emitter_t *emitter );
+
+/** Frees the buffer of *emitter*. Bytes not flushed are lost.
+ */
+void vcd_emitter_destroy( struct vcd_emitter_t *emitter );
+
 
+/** Identifier codes which cannot be decoded to an index in the dense
+    table of a signal map (because they are too long) are kept sorted
+    in an array of entries.
+ */
 typedef struct signal_map_entry_t {
-    uint32_t key;
+    char *key;
+    size_t key_len;
     signal_buf *timeline;
 } signal_map_entry;
 
+/** Identifier codes which decode to an index past the dense table
+    of a signal map are kept in a hash table of codes.
+ */
+typedef struct signal_map_code_t {
+    size_t index;
+    signal_buf *timeline;
+} signal_map_code;
+
 
+/** Timelines for the signals we are interested in.
+
+    VCD identifier codes are made of printable characters '!' to '~'
+    and are decoded as base-94 integers such that looking up a timeline
+    for a value change is a single load in *timelines*. The table holds
+    a few slots per identifier code in the map, codes decoding past it
+    are hashed into *codes*.
+
+    While the header definitions are parsed, declared names are looked up
+    in *names*, an open-addressing hash table of the signals in *head*,
+    and only the signals in *patterns* are matched against them. Both
+    are built on the first call to insert_short_key, such that all
+    signals must be in *head* by then.
+ */
 typedef struct signal_map_t {
     signal_buf *head;
-    signal_map_entry entries[256];
+    signal_buf **timelines;
+    size_t timelines_size;
+    signal_map_entry *entries;
+    size_t entries_size;
+    signal_map_code *codes;
+    size_t codes_size;
+    size_t codes_capacity;
+    size_t nb_codes;           /* bounds the size of *timelines* */
+    signal_buf **names;
+    size_t names_size;
+    size_t names_capacity;
+    signal_buf **patterns;
+    size_t patterns_size;
 } signal_map;
 
 
@@ -81,17 +217,34 @@ void destroy_signal_map( signal_map *map );
 
 /** Insert the short key symbol used to represent a signal declared
     as *name* in the timeline.
+
+    When no signal is called *name*, but a pattern in *map* matches it,
+    a signal called *name* is added to *map*. In patterns, '?' matches
+    a character and '*' a run of characters within a scope, while '**'
+    also matches across scopes, i.e. "board/disp/" followed by '**'
+    selects every signal under board/disp.
  */
 int insert_short_key( signal_map *map, const char *name, const char *key );
 
+/** Removes the patterns from the signals in *map*, once all signal
+    declarations have gone through insert_short_key. On return, *head*,
+    including the signals matched by patterns, is sorted by name
+    in reverse alphabetical order.
+ */
+void remove_signal_patterns( signal_map *map );
 
-/** Find the timeline associated to a short key.
+
+/** Returns the timeline associated to the short key *key*, creating it
+    if necessary. The name of a timeline created this way is *key*.
  */
-signal_buf* find_timeline( const signal_map *map,
+signal_buf* insert_timeline( signal_map *map,
     const char *key, size_t key_len );
 
 
-typedef void (*vcd_print_callback)( void* obj, const char *buffer, size_t len );
+/** Find the timeline associated to a short key.
+ */
+signal_buf* find_timeline( const signal_map *map,
+    const char *key, size_t key_len );
 
 
 /**
@@ -113,7 +266,12 @@ void header_and_definitions( FILE *from, signal_map *map,
    such that each timestamp is in [*start_time*, *end_time[.
 
    *resolution* indicates a timestamp per pixel ratio. This function will skip
-   records in the VCD file that would display to the same pixel.
+   records in the VCD file that would display to the same pixel. For each
+   pixel, only the first and the last value changes are kept. When more
+   than two changes were folded into a pixel, the last record carries
+   the number of changes in the pixel as a third element, such that
+   glitches are still visible (ex: [120, "0", 5]), followed by true when
+   one of those changes set a bit to x or z (ex: [120, "0", 5, true]).
 
    ex:
    { ".board.clock": [
@@ -165,6 +323,61 @@ typedef enum {
     value_change_real_vcd_token
 } vcd_token;
 
+#define VCD_TOKEN_TYPES   (value_change_real_vcd_token + 1)
+
+/** Returns the name of *tok* as printed in statistics (ex: "sim_time").
+ */
+const char *
+vcd_token_name( vcd_token tok );
+
+
+/** Statistics collected while a VCD file goes through a trace filter
+    (see trace_filter_enable_stats).
+
+    Times are in seconds and do not overlap: *tokenize_time* excludes
+    the parser actions, which exclude the print callbacks. *print_time*
+    is spent in the print callback of the trace, which receives blocks
+    coalesced by its emitter; copying into the emitter counts as parsing.
+    A token broken over two input buffers is counted once in *tokens*.
+    A value change is matched when it belongs to a selected signal,
+    and skipped otherwise.
+
+    *signal_bytes* is the memory held by the traces and change records
+    of the signals when the trace is flushed, i.e. before they are
+    printed. It does not include the VCD_EMITTER_SIZE bytes of the
+    emitter, nor the change logs of a parallel tokenizer.
+ */
+struct vcd_stats_t {
+    size_t bytes;
+    size_t tokens[VCD_TOKEN_TYPES];
+    size_t broken_tokens;
+    size_t value_changes_matched;
+    size_t value_changes_skipped;
+    double tokenize_time;
+    double parse_time;
+    double print_time;
+    size_t output_bytes;
+    size_t signal_bytes;
+    vcd_print_callback print;  /* timed print callback */
+    void *obj;
+};
+
+/** Returns the bytes of memory held by the signals in *map*.
+ */
+size_t
+signal_map_bytes( const signal_map *map );
+
+/** Prints *stats* as a JSON object using the *print* callback.
+ */
+void
+vcd_stats_print( const struct vcd_stats_t *stats,
+    vcd_print_callback print, void *obj );
+
+/** Returns a monotonic time in seconds.
+ */
+double
+vcd_stats_clock( void );
+
 
 struct definitions_t {
     signal_map *map;
@@ -174,25 +387,148 @@ struct definitions_t {
     void *obj;
     int scope_depth;
     char scope_prefix[FILENAME_MAX];
+    struct definitions_t *next;   /* binds the same declarations into
+                                     the maps of batched queries. */
+    struct hierarchy_builder_t *hierarchy; /* records the declarations
+                                     in a hierarchy cache when not NULL. */
 };
 
 
+/** Value change of the signal at *position* in a signal map.
+ */
+struct change_event_t {
+    size_t position;
+    size_t timestamp;
+    const char *value_change;
+    size_t length;
+};
+
+
+/** Value changes recorded while tokenizing a chunk of a VCD file that
+    stays in memory (*value_change* points into it) such that they can
+    be replayed later, in order, through a single simulation.
+
+    *before* holds the last change before the time window for each signal
+    that changed, *slots* maps the position of a signal to 1 + its index
+    in *before* (or 0). *events* holds the changes in the time window.
+ */
+struct change_log_t {
+    struct change_event_t *before;
+    size_t before_size;
+    size_t before_capacity;
+    struct change_event_t *events;
+    size_t events_size;
+    size_t events_capacity;
+    size_t *slots;
+};
+
+
+/** Layout of the filtered value changes.
+
+    *json_trace_format* buffers the value changes of each signal until
+    the end of the trace and writes a single JSON object.
+    *ndjson_trace_format* writes one JSON record per line as soon as
+    a value change is parsed, in time order:
+        {"t": 950, "name": "board/clock", "v": "0"}
+    A signal which does not change at the start of the time window
+    first gets a record of its value before the window, like in
+    *json_trace_format*. Records of decimated signals are ordered by pixel and carry
+    the number of value changes in the pixel as "n", and "x": true when
+    one of them set a bit to x or z.
+    *bin_trace_format* buffers value changes like *json_trace_format*
+    and writes them in the compact layout described in src/binary.c:
+    varint timestamp deltas and a per-signal dictionary of values,
+    with 4-state vectors packed 2 bits per state.
+ */
+typedef enum {
+    json_trace_format = 0,
+    ndjson_trace_format,
+    bin_trace_format
+} trace_format;
+
+
 struct simulation_t {
     const signal_map *map;    /* identifier codes we are interested in. */
     size_t current_timestamp;
     size_t start_time;         /* [start_time, end_time[ period we are   */
     size_t end_time;           /* interested in. */
     size_t resolution;
+    bool done;                 /* simulation time reached end_time. */
+    struct change_log_t *log;  /* records value changes instead of
+                                  filtering them when not NULL. */
+    trace_format format;
+    vcd_print_callback print;  /* streamed records are written here. */
+    void *obj;
+    bool window_open;          /* a record was streamed in the window. */
+    signal_buf *held;          /* records streamed at start_time, held
+                                  until the simulation time moves past it. */
+    size_t bucket;             /* pixel of the last streamed record. */
+    struct simulation_t *next; /* batched queries filtering the same
+                                  value changes. */
 };
 
 
+/** Sidecar index of a VCD file being built.
+
+    Every *interval* bytes, at the next simulation time, the index records
+    a checkpoint: the offset of the '#' marker in the VCD file, and the last
+    value change of every identifier code seen so far.
+ */
+struct time_index_t {
+    FILE *to;
+    size_t interval;
+    size_t next_checkpoint;
+    bool has_timestamp;
+    size_t current_timestamp;
+    signal_map codes;
+};
+
+
+/** Multi-resolution summaries of a VCD file being built.
+
+    Value changes are folded per identifier code into buckets of
+    2^LOD_MIN_LEVEL timestamps. Closed buckets are gathered in *run*,
+    then written to *spill* sorted by code. Coarser levels of the pyramid
+    are derived from those when the summaries are written (see src/lod.c).
+ */
+struct lod_builder_t {
+    size_t header_end;         /* offset right after $enddefinitions */
+    size_t current_timestamp;
+    size_t last_timestamp;
+    signal_map codes;          /* position indexes *states* */
+    struct lod_code_t *states;
+    size_t nb_states;
+    size_t states_capacity;
+    char *run;                 /* closed buckets not written yet */
+    size_t run_size;
+    size_t run_capacity;
+    size_t run_buckets;
+    FILE *spill;               /* temporary file of sorted runs */
+    uint64_t spill_size;
+    uint64_t *runs;            /* end offset of each run in *spill* */
+    size_t nb_runs;
+    size_t runs_capacity;
+    bool err;
+};
+
+
+/** State of the parser between two tokens. *identifier_code* and
+    *broken_token* (a token split over two input buffers) grow as needed,
+    such that vectors of any width can be parsed.
+ */
 struct parser_t {
-    char identifier_code[BUFFER_SIZE];
-    char broken_token[BUFFER_SIZE];
+    char *identifier_code;
+    size_t identifier_code_capacity;
+    char *broken_token;
+    size_t broken_token_capacity;
     size_t broken_token_len;
     size_t broken_token_mark;
+    size_t broken_token_offset;
     struct definitions_t *defs;
     struct simulation_t *sim;
+    struct time_index_t *index;
+    struct lod_builder_t *lod;
+    struct vcd_stats_t *stats;  /* counts tokens when not NULL. */
     void *state;
 };
 
@@ -202,14 +538,226 @@ struct tokenizer_t {
     vcd_token tok;
     vcd_token last_significant_tok;
     size_t line_num;
+    size_t offset;            /* position of the next buffer in the file */
     struct parser_t parser;
 };
 
+void
+init_tokenizer( struct tokenizer_t *tokenizer,
+    struct definitions_t *defs, struct simulation_t *sim );
+
+/** Releases the memory held by *tokenizer* once parsing is done.
+ */
+void
+destroy_tokenizer( struct tokenizer_t *tokenizer );
+
+size_t
+tokenize_header_and_definitions( struct tokenizer_t *tokenizer,
+    const char *buffer, size_t buffer_length );
+
+/** Tokenizes *buffer* through the tokenizer *obj*. This is
+    the vcd_write_callback of read_input for a struct tokenizer_t.
+ */
+size_t
+write_tokens( void *obj, const char *buffer, size_t length );
+
+/** Same as write_tokens for a struct trace_filter_t (see trace_filter_write).
+ */
+size_t
+write_trace( void *obj, const char *buffer, size_t length );
+
+/** Same as write_tokens for a struct trace_batch_t (see trace_batch_write).
+ */
+size_t
+write_batch( void *obj, const char *buffer, size_t length );
+
+/** Returns a pointer to the first whitespace character in [*first*, *last*[,
+    or *last* if there are none.
+ */
+const char *
+scan_space( const char *first, const char *last );
+
+/** Returns a pointer to the first character in [*first*, *last*[ that is
+    not a whitespace, or *last* if there are none.
+ */
+const char *
+scan_non_space( const char *first, const char *last );
+
+/** Returns a pointer to the first character in [*first*, *last*[ that is
+    not one of the binary vector digits '0', '1', 'x', 'X', 'z', 'Z',
+    or *last* if there are none.
+ */
+const char *
+scan_binary_digits( const char *first, const char *last );
+
+/** Maps the regular file *fd* in memory for sequential access.
+    This function returns NULL if *fd* cannot be mapped.
+ */
+const char *
+map_input( int fd, size_t *size );
+
+void
+unmap_input( const char *data, size_t size );
+
+/** Identifies the VCD file an index, summaries or hierarchy cache was
+    written for. A file rewritten within the same second, or replaced
+    by another file of the same size, gets a different stamp.
+ */
+struct vcd_file_stamp_t {
+    uint64_t size;
+    uint64_t mtime;            /* seconds */
+    uint64_t mtime_nsec;
+    uint64_t ino;
+    uint64_t dev;
+};
+
+/** Fills *stamp* with the current state of the open file *fd*.
+    This function returns 0 on success and 1 on error.
+ */
+int
+vcd_file_stamp( int fd, struct vcd_file_stamp_t *stamp );
+
+/** Returns true when the file *fd* still matches *stamp*.
+ */
+bool
+vcd_file_stamp_matches( int fd, const struct vcd_file_stamp_t *stamp );
+
+/** Compression of a VCD stream, detected from its first bytes.
+ */
+typedef enum {
+    no_compression,
+    gzip_compression,
+    zstd_compression
+} vcd_compression;
+
+/** Callback fed with the bytes of a VCD stream. It returns the number of
+    bytes accepted, less than *len* when it does not need more input.
+ */
+typedef size_t (*vcd_write_callback)( void* obj, const char *buffer,
+    size_t len );
+
+vcd_compression
+detect_compression( const char *buffer, size_t length );
+
+/** Returns the compression of the file *fd* without moving its offset,
+    or no_compression if *fd* cannot be read at an offset (ex: a pipe).
+ */
+vcd_compression
+file_compression( int fd );
+
+/** Default size of the buffers filled ahead of the tokenizer.
+ */
+#define READ_AHEAD_BUFFER_SIZE  (1 << 20)
+
+/** Feeds the VCD stream *from* to *write* until the end of input
+    or *write* accepts less than it is given. The input is read
+    on a separate thread, into *buffer_size* bytes buffers (0 for
+    READ_AHEAD_BUFFER_SIZE), while *write* tokenizes the previous buffer.
+    Streams compressed with gzip (or zstd when libvcd is built with zstd=1)
+    are decompressed on that thread.
+
+    This function returns 0 on success and 1 on error.
+ */
+int
+read_input( FILE *from, size_t buffer_size,
+    vcd_write_callback write, void *obj );
+
+/** Same as read_input for the *length* bytes at *offset* in the file
+    *from* (SIZE_MAX for the rest of the file). The bytes are passed
+    as they are, without detecting compression.
+ */
+int
+read_input_range( FILE *from, size_t offset, size_t length,
+    size_t buffer_size, vcd_write_callback write, void *obj );
+
+void
+hierarchy_enter_scope( struct hierarchy_builder_t *hierarchy,
+    const char *name, size_t length );
+
+void
+hierarchy_exit_scope( struct hierarchy_builder_t *hierarchy );
+
+void
+hierarchy_var_type( struct hierarchy_builder_t *hierarchy,
+    const char *type, size_t length );
+
+void
+hierarchy_var_width( struct hierarchy_builder_t *hierarchy,
+    const char *width, size_t length );
+
+/** Records the var *path* (full name, as selected in queries) declared
+    with identifier code *code* in the current scope of *hierarchy*.
+ */
+void
+hierarchy_add_var( struct hierarchy_builder_t *hierarchy,
+    const char *path, const char *code );
+
+void
+hierarchy_enddefinitions( struct hierarchy_builder_t *hierarchy,
+    size_t offset );
+
+/** Filters the value changes in *log* through *sim*. *timelines* maps
+    the position of a signal to its timeline.
+ */
+void
+replay_change_log( struct simulation_t *sim, signal_buf **timelines,
+    const struct change_log_t *log );
+
+void
+time_index_timestamp( struct time_index_t *index,
+    size_t timestamp, size_t offset );
+
+void
+time_index_value_change( struct time_index_t *index,
+    const char *buffer, size_t start, size_t last, size_t mark );
+
+void
+lod_timestamp( struct lod_builder_t *lod, size_t timestamp );
+
+/** Folds the change of the identifier code in [*mark*, *last*[ to
+    the value in [*start*, *mark*[ into the summaries of *lod*.
+ */
+void
+lod_value_change( struct lod_builder_t *lod,
+    const char *buffer, size_t start, size_t last, size_t mark );
+
+/** Adds a pixel of *timeline* to the trace being filtered by *sim*
+    as if *changes* value changes, the first at *first_timestamp*
+    and the last at *last_timestamp*, had been parsed. *unknown* is true
+    when one of those changes set a bit to x or z.
+ */
+void
+filter_value_change_summary( struct simulation_t *sim, signal_buf *timeline,
+    size_t first_timestamp, const char *first_value, size_t first_length,
+    size_t last_timestamp, const char *last_value, size_t last_length,
+    size_t changes, bool unknown );
+
+/** Returns true when *value_change* sets a bit to x or z.
+ */
+bool
+value_change_is_unknown( const char *value_change, size_t length );
+
+/** Appends a value change to *timeline* in the intermediate layout
+    read back by binary_trace_print.
+ */
+int
+binary_record_append( signal_buf *timeline, size_t timestamp,
+    const char *value_change, size_t length, size_t changes, bool unknown );
+
+/** Writes the timelines of the signals in *sim* in binary layout.
+ */
+void
+binary_trace_print( const struct simulation_t *sim,
+    vcd_print_callback print, void *obj );
+
 typedef struct trace_filter_t {
     struct signal_map_t map;
     struct definitions_t defs;
     struct simulation_t sim;
     struct tokenizer_t tokenizer;
+    struct vcd_emitter_t emitter;  /* in front of the print callback */
+    size_t definitions_end;    /* offset right after $enddefinitions once
+                                  loaded from a hierarchy cache, else 0. */
 } trace_filter;
 
 void
@@ -217,13 +765,279 @@ trace_filter_init( struct trace_filter_t *trace,
     size_t start_time, size_t end_time, size_t resolution,
     vcd_print_callback print, void *obj );
 
+/** Same as trace_filter_init except the filtered value changes are
+    written as *format*. The header definitions are only written with
+    *json_trace_format*. With *ndjson_trace_format*, value changes are
+    passed to *print* while the VCD file is tokenized instead of
+    in trace_filter_flush.
+
+    Output reaches *print* in large blocks (see vcd_emitter_t), the last
+    one in trace_filter_flush. With *ndjson_trace_format*, the records
+    of each trace_filter_write reach *print* before it returns.
+ */
+void
+trace_filter_init_format( struct trace_filter_t *trace,
+    size_t start_time, size_t end_time, size_t resolution,
+    trace_format format, vcd_print_callback print, void *obj );
+
 void
 trace_filter_flush( struct trace_filter_t *trace );
 
+/** Collects statistics about *trace* into *stats* from now on. It must
+    be called before anything is written to *trace*, and *stats* must
+    live until trace_filter_flush has returned, at which point
+    the statistics are complete. Counting tokens and timing the parser
+    and print callbacks slows parsing down, so it is off by default.
+ */
+void
+trace_filter_enable_stats( struct trace_filter_t *trace,
+    struct vcd_stats_t *stats );
+
+/** Tokenizes *buffer_length* bytes of a VCD file through *trace*.
+
+    This function returns the number of bytes consumed. It returns less
+    than *buffer_length* once the simulation time reaches the end of
+    the time window of *trace*, at which point callers should stop
+    feeding the rest of the VCD file.
+ */
 size_t
 trace_filter_write( struct trace_filter_t *trace,
     const char *buffer, size_t buffer_length );
 
+/** Maps the file opened as *fd* in memory and tokenizes it in place
+    as a single buffer, i.e. without per-chunk reads or reassembly
+    of tokens across chunks.
+
+    This function returns 0 on success and 1 if *fd* cannot be mapped
+    (ex: a pipe), in which case nothing was written to *trace*.
+ */
+int
+trace_filter_write_mapped( struct trace_filter_t *trace, int fd );
+
+/** Same as trace_filter_write_mapped except value changes after the header
+    definitions are tokenized on *nb_threads* threads, each working on
+    a chunk of the file that starts at a simulation time. The output
+    is identical to tokenizing the whole file on a single thread.
+
+    This function returns 0 on success and 1 if *fd* cannot be mapped,
+    in which case nothing was written to *trace*.
+ */
+int
+trace_filter_write_parallel( struct trace_filter_t *trace,
+    int fd, int nb_threads );
+
+/** Default number of bytes between checkpoints in a sidecar index.
+ */
+#define TIME_INDEX_INTERVAL   (1 << 24)
+
+/** Writes a sidecar index of the VCD file *from* into *to*. The index
+    records a checkpoint about every *interval* bytes of *from*.
+
+    This function returns 0 on success and 1 on error.
+ */
+int
+time_index_build( FILE *from, FILE *to, size_t interval );
+
+/** Filters the VCD file *from* through *trace*, reading only the header
+    definitions and the value changes after the last checkpoint in *index*
+    before the start of the time window of *trace*.
+
+    This function returns 0 on success and 1 if *index* is not an index
+    of *from* (or is out-of-date), in which case nothing was written
+    to *trace*.
+ */
+int
+trace_filter_write_indexed( struct trace_filter_t *trace,
+    FILE *from, FILE *index );
+
+/** A checkpoint of a sidecar index, loaded in memory.
+ */
+struct time_checkpoint_t {
+    size_t offset;             /* of the '#' marker in the VCD file */
+    size_t timestamp;
+    size_t snapshot;           /* offset of the value changes in the index */
+    size_t length;             /* of the value changes */
+};
+
+/** Loads the checkpoints of the sidecar index *index* of the VCD file
+    *from* into *checkpoints*, to be freed by the caller, such that
+    queries on the same VCD file do not read them again.
+
+    This function returns 0 on success and 1 if *index* is not an index
+    of *from* (or is out-of-date).
+ */
+int
+time_index_load( FILE *from, FILE *index,
+    struct time_checkpoint_t **checkpoints, size_t *nb_checkpoints );
+
+/** Same as trace_filter_write_indexed with the *checkpoints* of *index*
+    loaded by time_index_load.
+ */
+int
+trace_filter_write_checkpoint( struct trace_filter_t *trace,
+    FILE *from, FILE *index,
+    const struct time_checkpoint_t *checkpoints, size_t nb_checkpoints );
+
+/** Finest level of the summaries in a level-of-detail file: a bucket
+    spans 2^LOD_MIN_LEVEL timestamps.
+ */
+#define LOD_MIN_LEVEL   4
+
+/** Writes the level-of-detail file of the VCD file *from* into *to*.
+    For each identifier code, it holds a pyramid of buckets spanning
+    power-of-two time ranges, each with the number of value changes
+    and the first and last values. Only the levels that fold the value
+    changes at least by half are stored.
+
+    This function returns 0 on success and 1 on error.
+ */
+int
+lod_build( FILE *from, FILE *to );
+
+/** Writes the trace of the VCD file *from* into *trace* from the
+    summaries in *lod* instead of the value changes. The cost depends
+    on the number of pixels requested rather than on the activity
+    in the VCD file.
+
+    The summaries only apply when the start, resolution and end
+    (unless past the last simulation time) of *trace* are multiples
+    of 2^LOD_MIN_LEVEL, and records are not streamed. When a selected
+    signal has no level as fine as the pixels, the value changes are
+    read from *from* instead.
+
+    This function returns 0 on success and 1 if the summaries do not
+    apply or *lod* is not the level-of-detail file of *from* (or is
+    out-of-date), in which case nothing was written to *trace*.
+ */
+int
+trace_filter_write_lod( struct trace_filter_t *trace,
+    FILE *from, FILE *lod );
+
+/** Writes the hierarchy cache of the VCD file *from* into *to*: the header
+    definitions as printed by header_and_definitions, and the tree of
+    scopes and vars (with their type, width and identifier code) sorted
+    by name such that signals are looked up without tokenizing
+    the definitions again.
+
+    This function returns 0 on success and 1 on error.
+ */
+int
+hierarchy_build( FILE *from, FILE *to );
+
+/** Writes the header definitions of the VCD file *from* into *trace*
+    from the hierarchy cache *cache* and binds the signals selected
+    in *trace* to their identifier codes. On return, *from* is positioned
+    right after the definitions, such that the value changes can be
+    written to *trace* from there (see trace_filter_write_mapped,
+    trace_filter_write_parallel, trace_filter_write_indexed
+    and trace_filter_write_lod).
+
+    This function returns 0 on success and 1 if *cache* is not
+    the hierarchy cache of *from* (or is out-of-date), in which case
+    nothing was written to *trace*.
+ */
+int
+trace_filter_load_hierarchy( struct trace_filter_t *trace,
+    FILE *from, FILE *cache );
+
+/** A hierarchy cache mapped in memory.
+ */
+struct hierarchy_t;
+
+/** Maps the hierarchy cache *cache* of the VCD file *from* in memory
+    until hierarchy_close, such that queries on the same VCD file
+    share it. *cache* can be closed right away.
+
+    This function returns NULL if *cache* is not the hierarchy cache
+    of *from* (or is out-of-date).
+ */
+struct hierarchy_t *
+hierarchy_open( FILE *from, FILE *cache );
+
+void
+hierarchy_close( struct hierarchy_t *hierarchy );
+
+/** Same as trace_filter_load_hierarchy with a hierarchy cache mapped
+    by hierarchy_open, except *from* is left where it is.
+ */
+void
+trace_filter_bind_hierarchy( struct trace_filter_t *trace,
+    const struct hierarchy_t *hierarchy );
+
+/** Answers requests for traces of the VCD file *from* on the Unix
+    domain socket *socket_path*, one request per connection. The file
+    is indexed once, and its hierarchy cache *cache* mapped (or built
+    when *cache* is NULL or out-of-date), such that each request only
+    tokenizes the value changes around its time window. The protocol
+    is described at the top of src/server.c.
+
+    This function only returns on error, with 1.
+ */
+int
+trace_serve( const char *socket_path, FILE *from, FILE *cache );
+
+/** A query in a batch: the signals of *map* over [start_time, end_time[
+    at *resolution*, printed under *id* in the results of the batch.
+ */
+struct trace_query_t {
+    struct trace_query_t *next;
+    char *id;
+    signal_map map;
+    struct definitions_t defs;
+    struct simulation_t sim;
+};
+
+
+/** Runs many queries in a single pass over a VCD file. The results are
+    written as a JSON object keyed by query id, each value laid out as
+    the value changes in the output of a trace_filter_t.
+ */
+typedef struct trace_batch_t {
+    struct trace_query_t *head;
+    struct trace_query_t *tail;
+    struct tokenizer_t tokenizer;
+    bool started;
+    vcd_print_callback print;
+    void *obj;
+} trace_batch;
+
+void
+trace_batch_init( struct trace_batch_t *batch,
+    vcd_print_callback print, void *obj );
+
+/** Adds a query to *batch* and returns it, or NULL if memory could not
+    be allocated. Signals are selected by inserting them in the map
+    of the query returned. Queries must all be added before the first
+    call to trace_batch_write.
+ */
+struct trace_query_t *
+trace_batch_add_query( struct trace_batch_t *batch, const char *id,
+    size_t start_time, size_t end_time, size_t resolution );
+
+/** Adds the queries read from *from*, one per line, as whitespace
+    separated fields:
+        id start_time end_time resolution name [name ...]
+    Empty lines and lines starting with '#' are skipped.
+
+    This function returns 0 on success and 1 on error.
+ */
+int
+trace_batch_read_queries( struct trace_batch_t *batch, FILE *from );
+
+/** Tokenizes *buffer_length* bytes of a VCD file through all queries
+    in *batch*. Like trace_filter_write, it returns less than
+    *buffer_length* once the time window of every query is closed.
+ */
+size_t
+trace_batch_write( struct trace_batch_t *batch,
+    const char *buffer, size_t buffer_length );
+
+/** Prints the results of all queries in *batch* and frees them.
+    Query ids are escaped as JSON strings.
+ */
+void
+trace_batch_flush( struct trace_batch_t *batch );
+
 #ifdef __cplusplus
 }
 #endif
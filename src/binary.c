@@ -0,0 +1,405 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Binary layout of a filtered trace (all integers are unsigned LEB128
+   varints unless noted otherwise):
+
+       "VCDB" (4 bytes), version (1 byte, currently 2)
+       start_time, end_time, resolution
+       number of signals
+       for each signal, in the same order as the JSON output:
+           name length, name
+           number of values in the dictionary
+           for each value:
+               kind (1 byte)
+               kind 0 (4-state): number of states, then the states packed
+                   4 per byte, first state in the high bits, 0, 1, x
+                   and z encoded as 0, 1, 2 and 3.
+               kind 1 (text): length, characters (ex: real values, and
+                   vectors with an uppercase 'X' or 'Z', such that
+                   the case in the VCD file is preserved)
+           number of records
+           for each record:
+               timestamp minus the timestamp of the previous record
+                   of the signal (or minus 0 for the first record)
+               (index in the dictionary << 1) | has number of changes
+               (number of changes in the pixel << 1) | one of them set
+                   a bit to x or z, if flagged above
+
+   While the VCD file is tokenized, records are appended to the signal
+   timeline as (timestamp, changes << 1 | unknown, length, value). The dictionaries
+   are built once all value changes are known, in binary_trace_print. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "libvcd.h"
+
+#define BINARY_TRACE_MAGIC      "VCDB"
+#define BINARY_TRACE_VERSION    2
+
+#define FOUR_STATE_VALUE        0
+#define TEXT_VALUE              1
+
+
+/* Bytes are passed straight to *print*, which coalesces them (see
+   vcd_emitter_t). */
+struct binary_writer_t {
+    vcd_print_callback print;
+    void *obj;
+};
+
+
+/* Reads back the records appended to a timeline. */
+struct record_reader_t {
+    const text_chunk *chunk;
+    size_t pos;
+};
+
+
+struct dict_entry_t {
+    char *value;
+    size_t length;
+    size_t index;
+};
+
+
+struct value_dict_t {
+    struct dict_entry_t *entries;
+    size_t capacity;            /* power of 2 */
+    size_t size;
+    struct dict_entry_t **ordered;
+};
+
+
+static size_t
+encode_varint( unsigned char *buffer, size_t value )
+{
+    size_t len = 0;
+    while( value >= 0x80 ) {
+        buffer[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    buffer[len++] = value;
+    return len;
+}
+
+
+static void
+put_bytes( struct binary_writer_t *writer, const void *bytes, size_t len )
+{
+    writer->print(writer->obj, bytes, len);
+}
+
+
+static void
+put_varint( struct binary_writer_t *writer, size_t value )
+{
+    unsigned char varint[16];
+    put_bytes(writer, varint, encode_varint(varint, value));
+}
+
+
+static bool
+read_bytes( struct record_reader_t *reader, char *bytes, size_t len )
+{
+    while( len > 0 ) {
+        if( !reader->chunk ) return false;
+        size_t avail = reader->chunk->length - reader->pos;
+        size_t count = len < avail ? len : avail;
+        memcpy(bytes, &reader->chunk->text[reader->pos], count);
+        bytes += count;
+        len -= count;
+        reader->pos += count;
+        if( reader->pos == reader->chunk->length ) {
+            reader->chunk = reader->chunk->next;
+            reader->pos = 0;
+        }
+    }
+    return true;
+}
+
+
+static bool
+read_varint( struct record_reader_t *reader, size_t *value )
+{
+    unsigned char byte;
+    int shift = 0;
+    *value = 0;
+    do {
+        if( !read_bytes(reader, (char *)&byte, 1) ) return false;
+        *value |= (size_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while( byte & 0x80 );
+    return true;
+}
+
+
+/* Reads the next record of a timeline into *value*, which is grown
+   as necessary. */
+static bool
+read_record( struct record_reader_t *reader, size_t *timestamp,
+    size_t *changes, char **value, size_t *length, size_t *capacity )
+{
+    if( !read_varint(reader, timestamp)
+        || !read_varint(reader, changes)
+        || !read_varint(reader, length) ) {
+        return false;
+    }
+    if( *length >= *capacity ) {
+        size_t new_capacity = *capacity > 0 ? *capacity : 64;
+        while( new_capacity <= *length ) new_capacity *= 2;
+        char *new_value = realloc(*value, new_capacity);
+        if( !new_value ) {
+            fprintf(stderr, "error: unable to allocate %zu bytes"\
+                " for a value change\n", new_capacity);
+            return false;
+        }
+        *value = new_value;
+        *capacity = new_capacity;
+    }
+    return read_bytes(reader, *value, *length);
+}
+
+
+int
+binary_record_append( signal_buf *timeline, size_t timestamp,
+    const char *value_change, size_t length, size_t changes, bool unknown )
+{
+    unsigned char header[48];
+    size_t len = encode_varint(header, timestamp);
+    len += encode_varint(&header[len], (changes << 1) | unknown);
+    len += encode_varint(&header[len], length);
+    if( signal_buf_append(timeline, (const char *)header, len) != 0 ) {
+        return 1;
+    }
+    return signal_buf_append(timeline, value_change, length);
+}
+
+
+static size_t
+hash_value( const char *value, size_t length )
+{
+    /* FNV-1a */
+    size_t hash = 2166136261u;
+    for( size_t i = 0; i < length; ++i ) {
+        hash = (hash ^ (unsigned char)value[i]) * 16777619u;
+    }
+    return hash;
+}
+
+
+static void
+destroy_value_dict( struct value_dict_t *dict )
+{
+    for( size_t i = 0; i < dict->capacity; ++i ) {
+        free(dict->entries[i].value);
+    }
+    free(dict->entries);
+    free(dict->ordered);
+    memset(dict, 0, sizeof(struct value_dict_t));
+}
+
+
+static int
+grow_value_dict( struct value_dict_t *dict )
+{
+    struct value_dict_t grown;
+    grown.capacity = dict->capacity > 0 ? 2 * dict->capacity : 16;
+    grown.size = dict->size;
+    grown.entries = calloc(grown.capacity, sizeof(struct dict_entry_t));
+    grown.ordered = malloc(grown.capacity * sizeof(struct dict_entry_t *));
+    if( !grown.entries || !grown.ordered ) {
+        fprintf(stderr, "error: unable to allocate value dictionary\n");
+        free(grown.entries);
+        free(grown.ordered);
+        return 1;
+    }
+    for( size_t i = 0; i < dict->capacity; ++i ) {
+        struct dict_entry_t *entry = &dict->entries[i];
+        if( !entry->value ) continue;
+        size_t slot = hash_value(entry->value, entry->length)
+            & (grown.capacity - 1);
+        while( grown.entries[slot].value ) {
+            slot = (slot + 1) & (grown.capacity - 1);
+        }
+        grown.entries[slot] = *entry;
+        grown.ordered[entry->index] = &grown.entries[slot];
+    }
+    free(dict->entries);
+    free(dict->ordered);
+    *dict = grown;
+    return 0;
+}
+
+
+/* Returns the index of *value* in *dict*, adding it when it is not
+   there yet, or (size_t)-1 on allocation failure. */
+static size_t
+find_or_insert_value( struct value_dict_t *dict,
+    const char *value, size_t length )
+{
+    if( 2 * (dict->size + 1) > dict->capacity ) {
+        if( grow_value_dict(dict) != 0 ) return (size_t)-1;
+    }
+    size_t slot = hash_value(value, length) & (dict->capacity - 1);
+    while( dict->entries[slot].value ) {
+        struct dict_entry_t *entry = &dict->entries[slot];
+        if( entry->length == length
+            && memcmp(entry->value, value, length) == 0 ) {
+            return entry->index;
+        }
+        slot = (slot + 1) & (dict->capacity - 1);
+    }
+    struct dict_entry_t *entry = &dict->entries[slot];
+    entry->value = malloc(length + 1);
+    if( !entry->value ) {
+        fprintf(stderr, "error: unable to allocate value dictionary\n");
+        return (size_t)-1;
+    }
+    memcpy(entry->value, value, length);
+    entry->value[length] = '\0';
+    entry->length = length;
+    entry->index = dict->size++;
+    dict->ordered[entry->index] = entry;
+    return entry->index;
+}
+
+
+static int
+four_state( char c )
+{
+    switch( c ) {
+    case '0': return 0;
+    case '1': return 1;
+    case 'x': return 2;
+    case 'z': return 3;
+    default: break;
+    }
+    return -1;
+}
+
+
+static void
+put_value( struct binary_writer_t *writer, const char *value, size_t length )
+{
+    size_t i;
+    for( i = 0; i < length; ++i ) {
+        if( four_state(value[i]) < 0 ) break;
+    }
+    if( i < length ) {
+        unsigned char kind = TEXT_VALUE;
+        put_bytes(writer, &kind, 1);
+        put_varint(writer, length);
+        put_bytes(writer, value, length);
+        return;
+    }
+    unsigned char kind = FOUR_STATE_VALUE;
+    put_bytes(writer, &kind, 1);
+    put_varint(writer, length);
+    for( i = 0; i < length; i += 4 ) {
+        unsigned char packed = 0;
+        for( size_t j = 0; j < 4; ++j ) {
+            packed <<= 2;
+            if( i + j < length ) packed |= four_state(value[i + j]);
+        }
+        put_bytes(writer, &packed, 1);
+    }
+}
+
+
+static void
+print_binary_timeline( struct binary_writer_t *writer,
+    const signal_buf *timeline, char **value, size_t *capacity )
+{
+    struct value_dict_t dict;
+    struct record_reader_t reader;
+    size_t timestamp, changes, length, nb_records = 0;
+    memset(&dict, 0, sizeof(dict));
+
+    /* Aliases of an identifier code write the records of its trace. */
+    const signal_buf *data = timeline->alias_of ? timeline->alias_of : timeline;
+
+    /* First pass builds the dictionary, the second writes the records. */
+    reader.chunk = data->text_head;
+    reader.pos = 0;
+    while( read_record(&reader, &timestamp, &changes,
+               value, &length, capacity) ) {
+        if( find_or_insert_value(&dict, *value, length) == (size_t)-1 ) {
+            break;
+        }
+        ++nb_records;
+    }
+
+    size_t name_length = strlen(timeline->name);
+    put_varint(writer, name_length);
+    put_bytes(writer, timeline->name, name_length);
+    put_varint(writer, dict.size);
+    for( size_t i = 0; i < dict.size; ++i ) {
+        put_value(writer, dict.ordered[i]->value, dict.ordered[i]->length);
+    }
+    put_varint(writer, nb_records);
+
+    size_t prev_timestamp = 0;
+    reader.chunk = data->text_head;
+    reader.pos = 0;
+    for( size_t i = 0; i < nb_records; ++i ) {
+        read_record(&reader, &timestamp, &changes, value, &length, capacity);
+        size_t index = find_or_insert_value(&dict, *value, length);
+        put_varint(writer, timestamp - prev_timestamp);
+        put_varint(writer, (index << 1) | (changes > 0));
+        if( changes > 0 ) put_varint(writer, changes);
+        prev_timestamp = timestamp;
+    }
+    destroy_value_dict(&dict);
+}
+
+
+void
+binary_trace_print( const struct simulation_t *sim,
+    vcd_print_callback print, void *obj )
+{
+    struct binary_writer_t writer_data = { print, obj };
+    struct binary_writer_t *writer = &writer_data;
+
+    unsigned char version = BINARY_TRACE_VERSION;
+    put_bytes(writer, BINARY_TRACE_MAGIC, 4);
+    put_bytes(writer, &version, 1);
+    put_varint(writer, sim->start_time);
+    put_varint(writer, sim->end_time);
+    put_varint(writer, sim->resolution);
+
+    size_t nb_signals = 0;
+    const signal_buf *curr;
+    for( curr = sim->map->head; curr; curr = curr->next ) {
+        ++nb_signals;
+    }
+    put_varint(writer, nb_signals);
+
+    char *value = NULL;
+    size_t capacity = 0;
+    for( curr = sim->map->head; curr; curr = curr->next ) {
+        print_binary_timeline(writer, curr, &value, &capacity);
+    }
+    free(value);
+}
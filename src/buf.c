@@ -27,22 +27,202 @@
 #include <stdlib.h>
 #include "libvcd.h"
 
-signal_buf *insert_signal( signal_buf *head, char *name ) {
-    signal_buf *prev = NULL;
-    signal_buf *curr = head;
-    while( curr && strcmp(curr->name, name) >= 0 ) {
-        prev = curr;
-        curr = curr->next;
-    }
+/* The first block of text allocated for a trace is small such that
+   signals with few changes stay cheap. Following blocks double in size
+   until they reach TEXT_CHUNK_MAX_CAPACITY bytes. */
+#define TEXT_CHUNK_MIN_CAPACITY  64
+#define TEXT_CHUNK_MAX_CAPACITY  65536
+
+/* The dense table of identifier codes holds at most SIGNAL_MAP_DENSE_RATIO
+   slots per code in the map (and at least SIGNAL_MAP_DENSE_MIN_SIZE), such
+   that a few high codes do not allocate a large, mostly empty table. Codes
+   which decode past that limit are stored in a hash table instead, and
+   codes longer than SIGNAL_MAP_DENSE_MAX_DIGITS characters in the sorted
+   array of sparse entries. */
+#define SIGNAL_MAP_DENSE_RATIO       4
+#define SIGNAL_MAP_DENSE_MIN_SIZE    128
+#define SIGNAL_MAP_DENSE_MAX_DIGITS  4
+
+/* The hash table of sparse identifier codes is kept at most half full. */
+#define SIGNAL_MAP_CODES_MIN_CAPACITY  16
+
+/* The hash table of signal names is kept at most half full. */
+#define SIGNAL_NAMES_MIN_CAPACITY  64
+
+static signal_buf *
+new_signal_node( const char *name )
+{
     signal_buf *node = malloc(sizeof(signal_buf));
+    char *node_name = malloc(strlen(name) + 1);
+    if( !node || !node_name ) {
+        free(node);
+        free(node_name);
+        fprintf(stderr, "error: unable to allocate signal %s\n", name);
+        return NULL;
+    }
     memset(node, 0, sizeof(signal_buf));
-    node->name = malloc(strlen(name) + 1);
-    strcpy(node->name, name);
-    node->next = curr;
-    if( prev ) {
-        prev->next = node;
+    strcpy(node_name, name);
+    node->name = node_name;
+    node->is_pattern = (strpbrk(name, "*?") != NULL);
+    return node;
+}
+
+
+signal_buf *insert_signal( signal_buf *head, char *name ) {
+    /* Signals are put in order once, in remove_signal_patterns, such that
+       selecting many names does not walk *head* each time. */
+    signal_buf *node = new_signal_node(name);
+    if( !node ) return head;
+    node->next = head;
+    return node;
+}
+
+
+/* Matches *name* against a pattern where '?' and '*' stay within
+   a scope and '**' crosses scopes. */
+static bool
+match_signal_pattern( const char *pattern, const char *name )
+{
+    while( *pattern ) {
+        if( pattern[0] == '*' ) {
+            bool cross_scopes = (pattern[1] == '*');
+            pattern += cross_scopes ? 2 : 1;
+            for( ; ; ++name ) {
+                if( match_signal_pattern(pattern, name) ) return true;
+                if( !*name || (*name == '/' && !cross_scopes) ) return false;
+            }
+        }
+        if( !*name || (*pattern == '?' ? *name == '/' : *pattern != *name) ) {
+            return false;
+        }
+        ++pattern;
+        ++name;
+    }
+    return !*name;
+}
+
+
+int signal_buf_append( signal_buf *timeline, const char *text, size_t len )
+{
+    text_chunk *tail = timeline->text_tail;
+    while( len > 0 ) {
+        if( !tail || tail->length == tail->capacity ) {
+            size_t capacity = tail ? 2 * tail->capacity
+                : TEXT_CHUNK_MIN_CAPACITY;
+            if( capacity > TEXT_CHUNK_MAX_CAPACITY ) {
+                capacity = TEXT_CHUNK_MAX_CAPACITY;
+            }
+            text_chunk *chunk = malloc(sizeof(text_chunk) + capacity);
+            if( !chunk ) {
+                fprintf(stderr, "error: unable to allocate %zu bytes"\
+                    " for %s\n", capacity, timeline->name);
+                return 1;
+            }
+            chunk->next = NULL;
+            chunk->length = 0;
+            chunk->capacity = capacity;
+            if( tail ) {
+                tail->next = chunk;
+            } else {
+                timeline->text_head = chunk;
+            }
+            tail = chunk;
+            timeline->text_tail = chunk;
+        }
+        size_t avail = tail->capacity - tail->length;
+        size_t count = len < avail ? len : avail;
+        memcpy(&tail->text[tail->length], text, count);
+        tail->length += count;
+        text += count;
+        len -= count;
+    }
+    return 0;
+}
+
+
+int set_change_record( change_record *record,
+    size_t timestamp, const char *value_change, size_t length )
+{
+    if( length >= record->capacity ) {
+        size_t capacity = record->capacity > 0 ? record->capacity : 8;
+        while( capacity <= length ) capacity *= 2;
+        char *buffer = realloc(record->value_change, capacity);
+        if( !buffer ) {
+            fprintf(stderr, "error: unable to allocate %zu bytes"\
+                " for a value change\n", capacity);
+            return 1;
+        }
+        record->value_change = buffer;
+        record->capacity = capacity;
+    }
+    record->timestamp = timestamp;
+    record->length = length;
+    memcpy(record->value_change, value_change, length);
+    record->value_change[length] = '\0';
+    return 0;
+}
+
+
+void signal_buf_print( const signal_buf *timeline,
+    vcd_print_callback print, void *obj )
+{
+    if( timeline->alias_of ) timeline = timeline->alias_of;
+    const text_chunk *chunk = timeline->text_head;
+    while( chunk ) {
+        print(obj, chunk->text, chunk->length);
+        chunk = chunk->next;
     }
-    return prev ? head : node;
+}
+
+
+void vcd_emitter_init( struct vcd_emitter_t *emitter,
+    vcd_print_callback print, void *obj )
+{
+    emitter->print = print;
+    emitter->obj = obj;
+    emitter->buffer = NULL;
+    emitter->length = 0;
+}
+
+
+void vcd_emitter_print( void *obj, const char *buffer, size_t len )
+{
+    struct vcd_emitter_t *emitter = (struct vcd_emitter_t *)obj;
+    if( emitter->length + len > VCD_EMITTER_SIZE ) {
+        vcd_emitter_flush(emitter);
+    }
+    /* Spans a quarter of the buffer or more are not worth a copy. */
+    if( len >= VCD_EMITTER_SIZE / 4 ) {
+        vcd_emitter_flush(emitter);
+        emitter->print(emitter->obj, buffer, len);
+        return;
+    }
+    if( !emitter->buffer ) {
+        emitter->buffer = malloc(VCD_EMITTER_SIZE);
+        if( !emitter->buffer ) {
+            emitter->print(emitter->obj, buffer, len);
+            return;
+        }
+    }
+    memcpy(&emitter->buffer[emitter->length], buffer, len);
+    emitter->length += len;
+}
+
+
+void vcd_emitter_flush( struct vcd_emitter_t *emitter )
+{
+    if( emitter->length > 0 ) {
+        emitter->print(emitter->obj, emitter->buffer, emitter->length);
+        emitter->length = 0;
+    }
+}
+
+
+void vcd_emitter_destroy( struct vcd_emitter_t *emitter )
+{
+    free(emitter->buffer);
+    emitter->buffer = NULL;
+    emitter->length = 0;
 }
 
 
@@ -57,96 +237,456 @@ void destroy_signal_map( signal_map *map ) {
     while( curr ) {
         signal_buf *prev = curr;
         curr = curr->next;
+        text_chunk *chunk = prev->text_head;
+        while( chunk ) {
+            text_chunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(prev->initial_change_record.value_change);
+        free(prev->last_change_record.value_change);
         free((void *)prev->name);
         free(prev);
     }
+    for( size_t i = 0; i < map->entries_size; ++i ) {
+        free(map->entries[i].key);
+    }
+    free(map->entries);
+    free(map->timelines);
+    free(map->codes);
+    free(map->names);
+    free(map->patterns);
     memset(map, 0, sizeof(signal_map));
 }
 
 
-int insert_short_key( signal_map *map, const char *name, const char *key ) {
-    int key_len = strlen(key);
-    if( key_len > sizeof(uint32_t) ) {
-        fprintf(stderr, "error: The key is %d characters long,"\
-            " which is more than the %ld bytes.", key_len, sizeof(uint32_t));
-        return 1;
+/* FNV-1a */
+static size_t
+hash_signal_name( const char *name )
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for( ; *name; ++name ) {
+        hash ^= (unsigned char)*name;
+        hash *= 1099511628211ULL;
     }
-    /* Hash of the short key */
-    uint8_t key_hash = *key++;
-    uint32_t key_sym = key_hash;
-    while( *key != '\0' ) {
-        key_sym = key_sym << 8 | *key;
-        key_hash = key_hash ^ *key;
-        ++key;
-    }
-    /* Insert the short key into the hash table */
-    int j = 0;
-    while( j < 256 ) {
-        if( map->entries[key_hash].key == 0
-            || map->entries[key_hash].key == key_sym ) {
-            /* Associate the timeline buffer */
-            signal_buf *curr = map->head, *prev = NULL;
-            while( curr && strcmp(curr->name, name) != 0 ) {
-                prev = curr;
-                curr = curr->next;
-            }
-            if( curr ) {
-                map->entries[key_hash].timeline = curr;
-                map->entries[key_hash].key = key_sym;
+    return (size_t)hash;
+}
+
+
+/* Returns the slot of *name* in the hash table of signal names,
+   or the empty slot where it would be added. */
+static signal_buf **
+find_signal_slot( signal_buf **names, size_t capacity, const char *name )
+{
+    size_t mask = capacity - 1;
+    size_t i = hash_signal_name(name) & mask;
+    while( names[i] && strcmp(names[i]->name, name) != 0 ) {
+        i = (i + 1) & mask;
+    }
+    return &names[i];
+}
+
+
+/* Adds *node* to the hash table of signal names in *map*, unless a signal
+   with the same name is already there: insert_short_key binds the first
+   one in *head*. */
+static int
+add_signal_name( signal_map *map, signal_buf *node )
+{
+    if( 2 * (map->names_size + 1) > map->names_capacity ) {
+        size_t capacity = map->names_capacity > 0 ?
+            2 * map->names_capacity : SIGNAL_NAMES_MIN_CAPACITY;
+        signal_buf **names = calloc(capacity, sizeof(signal_buf*));
+        if( !names ) {
+            fprintf(stderr, "error: unable to allocate a table of %zu"\
+                " signal names\n", capacity);
+            return 1;
+        }
+        for( size_t i = 0; i < map->names_capacity; ++i ) {
+            if( map->names[i] ) {
+                *find_signal_slot(names, capacity, map->names[i]->name)
+                    = map->names[i];
             }
-            break;
         }
-        key_hash = (key_hash + 1) % 256;
-        ++j;
+        free(map->names);
+        map->names = names;
+        map->names_capacity = capacity;
+    }
+    signal_buf **slot = find_signal_slot(map->names,
+        map->names_capacity, node->name);
+    if( !*slot ) {
+        *slot = node;
+        ++map->names_size;
+    }
+    return 0;
+}
+
+
+/* Indexes the signals in *map* by name, and sets the patterns aside. */
+static int
+index_signal_names( signal_map *map )
+{
+    size_t nb_patterns = 0;
+    signal_buf *curr;
+    for( curr = map->head; curr; curr = curr->next ) {
+        if( curr->is_pattern ) ++nb_patterns;
+    }
+    free(map->patterns);
+    map->patterns = malloc((nb_patterns + 1) * sizeof(signal_buf*));
+    if( !map->patterns ) {
+        fprintf(stderr, "error: unable to allocate %zu patterns\n",
+            nb_patterns);
+        return 1;
+    }
+    map->patterns_size = 0;
+    /* An empty table still marks the map as indexed. */
+    map->names_size = 0;
+    map->names_capacity = SIGNAL_NAMES_MIN_CAPACITY;
+    map->names = calloc(map->names_capacity, sizeof(signal_buf*));
+    if( !map->names ) {
+        fprintf(stderr, "error: unable to allocate a table of %zu"\
+            " signal names\n", map->names_capacity);
+        map->names_capacity = 0;
+        return 1;
+    }
+    for( curr = map->head; curr; curr = curr->next ) {
+        if( curr->is_pattern ) {
+            map->patterns[map->patterns_size++] = curr;
+        } else if( add_signal_name(map, curr) != 0 ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/* Merges two lists in reverse alphabetical order. On equal names,
+   signals in *left* come first. */
+static signal_buf *
+merge_signals( signal_buf *left, signal_buf *right )
+{
+    signal_buf *head = NULL;
+    signal_buf **tail = &head;
+    while( left && right ) {
+        if( strcmp(left->name, right->name) >= 0 ) {
+            *tail = left;
+            left = left->next;
+        } else {
+            *tail = right;
+            right = right->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = left ? left : right;
+    return head;
+}
+
+
+/* Stable merge sort of a list of signals, in reverse alphabetical order. */
+static signal_buf *
+sort_signals( signal_buf *head )
+{
+    if( !head || !head->next ) return head;
+    signal_buf *middle = head;
+    signal_buf *fast = head->next;
+    while( fast && fast->next ) {
+        middle = middle->next;
+        fast = fast->next->next;
+    }
+    signal_buf *right = middle->next;
+    middle->next = NULL;
+    return merge_signals(sort_signals(head), sort_signals(right));
+}
+
+
+/* Decodes a VCD identifier code as a bijective base-94 integer, least
+   significant digit first. Simulators allocate codes in that order, so
+   the codes used in a dump decode to a compact range starting at 1.
+   The digits are decoded without a loop or a branch per character since
+   this runs for every value change. This function returns false when
+   the code contains characters outside '!' to '~' or is longer than
+   SIGNAL_MAP_DENSE_MAX_DIGITS. */
+static inline bool
+decode_identifier_code( const char *key, size_t key_len, size_t *index )
+{
+    const unsigned char *digits = (const unsigned char *)key;
+    size_t value = 0;
+    unsigned digit, invalid = 0;
+    switch( key_len ) {
+    case 4:
+        digit = digits[3] - '!';
+        invalid |= (digit >= 94);
+        value = digit + 1;
+        /* fallthrough */
+    case 3:
+        digit = digits[2] - '!';
+        invalid |= (digit >= 94);
+        value = value * 94 + digit + 1;
+        /* fallthrough */
+    case 2:
+        digit = digits[1] - '!';
+        invalid |= (digit >= 94);
+        value = value * 94 + digit + 1;
+        /* fallthrough */
+    case 1:
+        digit = digits[0] - '!';
+        invalid |= (digit >= 94);
+        *index = value * 94 + digit + 1;
+        return !invalid;
     }
-    if( j == 256 ) {
-        fprintf(stderr, "error: The hash table is full");
+    return false;
+}
+
+
+/* Binary search for *key* in the sorted array of sparse entries. On return
+   *pos* is the index of the entry if found, or its insertion point. */
+static bool
+find_entry( const signal_map *map, const char *key, size_t key_len,
+    size_t *pos )
+{
+    size_t low = 0, high = map->entries_size;
+    while( low < high ) {
+        size_t mid = low + (high - low) / 2;
+        const signal_map_entry *entry = &map->entries[mid];
+        int cmp = entry->key_len < key_len ? -1
+            : entry->key_len > key_len ? 1
+            : memcmp(entry->key, key, key_len);
+        if( cmp == 0 ) {
+            *pos = mid;
+            return true;
+        }
+        if( cmp < 0 ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *pos = low;
+    return false;
+}
+
+
+static int
+insert_entry( signal_map *map, const char *key, size_t key_len,
+    signal_buf *timeline )
+{
+    size_t pos;
+    if( find_entry(map, key, key_len, &pos) ) {
+        map->entries[pos].timeline = timeline;
+        return 0;
+    }
+    signal_map_entry *entries = realloc(map->entries,
+        (map->entries_size + 1) * sizeof(signal_map_entry));
+    char *entry_key = malloc(key_len);
+    if( !entries || !entry_key ) {
+        if( entries ) map->entries = entries;
+        free(entry_key);
+        fprintf(stderr, "error: unable to allocate signal map entry\n");
+        return 1;
+    }
+    map->entries = entries;
+    memmove(&entries[pos + 1], &entries[pos],
+        (map->entries_size - pos) * sizeof(signal_map_entry));
+    memcpy(entry_key, key, key_len);
+    entries[pos].key = entry_key;
+    entries[pos].key_len = key_len;
+    entries[pos].timeline = timeline;
+    ++map->entries_size;
+    return 0;
+}
+
+
+/* Returns the slot of the identifier code decoded as *index* in the hash
+   table *codes*, or the empty slot where it would be added. */
+static signal_map_code *
+find_code_slot( signal_map_code *codes, size_t capacity, size_t index )
+{
+    size_t mask = capacity - 1;
+    size_t i = (size_t)(((uint64_t)index * 11400714819323198485ULL) >> 32)
+        & mask;
+    while( codes[i].timeline && codes[i].index != index ) {
+        i = (i + 1) & mask;
+    }
+    return &codes[i];
+}
+
+
+/* Rebuilds the hash table of sparse codes in *map* with *capacity* slots,
+   leaving out the codes which now fit in the dense table. */
+static int
+rehash_codes( signal_map *map, size_t capacity )
+{
+    signal_map_code *codes = calloc(capacity, sizeof(signal_map_code));
+    if( !codes ) {
+        fprintf(stderr, "error: unable to allocate a table of %zu"\
+            " identifier codes\n", capacity);
         return 1;
     }
+    map->codes_size = 0;
+    for( size_t i = 0; i < map->codes_capacity; ++i ) {
+        signal_map_code *code = &map->codes[i];
+        if( !code->timeline ) continue;
+        if( code->index < map->timelines_size ) {
+            map->timelines[code->index] = code->timeline;
+        } else {
+            *find_code_slot(codes, capacity, code->index) = *code;
+            ++map->codes_size;
+        }
+    }
+    free(map->codes);
+    map->codes = codes;
+    map->codes_capacity = capacity;
     return 0;
 }
 
 
+static int
+set_timeline( signal_map *map, const char *key, size_t key_len,
+    signal_buf *timeline )
+{
+    size_t index;
+    if( !decode_identifier_code(key, key_len, &index) ) {
+        return insert_entry(map, key, key_len, timeline);
+    }
+    size_t limit = SIGNAL_MAP_DENSE_RATIO * (map->nb_codes + 1);
+    if( limit < SIGNAL_MAP_DENSE_MIN_SIZE ) limit = SIGNAL_MAP_DENSE_MIN_SIZE;
+    ++map->nb_codes;
+    if( index >= map->timelines_size && index < limit ) {
+        size_t size = map->timelines_size > 0 ?
+            map->timelines_size : SIGNAL_MAP_DENSE_MIN_SIZE;
+        while( size <= index ) size *= 2;
+        signal_buf **timelines = realloc(map->timelines,
+            size * sizeof(signal_buf*));
+        if( !timelines ) {
+            fprintf(stderr, "error: unable to allocate a table of %zu"\
+                " identifier codes\n", size);
+            return 1;
+        }
+        memset(&timelines[map->timelines_size], 0,
+            (size - map->timelines_size) * sizeof(signal_buf*));
+        map->timelines = timelines;
+        map->timelines_size = size;
+        /* Sparse codes the dense table now covers move into it. */
+        if( map->codes_size > 0
+            && rehash_codes(map, map->codes_capacity) != 0 ) {
+            return 1;
+        }
+    }
+    if( index < map->timelines_size ) {
+        map->timelines[index] = timeline;
+        return 0;
+    }
+    if( 2 * (map->codes_size + 1) > map->codes_capacity ) {
+        size_t capacity = map->codes_capacity > 0 ?
+            2 * map->codes_capacity : SIGNAL_MAP_CODES_MIN_CAPACITY;
+        if( rehash_codes(map, capacity) != 0 ) return 1;
+    }
+    signal_map_code *code = find_code_slot(map->codes,
+        map->codes_capacity, index);
+    if( !code->timeline ) ++map->codes_size;
+    code->index = index;
+    code->timeline = timeline;
+    return 0;
+}
+
+
+int insert_short_key( signal_map *map, const char *name, const char *key ) {
+    /* Associate the timeline buffer */
+    if( !map->names && index_signal_names(map) != 0 ) return 1;
+    signal_buf *curr = *find_signal_slot(map->names,
+        map->names_capacity, name);
+    if( !curr ) {
+        size_t i = 0;
+        while( i < map->patterns_size
+            && !match_signal_pattern(map->patterns[i]->name, name) ) {
+            ++i;
+        }
+        if( i == map->patterns_size ) return 0;
+        /* The signal is put in order in remove_signal_patterns. */
+        curr = new_signal_node(name);
+        if( !curr ) return 1;
+        curr->next = map->head;
+        map->head = curr;
+        if( add_signal_name(map, curr) != 0 ) return 1;
+    }
+    signal_buf *owner = find_timeline(map, key, strlen(key));
+    if( owner && owner != curr ) {
+        /* The identifier code is already captured for another name,
+           both names share its trace. */
+        if( !curr->alias_of ) {
+            curr->alias_of = owner;
+            curr->next_alias = owner->next_alias;
+            owner->next_alias = curr;
+        }
+        return 0;
+    }
+    return set_timeline(map, key, strlen(key), curr);
+}
+
+
+void remove_signal_patterns( signal_map *map ) {
+    signal_buf **prev = &map->head;
+    while( *prev ) {
+        signal_buf *curr = *prev;
+        if( curr->is_pattern ) {
+            *prev = curr->next;
+            free((void *)curr->name);
+            free(curr);
+        } else {
+            prev = &curr->next;
+        }
+    }
+    free(map->names);
+    map->names = NULL;
+    map->names_size = 0;
+    map->names_capacity = 0;
+    free(map->patterns);
+    map->patterns = NULL;
+    map->patterns_size = 0;
+    map->head = sort_signals(map->head);
+}
+
+
+signal_buf*
+insert_timeline( signal_map *map, const char *key, size_t key_len )
+{
+    signal_buf *timeline = find_timeline(map, key, key_len);
+    if( timeline ) return timeline;
+
+    timeline = malloc(sizeof(signal_buf));
+    char *name = malloc(key_len + 1);
+    if( !timeline || !name ) {
+        free(timeline);
+        free(name);
+        fprintf(stderr, "error: unable to allocate timeline\n");
+        return NULL;
+    }
+    memset(timeline, 0, sizeof(signal_buf));
+    memcpy(name, key, key_len);
+    name[key_len] = '\0';
+    timeline->name = name;
+    if( set_timeline(map, key, key_len, timeline) != 0 ) {
+        free(name);
+        free(timeline);
+        return NULL;
+    }
+    timeline->next = map->head;
+    map->head = timeline;
+    return timeline;
+}
+
+
 signal_buf*
 find_timeline( const signal_map *map, const char *key, size_t key_len ) {
-#if 0
-    assert(key_len < FILENAME_MAX);
-    char key_tmp[FILENAME_MAX];
-    strncpy(key_tmp, key, key_len);
-    fprintf(stderr, "find %s in\n", key_tmp);
-    for( int i = 0; i < 256; ++i ) {
-        if( map->entries[i].key ) {
-            fprintf(stderr, "%d: %d\n", i, map->entries[i].key);
-        }
-    }
-#endif
-
-    /* Hash of the short key */
-    uint8_t key_hash = *key++;
-    uint32_t key_sym = key_hash;
-    --key_len;
-    while( key_len ) {
-        key_sym = key_sym << 8 | *key;
-        key_hash = key_hash ^ *key;
-        ++key;
-        --key_len;
-    }
-
-    /* Find the short key into the hash table */
-    int j = 0;
-    while( j < 256 ) {
-        if( map->entries[key_hash].key == 0 ) {
-            /* key does not exists. */
-            return NULL;
-        } else if( map->entries[key_hash].key == key_sym ) {
-            /* We found the key */
-            assert( map->entries[key_hash].timeline );
-            return map->entries[key_hash].timeline;
-        }
-        key_hash = (key_hash + 1) % 256;
-        ++j;
-    }
-    fprintf(stderr, "warning: walked the whole table for %s.", key);
+    size_t index;
+    if( decode_identifier_code(key, key_len, &index) ) {
+        if( index < map->timelines_size ) return map->timelines[index];
+        if( map->codes_size == 0 ) return NULL;
+        return find_code_slot(map->codes, map->codes_capacity,
+            index)->timeline;
+    }
+    if( map->entries_size > 0 && find_entry(map, key, key_len, &index) ) {
+        return map->entries[index].timeline;
+    }
     return NULL;
 }
-
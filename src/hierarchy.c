@@ -0,0 +1,743 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include "libvcd.h"
+
+/* A hierarchy cache holds the header definitions of a VCD file, such that
+   they are not tokenized again on every query. All integers are 64-bit,
+   in native byte order.
+
+     header          struct hierarchy_header_t
+     scopes          struct hierarchy_scope_t, nb_scopes of them. Scope 0
+                     is the (unnamed) root of the hierarchy.
+     vars            struct hierarchy_var_t, nb_vars of them, in the order
+                     they are declared in the VCD file
+     children        scope indices, the children of each scope sorted
+                     by name
+     members         var indices, the vars of each scope sorted by name
+     definitions     the "date", "version", ..., "definitions" JSON
+                     fields, as printed by header_and_definitions
+     pool            NUL-terminated strings
+
+   Names are resolved by walking down the scopes one '/' separated
+   component at a time, with a binary search at each level. */
+#define HIERARCHY_MAGIC      "VCDHIER2"
+#define HIERARCHY_NO_SCOPE   UINT64_MAX
+
+struct hierarchy_header_t {
+    char magic[8];
+    struct vcd_file_stamp_t vcd;
+    uint64_t definitions_end;   /* offset right after $enddefinitions */
+    uint64_t nb_scopes;
+    uint64_t scopes_offset;
+    uint64_t nb_vars;
+    uint64_t vars_offset;
+    uint64_t children_offset;
+    uint64_t members_offset;
+    uint64_t definitions_offset;
+    uint64_t definitions_size;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+struct hierarchy_scope_t {
+    uint64_t name;              /* offsets in the pool */
+    uint64_t parent;
+    uint64_t first_child;       /* index in the children */
+    uint64_t nb_children;
+    uint64_t first_member;      /* index in the members */
+    uint64_t nb_members;
+};
+
+struct hierarchy_var_t {
+    uint64_t path;              /* full name, as selected in queries */
+    uint64_t name;              /* last component of *path* */
+    uint64_t code;
+    uint64_t type;
+    uint64_t width;
+    uint64_t scope;
+};
+
+/* Growable block of bytes. */
+struct hierarchy_bytes_t {
+    char *data;
+    size_t size;
+    size_t capacity;
+};
+
+struct hierarchy_builder_t {
+    struct hierarchy_bytes_t scopes;
+    struct hierarchy_bytes_t vars;
+    struct hierarchy_bytes_t pool;
+    struct hierarchy_bytes_t definitions;
+    uint64_t current_scope;
+    uint64_t var_type;          /* of the $var being declared */
+    uint64_t var_width;
+    size_t definitions_end;
+    bool err;
+};
+
+
+static void *
+bytes_append( struct hierarchy_builder_t *hierarchy,
+    struct hierarchy_bytes_t *bytes, const void *data, size_t length )
+{
+    if( bytes->size + length > bytes->capacity ) {
+        size_t capacity = bytes->capacity > 0 ? bytes->capacity : 4096;
+        while( capacity < bytes->size + length ) capacity *= 2;
+        char *new_data = realloc(bytes->data, capacity);
+        if( !new_data ) {
+            fprintf(stderr, "error: unable to allocate hierarchy\n");
+            hierarchy->err = true;
+            return NULL;
+        }
+        bytes->data = new_data;
+        bytes->capacity = capacity;
+    }
+    void *result = &bytes->data[bytes->size];
+    memcpy(result, data, length);
+    bytes->size += length;
+    return result;
+}
+
+
+static uint64_t
+pool_append( struct hierarchy_builder_t *hierarchy,
+    const char *text, size_t length )
+{
+    uint64_t offset = hierarchy->pool.size;
+    bytes_append(hierarchy, &hierarchy->pool, text, length);
+    bytes_append(hierarchy, &hierarchy->pool, "", 1);
+    return offset;
+}
+
+
+static void
+capture_print( void *obj, const char *buffer, size_t length )
+{
+    struct hierarchy_builder_t *hierarchy = obj;
+    bytes_append(hierarchy, &hierarchy->definitions, buffer, length);
+}
+
+
+void
+hierarchy_enter_scope( struct hierarchy_builder_t *hierarchy,
+    const char *name, size_t length )
+{
+    struct hierarchy_scope_t scope;
+    memset(&scope, 0, sizeof(scope));
+    scope.name = pool_append(hierarchy, name, length);
+    scope.parent = hierarchy->current_scope;
+    if( bytes_append(hierarchy, &hierarchy->scopes, &scope, sizeof(scope)) ) {
+        hierarchy->current_scope
+            = hierarchy->scopes.size / sizeof(struct hierarchy_scope_t) - 1;
+    }
+}
+
+
+void
+hierarchy_exit_scope( struct hierarchy_builder_t *hierarchy )
+{
+    const struct hierarchy_scope_t *scopes
+        = (const struct hierarchy_scope_t *)hierarchy->scopes.data;
+    /* $enddefinitions also closes the "definitions" field. */
+    if( hierarchy->current_scope != 0 ) {
+        hierarchy->current_scope = scopes[hierarchy->current_scope].parent;
+    }
+}
+
+
+void
+hierarchy_var_type( struct hierarchy_builder_t *hierarchy,
+    const char *type, size_t length )
+{
+    /* Consecutive vars mostly share the same type. */
+    const char *last_type = &hierarchy->pool.data[hierarchy->var_type];
+    if( strncmp(last_type, type, length) == 0 && last_type[length] == '\0' ) {
+        return;
+    }
+    hierarchy->var_type = pool_append(hierarchy, type, length);
+}
+
+
+void
+hierarchy_var_width( struct hierarchy_builder_t *hierarchy,
+    const char *width, size_t length )
+{
+    hierarchy->var_width = 0;
+    for( size_t i = 0; i < length && '0' <= width[i] && width[i] <= '9';
+         ++i ) {
+        hierarchy->var_width = 10 * hierarchy->var_width + (width[i] - '0');
+    }
+}
+
+
+void
+hierarchy_add_var( struct hierarchy_builder_t *hierarchy,
+    const char *path, const char *code )
+{
+    const struct hierarchy_scope_t *scopes
+        = (const struct hierarchy_scope_t *)hierarchy->scopes.data;
+    struct hierarchy_var_t var;
+    var.path = pool_append(hierarchy, path, strlen(path));
+    /* The scope path is a prefix of the var path. */
+    size_t prefix_length = 0;
+    for( uint64_t scope = hierarchy->current_scope; scope != 0;
+         scope = scopes[scope].parent ) {
+        prefix_length += strlen(&hierarchy->pool.data[scopes[scope].name]) + 1;
+    }
+    /* Scope names starting with '[' are not separated by a '/',
+       such names are still found by select_vars, by path. */
+    if( prefix_length > strlen(path) ) prefix_length = strlen(path);
+    var.name = var.path + prefix_length;
+    var.code = pool_append(hierarchy, code, strlen(code));
+    var.type = hierarchy->var_type;
+    var.width = hierarchy->var_width;
+    var.scope = hierarchy->current_scope;
+    bytes_append(hierarchy, &hierarchy->vars, &var, sizeof(var));
+}
+
+
+void
+hierarchy_enddefinitions( struct hierarchy_builder_t *hierarchy,
+    size_t offset )
+{
+    hierarchy->definitions_end = offset;
+}
+
+
+/* Sort context; qsort does not take one. */
+static const char *sort_pool;
+static const uint64_t *sort_names;
+
+static int
+compare_names( const void *left, const void *right )
+{
+    return strcmp(&sort_pool[sort_names[*(const uint64_t *)left]],
+        &sort_pool[sort_names[*(const uint64_t *)right]]);
+}
+
+
+/* Writes the indices of the elements of each scope, sorted by name. */
+static int
+write_members( FILE *to, size_t nb_scopes, struct hierarchy_scope_t *scopes,
+    const uint64_t *parents, const uint64_t *names, size_t nb_elements,
+    const char *pool, bool children )
+{
+    uint64_t *counts = calloc(nb_scopes + 1, sizeof(uint64_t));
+    uint64_t *members = malloc((nb_elements + 1) * sizeof(uint64_t));
+    if( !counts || !members ) {
+        fprintf(stderr, "error: unable to allocate hierarchy\n");
+        free(counts);
+        free(members);
+        return 1;
+    }
+    /* Scope 0 is the root, it is not its own child. */
+    size_t first = children ? 1 : 0;
+    for( size_t i = first; i < nb_elements; ++i ) ++counts[parents[i] + 1];
+    for( size_t i = 0; i < nb_scopes; ++i ) counts[i + 1] += counts[i];
+    for( size_t i = 0; i < nb_scopes; ++i ) {
+        if( children ) {
+            scopes[i].first_child = counts[i];
+            scopes[i].nb_children = counts[i + 1] - counts[i];
+        } else {
+            scopes[i].first_member = counts[i];
+            scopes[i].nb_members = counts[i + 1] - counts[i];
+        }
+    }
+    for( size_t i = first; i < nb_elements; ++i ) {
+        members[counts[parents[i]]++] = i;
+    }
+    sort_pool = pool;
+    sort_names = names;
+    size_t begin = 0;
+    for( size_t i = 0; i < nb_scopes; ++i ) {
+        size_t end = children ? scopes[i].first_child + scopes[i].nb_children
+            : scopes[i].first_member + scopes[i].nb_members;
+        qsort(&members[begin], end - begin, sizeof(uint64_t), compare_names);
+        begin = end;
+    }
+    fwrite(members, sizeof(uint64_t), nb_elements - first, to);
+    free(counts);
+    free(members);
+    return 0;
+}
+
+
+static int
+write_hierarchy( struct hierarchy_builder_t *hierarchy, FILE *to,
+    struct hierarchy_header_t *header )
+{
+    struct hierarchy_scope_t *scopes
+        = (struct hierarchy_scope_t *)hierarchy->scopes.data;
+    const struct hierarchy_var_t *vars
+        = (const struct hierarchy_var_t *)hierarchy->vars.data;
+    size_t nb_scopes = hierarchy->scopes.size / sizeof(*scopes);
+    size_t nb_vars = hierarchy->vars.size / sizeof(*vars);
+    uint64_t *parents = malloc((nb_scopes + nb_vars + 1) * sizeof(uint64_t));
+    uint64_t *names = malloc((nb_scopes + nb_vars + 1) * sizeof(uint64_t));
+    int err = 0;
+    if( !parents || !names ) {
+        fprintf(stderr, "error: unable to allocate hierarchy\n");
+        free(parents);
+        free(names);
+        return 1;
+    }
+
+    header->nb_scopes = nb_scopes;
+    header->scopes_offset = sizeof(struct hierarchy_header_t);
+    header->nb_vars = nb_vars;
+    header->vars_offset = header->scopes_offset
+        + nb_scopes * sizeof(struct hierarchy_scope_t);
+    header->children_offset = header->vars_offset
+        + nb_vars * sizeof(struct hierarchy_var_t);
+    header->members_offset = header->children_offset
+        + (nb_scopes - 1) * sizeof(uint64_t);
+
+    /* The scope table is written last, once children and members
+       are known. */
+    fseek(to, header->children_offset, SEEK_SET);
+    for( size_t i = 0; i < nb_scopes; ++i ) {
+        parents[i] = scopes[i].parent;
+        names[i] = scopes[i].name;
+    }
+    err = write_members(to, nb_scopes, scopes, parents, names, nb_scopes,
+        hierarchy->pool.data, true);
+    for( size_t i = 0; i < nb_vars; ++i ) {
+        parents[i] = vars[i].scope;
+        names[i] = vars[i].name;
+    }
+    if( !err ) {
+        err = write_members(to, nb_scopes, scopes, parents, names, nb_vars,
+            hierarchy->pool.data, false);
+    }
+    header->definitions_offset = header->members_offset
+        + nb_vars * sizeof(uint64_t);
+    header->definitions_size = hierarchy->definitions.size;
+    fwrite(hierarchy->definitions.data, 1, hierarchy->definitions.size, to);
+    header->pool_offset = header->definitions_offset
+        + hierarchy->definitions.size;
+    header->pool_size = hierarchy->pool.size;
+    fwrite(hierarchy->pool.data, 1, hierarchy->pool.size, to);
+
+    fseek(to, header->scopes_offset, SEEK_SET);
+    fwrite(scopes, sizeof(struct hierarchy_scope_t), nb_scopes, to);
+    fwrite(vars, sizeof(struct hierarchy_var_t), nb_vars, to);
+    free(parents);
+    free(names);
+    return err;
+}
+
+
+static size_t
+write_hierarchy_trace( void *obj, const char *buffer, size_t length )
+{
+    return trace_filter_write((struct trace_filter_t *)obj, buffer, length);
+}
+
+
+int
+hierarchy_build( FILE *from, FILE *to )
+{
+    struct vcd_file_stamp_t stamp;
+    struct hierarchy_builder_t hierarchy;
+    struct hierarchy_header_t header;
+    struct trace_filter_t trace;
+
+    if( vcd_file_stamp(fileno(from), &stamp) != 0 ) {
+        fprintf(stderr, "error: unable to stat VCD file\n");
+        return 1;
+    }
+    memset(&hierarchy, 0, sizeof(hierarchy));
+    /* The root scope. */
+    hierarchy_enter_scope(&hierarchy, "", 0);
+    if( hierarchy.err ) return 1;
+    ((struct hierarchy_scope_t *)hierarchy.scopes.data)->parent
+        = HIERARCHY_NO_SCOPE;
+
+    /* An empty time window: the trace stops at the first simulation
+       time, right after the definitions. */
+    trace_filter_init_format(&trace, 0, 0, 1,
+        json_trace_format, capture_print, &hierarchy);
+    trace.defs.hierarchy = &hierarchy;
+    vcd_emitter_flush(&trace.emitter);
+    hierarchy.definitions.size = 0;   /* the opening '{' */
+
+    memset(&header, 0, sizeof(header));
+    int err = read_input(from, 0, write_hierarchy_trace, &trace)
+        || hierarchy.err || hierarchy.definitions_end == 0;
+    vcd_emitter_flush(&trace.emitter);
+    vcd_emitter_destroy(&trace.emitter);
+    destroy_tokenizer(&trace.tokenizer);
+    destroy_signal_map(&trace.map);
+    if( !err ) err = write_hierarchy(&hierarchy, to, &header);
+    if( !err ) {
+        memcpy(header.magic, HIERARCHY_MAGIC, sizeof(header.magic));
+        header.vcd = stamp;
+        header.definitions_end = hierarchy.definitions_end;
+        if( fseek(to, 0, SEEK_SET) != 0 ) err = 1;
+        fwrite(&header, sizeof(header), 1, to);
+    }
+    free(hierarchy.scopes.data);
+    free(hierarchy.vars.data);
+    free(hierarchy.pool.data);
+    free(hierarchy.definitions.data);
+    return err || ferror(to) ? 1 : 0;
+}
+
+
+/* A hierarchy cache mapped in memory. */
+struct hierarchy_t {
+    const char *data;
+    size_t size;
+    const struct hierarchy_header_t *header;
+    const struct hierarchy_scope_t *scopes;
+    const struct hierarchy_var_t *vars;
+    const uint64_t *children;
+    const uint64_t *members;
+    const char *pool;
+};
+
+
+/* Returns true when the section of *count* elements of *element_size*
+   bytes starts at *offset* and fits in the *size* bytes of the cache.
+   *offset* is then moved to the end of the section. */
+static bool
+next_section( uint64_t *offset, uint64_t section_offset, uint64_t count,
+    size_t element_size, size_t size )
+{
+    if( section_offset != *offset || section_offset > size
+        || count > (size - section_offset) / element_size ) return false;
+    *offset = section_offset + count * element_size;
+    return true;
+}
+
+
+/* Returns true when [*first*, *first* + *count*[ is within *limit*. */
+static bool
+range_within( uint64_t first, uint64_t count, uint64_t limit )
+{
+    return first <= limit && count <= limit - first;
+}
+
+
+/* Checks the sections are laid out as written by write_hierarchy
+   and that every offset and index is within the section it refers to,
+   such that a truncated or corrupted cache is rebuilt rather than
+   read past its end. */
+static bool
+valid_hierarchy( const struct hierarchy_t *hierarchy )
+{
+    const struct hierarchy_header_t *header = hierarchy->header;
+    size_t size = hierarchy->size;
+    uint64_t offset = sizeof(struct hierarchy_header_t);
+
+    if( header->nb_scopes == 0
+        || !next_section(&offset, header->scopes_offset, header->nb_scopes,
+            sizeof(struct hierarchy_scope_t), size)
+        || !next_section(&offset, header->vars_offset, header->nb_vars,
+            sizeof(struct hierarchy_var_t), size)
+        || !next_section(&offset, header->children_offset,
+            header->nb_scopes - 1, sizeof(uint64_t), size)
+        || !next_section(&offset, header->members_offset, header->nb_vars,
+            sizeof(uint64_t), size)
+        || !next_section(&offset, header->definitions_offset,
+            header->definitions_size, 1, size)
+        || !next_section(&offset, header->pool_offset, header->pool_size,
+            1, size)
+        || offset != size || header->pool_size == 0
+        || hierarchy->data[size - 1] != '\0' ) return false;
+
+    const struct hierarchy_scope_t *scopes = (const struct hierarchy_scope_t *)
+        &hierarchy->data[header->scopes_offset];
+    const struct hierarchy_var_t *vars = (const struct hierarchy_var_t *)
+        &hierarchy->data[header->vars_offset];
+    const uint64_t *children = (const uint64_t *)
+        &hierarchy->data[header->children_offset];
+    const uint64_t *members = (const uint64_t *)
+        &hierarchy->data[header->members_offset];
+    for( uint64_t i = 0; i < header->nb_scopes; ++i ) {
+        if( scopes[i].name >= header->pool_size
+            || (scopes[i].parent >= header->nb_scopes
+                && scopes[i].parent != HIERARCHY_NO_SCOPE)
+            || !range_within(scopes[i].first_child, scopes[i].nb_children,
+                header->nb_scopes - 1)
+            || !range_within(scopes[i].first_member, scopes[i].nb_members,
+                header->nb_vars) ) return false;
+    }
+    for( uint64_t i = 0; i < header->nb_vars; ++i ) {
+        if( vars[i].path >= header->pool_size
+            || vars[i].name >= header->pool_size
+            || vars[i].code >= header->pool_size
+            || vars[i].scope >= header->nb_scopes
+            || members[i] >= header->nb_vars ) return false;
+    }
+    for( uint64_t i = 0; i + 1 < header->nb_scopes; ++i ) {
+        if( children[i] >= header->nb_scopes ) return false;
+    }
+    return true;
+}
+
+
+static int
+map_hierarchy( struct hierarchy_t *hierarchy, FILE *from, FILE *cache )
+{
+    hierarchy->data = map_input(fileno(cache), &hierarchy->size);
+    if( !hierarchy->data ) return 1;
+
+    const struct hierarchy_header_t *header
+        = (const struct hierarchy_header_t *)hierarchy->data;
+    hierarchy->header = header;
+    if( hierarchy->size < sizeof(struct hierarchy_header_t)
+        || memcmp(header->magic, HIERARCHY_MAGIC, sizeof(header->magic)) != 0
+        || !vcd_file_stamp_matches(fileno(from), &header->vcd)
+        || header->definitions_end > header->vcd.size
+        || !valid_hierarchy(hierarchy) ) {
+        unmap_input(hierarchy->data, hierarchy->size);
+        return 1;
+    }
+    hierarchy->scopes = (const struct hierarchy_scope_t *)
+        &hierarchy->data[header->scopes_offset];
+    hierarchy->vars = (const struct hierarchy_var_t *)
+        &hierarchy->data[header->vars_offset];
+    hierarchy->children = (const uint64_t *)
+        &hierarchy->data[header->children_offset];
+    hierarchy->members = (const uint64_t *)
+        &hierarchy->data[header->members_offset];
+    hierarchy->pool = &hierarchy->data[header->pool_offset];
+    return 0;
+}
+
+
+/* Binary search for *name* (of *length* characters) in the *count*
+   *indices* sorted by the names of *elements*. *result* is set to
+   the position in *indices* of an element with that name, or *count*. */
+#define FIND_BY_NAME(result, pool, elements, indices, count, name, length) \
+    { \
+        size_t low = 0, high = (count); \
+        (result) = (count); \
+        while( low < high ) { \
+            size_t mid = low + (high - low) / 2; \
+            const char *curr = &(pool)[(elements)[(indices)[mid]].name]; \
+            int cmp = strncmp(curr, (name), (length)); \
+            if( cmp == 0 && curr[(length)] != '\0' ) cmp = 1; \
+            if( cmp == 0 ) { (result) = mid; break; } \
+            if( cmp < 0 ) low = mid + 1; else high = mid; \
+        } \
+    }
+
+
+/* Var indices selected while binding signals. */
+struct hierarchy_selection_t {
+    uint64_t *vars;
+    size_t size;
+    size_t capacity;
+};
+
+
+static bool
+select_var( struct hierarchy_selection_t *selection, uint64_t var )
+{
+    if( selection->size == selection->capacity ) {
+        size_t capacity = selection->capacity > 0 ?
+            2 * selection->capacity : 64;
+        uint64_t *vars = realloc(selection->vars, capacity * sizeof(uint64_t));
+        if( !vars ) {
+            fprintf(stderr, "error: unable to allocate %zu signals\n",
+                capacity);
+            return false;
+        }
+        selection->vars = vars;
+        selection->capacity = capacity;
+    }
+    selection->vars[selection->size++] = var;
+    return true;
+}
+
+
+/* Selects the vars declared as *path*. A name can be declared more than
+   once, as different vars. */
+static bool
+select_vars( const struct hierarchy_t *hierarchy, const char *path,
+    struct hierarchy_selection_t *selection )
+{
+    uint64_t scope = 0;
+    const char *name = path;
+    for( ; ; ) {
+        const struct hierarchy_scope_t *curr = &hierarchy->scopes[scope];
+        const uint64_t *members = &hierarchy->members[curr->first_member];
+        size_t found;
+        FIND_BY_NAME(found, hierarchy->pool, hierarchy->vars,
+            members, curr->nb_members, name, strlen(name));
+        if( found < curr->nb_members ) {
+            const char *var_name
+                = &hierarchy->pool[hierarchy->vars[members[found]].name];
+            size_t first = found, last = found + 1;
+            while( first > 0 && strcmp(var_name,
+                    &hierarchy->pool[hierarchy->vars[members[first - 1]].name])
+                   == 0 ) --first;
+            while( last < curr->nb_members && strcmp(var_name,
+                    &hierarchy->pool[hierarchy->vars[members[last]].name])
+                   == 0 ) ++last;
+            for( ; first < last; ++first ) {
+                if( !select_var(selection, members[first]) ) return false;
+            }
+            return true;
+        }
+
+        const char *sep = strchr(name, '/');
+        if( !sep ) break;
+        const uint64_t *children = &hierarchy->children[curr->first_child];
+        FIND_BY_NAME(found, hierarchy->pool, hierarchy->scopes,
+            children, curr->nb_children, name, (size_t)(sep - name));
+        if( found == curr->nb_children ) break;
+        scope = children[found];
+        name = sep + 1;
+    }
+
+    /* Names that do not split along scopes (ex: escaped identifiers
+       with a '/'). */
+    for( uint64_t i = 0; i < hierarchy->header->nb_vars; ++i ) {
+        if( strcmp(&hierarchy->pool[hierarchy->vars[i].path], path) == 0 ) {
+            if( !select_var(selection, i) ) return false;
+        }
+    }
+    return true;
+}
+
+
+static int
+compare_indices( const void *left, const void *right )
+{
+    uint64_t l = *(const uint64_t *)left;
+    uint64_t r = *(const uint64_t *)right;
+    return l < r ? -1 : l > r ? 1 : 0;
+}
+
+
+/* Binds the signals selected in *map* to their identifier codes,
+   in the order the vars are declared, as the parser would. */
+static void
+bind_signals( const struct hierarchy_t *hierarchy, signal_map *map )
+{
+    const struct hierarchy_var_t *vars = hierarchy->vars;
+    struct hierarchy_selection_t selection;
+    signal_buf *curr;
+
+    for( curr = map->head; curr; curr = curr->next ) {
+        if( curr->is_pattern ) {
+            /* Patterns have to be matched against every var. */
+            for( uint64_t i = 0; i < hierarchy->header->nb_vars; ++i ) {
+                insert_short_key(map, &hierarchy->pool[vars[i].path],
+                    &hierarchy->pool[vars[i].code]);
+            }
+            return;
+        }
+    }
+
+    memset(&selection, 0, sizeof(selection));
+    for( curr = map->head; curr; curr = curr->next ) {
+        if( !select_vars(hierarchy, curr->name, &selection) ) break;
+    }
+    qsort(selection.vars, selection.size, sizeof(uint64_t), compare_indices);
+    for( size_t i = 0; i < selection.size; ++i ) {
+        /* A var selected twice is bound once. */
+        if( i > 0 && selection.vars[i] == selection.vars[i - 1] ) continue;
+        insert_short_key(map, &hierarchy->pool[vars[selection.vars[i]].path],
+            &hierarchy->pool[vars[selection.vars[i]].code]);
+    }
+    free(selection.vars);
+}
+
+
+static void
+discard_definitions( void *obj, const char *buffer, size_t length )
+{
+    (void)obj;
+    (void)buffer;
+    (void)length;
+}
+
+
+void
+trace_filter_bind_hierarchy( struct trace_filter_t *trace,
+    const struct hierarchy_t *hierarchy )
+{
+    const struct hierarchy_header_t *header = hierarchy->header;
+    trace->defs.print(trace->defs.obj,
+        &hierarchy->data[header->definitions_offset], header->definitions_size);
+    bind_signals(hierarchy, &trace->map);
+
+    /* Moves the parser past the header definitions, as if it had
+       tokenized them. */
+    vcd_print_callback print = trace->defs.print;
+    trace->defs.print = discard_definitions;
+    trace_filter_write(trace, "$enddefinitions\n", 16);
+    trace->defs.print = print;
+    trace->tokenizer.offset = header->definitions_end;
+    trace->definitions_end = header->definitions_end;
+}
+
+
+int
+trace_filter_load_hierarchy( struct trace_filter_t *trace,
+    FILE *from, FILE *cache )
+{
+    struct hierarchy_t hierarchy;
+    if( map_hierarchy(&hierarchy, from, cache) != 0 ) return 1;
+    trace_filter_bind_hierarchy(trace, &hierarchy);
+    unmap_input(hierarchy.data, hierarchy.size);
+
+    fseek(from, trace->definitions_end, SEEK_SET);
+    return 0;
+}
+
+
+struct hierarchy_t *
+hierarchy_open( FILE *from, FILE *cache )
+{
+    struct hierarchy_t *hierarchy = malloc(sizeof(struct hierarchy_t));
+    if( !hierarchy ) {
+        fprintf(stderr, "error: unable to allocate hierarchy\n");
+        return NULL;
+    }
+    if( map_hierarchy(hierarchy, from, cache) != 0 ) {
+        free(hierarchy);
+        return NULL;
+    }
+    return hierarchy;
+}
+
+
+void
+hierarchy_close( struct hierarchy_t *hierarchy )
+{
+    if( !hierarchy ) return;
+    unmap_input(hierarchy->data, hierarchy->size);
+    free(hierarchy);
+}
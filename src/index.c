@@ -0,0 +1,268 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include "libvcd.h"
+
+/* The sidecar index is a text file. The first line identifies the VCD
+   file it was built from (size, modification time in seconds and
+   nanoseconds, inode and device, see vcd_file_stamp_t). Each checkpoint
+   follows as a "#checkpoint offset timestamp length" line, then *length*
+   bytes of value changes, in VCD syntax, that restore the value of every
+   identifier code at *offset* in the VCD file. */
+#define TIME_INDEX_MAGIC     "vcd2json-index 2"
+
+
+static int
+compare_change_timestamps( const void *left, const void *right )
+{
+    const signal_buf *l = *(const signal_buf **)left;
+    const signal_buf *r = *(const signal_buf **)right;
+    return l->initial_change_record.timestamp
+        < r->initial_change_record.timestamp ? -1
+        : l->initial_change_record.timestamp
+        > r->initial_change_record.timestamp ? 1 : 0;
+}
+
+
+static void
+write_checkpoint( struct time_index_t *index,
+    size_t timestamp, size_t offset )
+{
+    size_t nb_codes = 0;
+    signal_buf **codes = NULL;
+    signal_buf *curr;
+
+    /* Value changes before the first simulation time are part
+       of the header definitions read on every query. */
+    if( index->has_timestamp ) {
+        for( curr = index->codes.head; curr; curr = curr->next ) ++nb_codes;
+        codes = malloc((nb_codes + 1) * sizeof(signal_buf*));
+        if( !codes ) {
+            fprintf(stderr, "error: unable to allocate checkpoint\n");
+            return;
+        }
+        nb_codes = 0;
+        for( curr = index->codes.head; curr; curr = curr->next ) {
+            codes[nb_codes++] = curr;
+        }
+        qsort(codes, nb_codes, sizeof(signal_buf*), compare_change_timestamps);
+    }
+
+    /* Simulation times must be increasing so the snapshot is written
+       grouped by the time each identifier code last changed. */
+    size_t length = 0;
+    for( size_t i = 0; i < nb_codes; ++i ) {
+        const change_record *record = &codes[i]->initial_change_record;
+        if( i == 0 || record->timestamp
+            != codes[i - 1]->initial_change_record.timestamp ) {
+            length += snprintf(NULL, 0, "#%zu\n", record->timestamp);
+        }
+        length += record->length + 1;
+    }
+    fprintf(index->to, "#checkpoint %zu %zu %zu\n", offset, timestamp, length);
+    for( size_t i = 0; i < nb_codes; ++i ) {
+        const change_record *record = &codes[i]->initial_change_record;
+        if( i == 0 || record->timestamp
+            != codes[i - 1]->initial_change_record.timestamp ) {
+            fprintf(index->to, "#%zu\n", record->timestamp);
+        }
+        fwrite(record->value_change, 1, record->length, index->to);
+        fputc('\n', index->to);
+    }
+    free(codes);
+}
+
+
+void
+time_index_timestamp( struct time_index_t *index,
+    size_t timestamp, size_t offset )
+{
+    /* A checkpoint is only valid at the first reference
+       to a simulation time. */
+    if( offset >= index->next_checkpoint
+        && (!index->has_timestamp || timestamp > index->current_timestamp) ) {
+        write_checkpoint(index, timestamp, offset);
+        index->next_checkpoint = offset + index->interval;
+    }
+    index->current_timestamp = timestamp;
+    index->has_timestamp = true;
+}
+
+
+void
+time_index_value_change( struct time_index_t *index,
+    const char *buffer, size_t start, size_t last, size_t mark )
+{
+    size_t len = last - mark;
+    if( buffer[mark] == ' ' ) --len;
+    signal_buf *timeline = insert_timeline(
+        &index->codes, &buffer[last - len], len);
+    if( !timeline ) return;
+    /* We keep the whole token, as it appears in the VCD file. */
+    set_change_record(&timeline->initial_change_record,
+        index->current_timestamp, &buffer[start], last - start);
+}
+
+
+int
+time_index_build( FILE *from, FILE *to, size_t interval )
+{
+    struct vcd_file_stamp_t stamp;
+    struct time_index_t index;
+    struct tokenizer_t tokenizer;
+
+    if( vcd_file_stamp(fileno(from), &stamp) != 0 ) {
+        fprintf(stderr, "error: unable to stat VCD file\n");
+        return 1;
+    }
+    index.to = to;
+    index.interval = interval > 0 ? interval : TIME_INDEX_INTERVAL;
+    index.next_checkpoint = 0;
+    index.has_timestamp = false;
+    index.current_timestamp = 0;
+    init_signal_map(&index.codes);
+    init_tokenizer(&tokenizer, NULL, NULL);
+    tokenizer.parser.index = &index;
+
+    fprintf(to, "%s %llu %llu %llu %llu %llu\n", TIME_INDEX_MAGIC,
+        (unsigned long long)stamp.size, (unsigned long long)stamp.mtime,
+        (unsigned long long)stamp.mtime_nsec, (unsigned long long)stamp.ino,
+        (unsigned long long)stamp.dev);
+    int err = read_input(from, 0, write_tokens, &tokenizer);
+    destroy_tokenizer(&tokenizer);
+    destroy_signal_map(&index.codes);
+    return err || ferror(to) ? 1 : 0;
+}
+
+
+int
+time_index_load( FILE *from, FILE *index,
+    struct time_checkpoint_t **checkpoints, size_t *nb_checkpoints )
+{
+    struct vcd_file_stamp_t stamp;
+    char line[FILENAME_MAX];
+    unsigned long long size, mtime, mtime_nsec, ino, dev;
+    struct time_checkpoint_t *loaded = NULL;
+    size_t nb_loaded = 0, capacity = 0;
+
+    if( !fgets(line, sizeof(line), index)
+        || sscanf(line, TIME_INDEX_MAGIC " %llu %llu %llu %llu %llu",
+            &size, &mtime, &mtime_nsec, &ino, &dev) != 5 ) {
+        return 1;
+    }
+    stamp.size = size;
+    stamp.mtime = mtime;
+    stamp.mtime_nsec = mtime_nsec;
+    stamp.ino = ino;
+    stamp.dev = dev;
+    if( !vcd_file_stamp_matches(fileno(from), &stamp) ) return 1;
+
+    while( fgets(line, sizeof(line), index) ) {
+        struct time_checkpoint_t checkpoint;
+        long snapshot = ftell(index);
+        if( sscanf(line, "#checkpoint %zu %zu %zu", &checkpoint.offset,
+                &checkpoint.timestamp, &checkpoint.length) != 3
+            || snapshot < 0
+            || fseek(index, checkpoint.length, SEEK_CUR) != 0 ) {
+            free(loaded);
+            return 1;
+        }
+        checkpoint.snapshot = snapshot;
+        if( nb_loaded == capacity ) {
+            capacity = capacity > 0 ? 2 * capacity : 64;
+            struct time_checkpoint_t *grown = realloc(loaded,
+                capacity * sizeof(struct time_checkpoint_t));
+            if( !grown ) {
+                fprintf(stderr, "error: unable to allocate checkpoints\n");
+                free(loaded);
+                return 1;
+            }
+            loaded = grown;
+        }
+        loaded[nb_loaded++] = checkpoint;
+    }
+    if( nb_loaded == 0 ) {
+        free(loaded);
+        return 1;
+    }
+    *checkpoints = loaded;
+    *nb_checkpoints = nb_loaded;
+    return 0;
+}
+
+
+int
+trace_filter_write_checkpoint( struct trace_filter_t *trace,
+    FILE *from, FILE *index,
+    const struct time_checkpoint_t *checkpoints, size_t nb_checkpoints )
+{
+    /* The first checkpoint is right after the header definitions.
+       Find the last checkpoint before the time window. */
+    size_t header_end = checkpoints[0].offset;
+    size_t low = 1, high = nb_checkpoints;
+    while( low < high ) {
+        size_t mid = low + (high - low) / 2;
+        if( checkpoints[mid].timestamp > trace->sim.start_time ) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    const struct time_checkpoint_t *checkpoint = &checkpoints[low - 1];
+
+    /* header definitions, then the value of every identifier code
+       at the checkpoint, then value changes from the checkpoint on. */
+    /* (The definitions might already be loaded from a hierarchy cache.) */
+    if( trace->definitions_end > header_end ) return 1;
+    read_input_range(from, trace->definitions_end,
+        header_end - trace->definitions_end, 0, write_trace, trace);
+    if( trace->sim.done ) return 0;
+    read_input_range(index, checkpoint->snapshot, checkpoint->length,
+        0, write_trace, trace);
+    if( trace->sim.done ) return 0;
+    read_input_range(from, checkpoint->offset, SIZE_MAX, 0,
+        write_trace, trace);
+    return 0;
+}
+
+
+int
+trace_filter_write_indexed( struct trace_filter_t *trace,
+    FILE *from, FILE *index )
+{
+    struct time_checkpoint_t *checkpoints;
+    size_t nb_checkpoints;
+
+    if( time_index_load(from, index, &checkpoints, &nb_checkpoints) != 0 ) {
+        return 1;
+    }
+    int err = trace_filter_write_checkpoint(trace, from, index,
+        checkpoints, nb_checkpoints);
+    free(checkpoints);
+    return err;
+}
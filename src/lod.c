@@ -0,0 +1,995 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include "libvcd.h"
+
+/* A level-of-detail file holds, for each identifier code, a pyramid
+   of buckets. A bucket at level k spans the 2^k timestamps
+   [bucket << k, (bucket + 1) << k[, where bucket is its first timestamp
+   shifted right by k, and summarizes the value changes in that range,
+   including whether one of them set a bit to x or z.
+   All integers are 64-bit, in native byte order.
+
+     header          struct lod_header_t
+     buckets         struct lod_bucket_t, nb_buckets of them, grouped
+                     by code, then by level, each group sorted by time
+     codes           struct lod_code_entry_t, nb_codes of them
+     levels          struct lod_level_entry_t, nb_levels of them
+     pool            NUL-terminated values and identifier codes, each
+                     value stored once per code
+
+   A level is only stored when its buckets take at most half the bytes
+   of the last level stored for the code, the value changes counting as
+   the level below LOD_MIN_LEVEL, so the file is no larger than the value
+   changes and queries read no more than twice the bytes of the pixels
+   they request. Codes with few value changes may thus have no level
+   at all. A query finer than the levels stored for a code reads
+   the value changes.
+
+   While the VCD file is read, the buckets of LOD_MIN_LEVEL are written
+   to a temporary file as they close, in runs of LOD_RUN_SIZE bytes sorted
+   by code. When the VCD file is done, the buckets of each code are read
+   back from every run in turn to fold the coarser levels. */
+#define LOD_MAGIC        "VCDLOD4"
+#define LOD_MAX_LEVEL    63
+
+/* Bytes of buckets sorted in memory before they are written
+   to the temporary file. */
+#define LOD_RUN_SIZE             (1 << 23)
+
+/* Bytes read at a time from each run of the temporary file. */
+#define LOD_RUN_READ_SIZE        (1 << 16)
+
+/* Distinct values of a code past which values are no longer interned. */
+#define LOD_MAX_INTERNED_VALUES  (1 << 16)
+
+struct lod_header_t {
+    char magic[8];
+    struct vcd_file_stamp_t vcd;
+    uint64_t header_end;
+    uint64_t last_timestamp;
+    uint64_t nb_buckets;
+    uint64_t nb_codes;
+    uint64_t codes_offset;
+    uint64_t nb_levels;
+    uint64_t levels_offset;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+struct lod_bucket_t {
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint64_t changes;
+    uint64_t unknown;          /* 1 when a change set a bit to x or z */
+    uint64_t first_value;      /* offsets in the pool */
+    uint64_t last_value;
+};
+
+struct lod_code_entry_t {
+    uint64_t code;             /* offset in the pool */
+    uint64_t first_level;      /* index in the levels */
+    uint64_t nb_levels;
+    uint64_t nb_buckets;       /* at LOD_MIN_LEVEL, 0 without value changes */
+};
+
+struct lod_level_entry_t {
+    uint64_t level;
+    uint64_t first_bucket;     /* index in the buckets */
+    uint64_t nb_buckets;
+};
+
+/* Open bucket of an identifier code while the VCD file is read. */
+struct lod_code_t {
+    signal_buf *code;
+    change_record first;       /* first value change in the bucket */
+    change_record last;        /* previous value change */
+    uint64_t changes;          /* in the bucket, 0 when none is open */
+    bool unknown;              /* a change in the bucket set x or z */
+    uint64_t change_bytes;     /* of the value changes in the VCD file */
+    uint64_t nb_buckets;       /* closed buckets */
+    uint64_t spill_size;       /* bytes of those buckets */
+};
+
+/* A closed bucket in a run, followed by its first value and, when
+   it has more than one change, its last value. */
+struct lod_spill_t {
+    uint64_t position;         /* of the code in the states */
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint64_t changes;
+    uint64_t unknown;
+    uint64_t first_length;
+    uint64_t last_length;
+};
+
+/* A bucket of a run being sorted. */
+struct lod_run_entry_t {
+    uint64_t position;
+    size_t offset;             /* in the run */
+    size_t length;
+};
+
+/* Buckets of a run in the temporary file being read back. */
+struct lod_run_t {
+    uint64_t offset;           /* of the next bytes to read */
+    uint64_t end;
+    char *buffer;
+    size_t first;              /* bytes not read back yet */
+    size_t last;
+};
+
+/* A bucket being folded into coarser levels. */
+struct lod_summary_t {
+    uint64_t first_timestamp;
+    uint64_t last_timestamp;
+    uint64_t changes;
+    bool unknown;
+    const char *first_value;
+    size_t first_length;
+    const char *last_value;
+    size_t last_length;
+};
+
+/* A value of the code being written, interned in the pool. */
+struct lod_value_t {
+    const char *value;
+    size_t length;
+    uint64_t offset;
+    size_t generation;         /* the slot is empty for other codes */
+};
+
+/* Summaries being written after the buckets read back. */
+struct lod_writer_t {
+    FILE *to;
+    FILE *pool;                /* appended to *to* once the buckets are */
+    uint64_t pool_size;
+    uint64_t nb_buckets;
+    struct lod_level_entry_t *levels;
+    size_t nb_levels;
+    size_t levels_capacity;
+    struct lod_value_t *values;
+    size_t nb_values;
+    size_t values_capacity;
+    size_t generation;
+};
+
+
+static int
+compare_run_entries( const void *left, const void *right )
+{
+    const struct lod_run_entry_t *l = left;
+    const struct lod_run_entry_t *r = right;
+    if( l->position != r->position ) return l->position < r->position ? -1 : 1;
+    return l->offset < r->offset ? -1 : l->offset > r->offset ? 1 : 0;
+}
+
+
+/* Writes the buckets of the current run to the temporary file, sorted
+   by code, and in the order they closed for a code. */
+static void
+write_run( struct lod_builder_t *lod )
+{
+    struct lod_run_entry_t *entries = malloc(
+        (lod->run_buckets + 1) * sizeof(struct lod_run_entry_t));
+    if( !entries ) {
+        fprintf(stderr, "error: unable to allocate summaries\n");
+        lod->err = true;
+        return;
+    }
+    size_t offset = 0;
+    for( size_t i = 0; i < lod->run_buckets; ++i ) {
+        struct lod_spill_t spill;
+        memcpy(&spill, &lod->run[offset], sizeof(spill));
+        entries[i].position = spill.position;
+        entries[i].offset = offset;
+        entries[i].length = sizeof(spill)
+            + spill.first_length + spill.last_length;
+        offset += entries[i].length;
+    }
+    qsort(entries, lod->run_buckets, sizeof(struct lod_run_entry_t),
+        compare_run_entries);
+    for( size_t i = 0; i < lod->run_buckets; ++i ) {
+        fwrite(&lod->run[entries[i].offset], 1, entries[i].length, lod->spill);
+    }
+    free(entries);
+
+    if( lod->nb_runs == lod->runs_capacity ) {
+        size_t capacity = lod->runs_capacity > 0 ? 2 * lod->runs_capacity : 16;
+        uint64_t *runs = realloc(lod->runs, capacity * sizeof(uint64_t));
+        if( !runs ) {
+            fprintf(stderr, "error: unable to allocate summaries\n");
+            lod->err = true;
+            return;
+        }
+        lod->runs = runs;
+        lod->runs_capacity = capacity;
+    }
+    lod->spill_size += lod->run_size;
+    lod->runs[lod->nb_runs++] = lod->spill_size;
+    lod->run_size = 0;
+    lod->run_buckets = 0;
+}
+
+
+/* Adds the open bucket of *state* to the current run. */
+static void
+spill_bucket( struct lod_builder_t *lod, struct lod_code_t *state )
+{
+    struct lod_spill_t spill;
+    const change_record *last = state->changes > 1 ?
+        &state->last : &state->first;
+    spill.position = state->code->position;
+    spill.first_timestamp = state->first.timestamp;
+    spill.last_timestamp = last->timestamp;
+    spill.changes = state->changes;
+    spill.unknown = state->unknown;
+    spill.first_length = state->first.length;
+    spill.last_length = state->changes > 1 ? state->last.length : 0;
+    state->changes = 0;
+    state->unknown = false;
+
+    size_t length = sizeof(spill) + spill.first_length + spill.last_length;
+    if( lod->run_size + length > lod->run_capacity ) {
+        if( lod->run_size > 0 ) write_run(lod);
+        if( length > lod->run_capacity ) {
+            size_t capacity = length > LOD_RUN_SIZE ? length : LOD_RUN_SIZE;
+            char *run = realloc(lod->run, capacity);
+            if( !run ) {
+                fprintf(stderr, "error: unable to allocate summaries\n");
+                lod->err = true;
+                return;
+            }
+            lod->run = run;
+            lod->run_capacity = capacity;
+        }
+    }
+    char *to = &lod->run[lod->run_size];
+    memcpy(to, &spill, sizeof(spill));
+    memcpy(to + sizeof(spill), state->first.value_change, spill.first_length);
+    if( spill.last_length > 0 ) {
+        memcpy(to + sizeof(spill) + spill.first_length,
+            state->last.value_change, spill.last_length);
+    }
+    lod->run_size += length;
+    ++lod->run_buckets;
+    ++state->nb_buckets;
+    state->spill_size += length;
+}
+
+
+static struct lod_code_t *
+find_code_state( struct lod_builder_t *lod, const char *code, size_t length )
+{
+    signal_buf *timeline = find_timeline(&lod->codes, code, length);
+    if( timeline ) return &lod->states[timeline->position];
+
+    if( lod->nb_states == lod->states_capacity ) {
+        size_t capacity = lod->states_capacity > 0
+            ? 2 * lod->states_capacity : 256;
+        struct lod_code_t *states = realloc(lod->states,
+            capacity * sizeof(struct lod_code_t));
+        if( !states ) {
+            fprintf(stderr, "error: unable to allocate summaries\n");
+            return NULL;
+        }
+        lod->states = states;
+        lod->states_capacity = capacity;
+    }
+    timeline = insert_timeline(&lod->codes, code, length);
+    if( !timeline ) return NULL;
+    timeline->position = lod->nb_states;
+    struct lod_code_t *state = &lod->states[lod->nb_states++];
+    memset(state, 0, sizeof(struct lod_code_t));
+    state->code = timeline;
+    return state;
+}
+
+
+void
+lod_timestamp( struct lod_builder_t *lod, size_t timestamp )
+{
+    lod->current_timestamp = timestamp;
+    if( timestamp > lod->last_timestamp ) lod->last_timestamp = timestamp;
+}
+
+
+void
+lod_value_change( struct lod_builder_t *lod,
+    const char *buffer, size_t start, size_t last, size_t mark )
+{
+    size_t len = last - mark;
+    if( buffer[mark] == ' ' ) --len;
+    struct lod_code_t *state = find_code_state(lod, &buffer[last - len], len);
+    if( !state ) {
+        lod->err = true;
+        return;
+    }
+
+    uint64_t bucket = lod->current_timestamp >> LOD_MIN_LEVEL;
+    if( state->changes > 0
+        && (state->first.timestamp >> LOD_MIN_LEVEL) != bucket ) {
+        spill_bucket(lod, state);
+    }
+    if( set_change_record(state->changes > 0 ? &state->last : &state->first,
+            lod->current_timestamp, &buffer[start], mark - start) != 0 ) {
+        lod->err = true;
+        return;
+    }
+    ++state->changes;
+    state->unknown |= value_change_is_unknown(&buffer[start], mark - start);
+    state->change_bytes += last - start + 1;
+}
+
+
+/* Makes at least *length* bytes of *run* available in its buffer,
+   unless the run ends before. Returns the bytes available. */
+static size_t
+fill_run( struct lod_run_t *run, FILE *spill, size_t length )
+{
+    size_t available = run->last - run->first;
+    if( available >= length || run->offset == run->end ) return available;
+    memmove(run->buffer, &run->buffer[run->first], available);
+    run->first = 0;
+    run->last = available;
+    size_t read_size = LOD_RUN_READ_SIZE - available;
+    if( read_size > run->end - run->offset ) {
+        read_size = run->end - run->offset;
+    }
+    if( fseeko(spill, run->offset, SEEK_SET) == 0 ) {
+        size_t bytes_read = fread(&run->buffer[run->last], 1,
+            read_size, spill);
+        run->offset += bytes_read;
+        run->last += bytes_read;
+    }
+    return run->last - run->first;
+}
+
+
+/* Copies the buckets of *state* from every run into *data*,
+   in the order they closed. */
+static int
+read_runs( struct lod_builder_t *lod, struct lod_run_t *runs,
+    const struct lod_code_t *state, char *data )
+{
+    struct lod_spill_t spill;
+    size_t length = 0;
+    for( size_t i = 0; i < lod->nb_runs; ++i ) {
+        struct lod_run_t *run = &runs[i];
+        while( fill_run(run, lod->spill, sizeof(spill)) >= sizeof(spill) ) {
+            memcpy(&spill, &run->buffer[run->first], sizeof(spill));
+            if( spill.position != state->code->position ) break;
+            size_t remaining = sizeof(spill)
+                + spill.first_length + spill.last_length;
+            if( length + remaining > state->spill_size ) return 1;
+            while( remaining > 0 ) {
+                size_t available = fill_run(run, lod->spill,
+                    remaining < LOD_RUN_READ_SIZE ?
+                    remaining : LOD_RUN_READ_SIZE);
+                if( available == 0 ) return 1;
+                if( available > remaining ) available = remaining;
+                memcpy(&data[length], &run->buffer[run->first], available);
+                run->first += available;
+                length += available;
+                remaining -= available;
+            }
+        }
+    }
+    return length == state->spill_size ? 0 : 1;
+}
+
+
+static size_t
+hash_value( const char *value, size_t length )
+{
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for( size_t i = 0; i < length; ++i ) {
+        hash ^= (unsigned char)value[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t)hash;
+}
+
+
+static uint64_t
+pool_append( struct lod_writer_t *writer, const char *value, size_t length )
+{
+    uint64_t offset = writer->pool_size;
+    fwrite(value, 1, length, writer->pool);
+    fputc('\0', writer->pool);
+    writer->pool_size += length + 1;
+    return offset;
+}
+
+
+/* Returns the slot of *value* in the values of the current code,
+   or the empty slot where it would be added. */
+static struct lod_value_t *
+find_value_slot( struct lod_writer_t *writer,
+    const char *value, size_t length )
+{
+    size_t mask = writer->values_capacity - 1;
+    size_t i = hash_value(value, length) & mask;
+    for( ; ; ) {
+        struct lod_value_t *slot = &writer->values[i];
+        if( slot->generation != writer->generation
+            || (slot->length == length
+                && memcmp(slot->value, value, length) == 0) ) {
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+
+/* Returns the offset of *value* in the pool, appending it the first time
+   it occurs for the current code. */
+static uint64_t
+intern_value( struct lod_writer_t *writer, const char *value, size_t length )
+{
+    if( writer->nb_values >= LOD_MAX_INTERNED_VALUES ) {
+        return pool_append(writer, value, length);
+    }
+    if( 2 * (writer->nb_values + 1) > writer->values_capacity ) {
+        size_t capacity = writer->values_capacity > 0 ?
+            2 * writer->values_capacity : 16;
+        struct lod_value_t *values = writer->values;
+        size_t values_capacity = writer->values_capacity;
+        writer->values = calloc(capacity, sizeof(struct lod_value_t));
+        if( !writer->values ) {
+            writer->values = values;
+            return pool_append(writer, value, length);
+        }
+        writer->values_capacity = capacity;
+        for( size_t i = 0; i < values_capacity; ++i ) {
+            if( values[i].generation == writer->generation ) {
+                *find_value_slot(writer, values[i].value, values[i].length)
+                    = values[i];
+            }
+        }
+        free(values);
+    }
+    struct lod_value_t *slot = find_value_slot(writer, value, length);
+    if( slot->generation != writer->generation ) {
+        slot->value = value;
+        slot->length = length;
+        slot->offset = pool_append(writer, value, length);
+        slot->generation = writer->generation;
+        ++writer->nb_values;
+    }
+    return slot->offset;
+}
+
+
+/* Folds *summaries* of a level into the buckets of the next coarser
+   *level*, in place. Returns the number of buckets in the coarser level. */
+static size_t
+fold_level( struct lod_summary_t *summaries, size_t nb_summaries,
+    unsigned int level )
+{
+    size_t size = 0;
+    for( size_t i = 0; i < nb_summaries; ++i ) {
+        if( size > 0 && (summaries[size - 1].first_timestamp >> level)
+            == (summaries[i].first_timestamp >> level) ) {
+            struct lod_summary_t *merged = &summaries[size - 1];
+            merged->changes += summaries[i].changes;
+            merged->unknown |= summaries[i].unknown;
+            merged->last_timestamp = summaries[i].last_timestamp;
+            merged->last_value = summaries[i].last_value;
+            merged->last_length = summaries[i].last_length;
+        } else {
+            summaries[size++] = summaries[i];
+        }
+    }
+    return size;
+}
+
+
+/* Bytes of the *size* buckets of a level in the file, as if none
+   of their values had been stored before. */
+static uint64_t
+level_bytes( const struct lod_summary_t *summaries, size_t size )
+{
+    uint64_t bytes = size * (sizeof(struct lod_bucket_t) + 1);
+    for( size_t i = 0; i < size; ++i ) {
+        bytes += summaries[i].first_length;
+        if( summaries[i].changes > 1 ) {
+            bytes += summaries[i].last_length + 1;
+        }
+    }
+    return bytes;
+}
+
+
+/* Writes the levels of *state* from its buckets read back in *data*. */
+static int
+write_levels( struct lod_writer_t *writer, const struct lod_code_t *state,
+    const char *data, struct lod_code_entry_t *code )
+{
+    struct lod_summary_t *summaries = malloc(
+        (state->nb_buckets + 1) * sizeof(struct lod_summary_t));
+    if( !summaries ) {
+        fprintf(stderr, "error: unable to allocate summaries\n");
+        return 1;
+    }
+    for( size_t i = 0; i < state->nb_buckets; ++i ) {
+        struct lod_spill_t spill;
+        memcpy(&spill, data, sizeof(spill));
+        data += sizeof(spill);
+        summaries[i].first_timestamp = spill.first_timestamp;
+        summaries[i].last_timestamp = spill.last_timestamp;
+        summaries[i].changes = spill.changes;
+        summaries[i].unknown = spill.unknown != 0;
+        summaries[i].first_value = data;
+        summaries[i].first_length = spill.first_length;
+        data += spill.first_length;
+        summaries[i].last_value = spill.changes > 1 ? data
+            : summaries[i].first_value;
+        summaries[i].last_length = spill.changes > 1 ? spill.last_length
+            : spill.first_length;
+        data += spill.last_length;
+    }
+
+    ++writer->generation;
+    writer->nb_values = 0;
+    code->first_level = writer->nb_levels;
+    code->nb_levels = 0;
+    code->nb_buckets = state->nb_buckets;
+    size_t size = state->nb_buckets;
+    uint64_t stored = state->change_bytes;
+    for( unsigned int level = LOD_MIN_LEVEL;
+         level <= LOD_MAX_LEVEL && size > 0; ++level ) {
+        uint64_t bytes = level_bytes(summaries, size);
+        if( 2 * bytes <= stored ) {
+            if( writer->nb_levels == writer->levels_capacity ) {
+                size_t capacity = writer->levels_capacity > 0
+                    ? 2 * writer->levels_capacity : 256;
+                struct lod_level_entry_t *entries = realloc(writer->levels,
+                    capacity * sizeof(struct lod_level_entry_t));
+                if( !entries ) {
+                    fprintf(stderr, "error: unable to allocate summaries\n");
+                    free(summaries);
+                    return 1;
+                }
+                writer->levels = entries;
+                writer->levels_capacity = capacity;
+            }
+            struct lod_level_entry_t *entry
+                = &writer->levels[writer->nb_levels++];
+            entry->level = level;
+            entry->first_bucket = writer->nb_buckets;
+            entry->nb_buckets = size;
+            ++code->nb_levels;
+            for( size_t i = 0; i < size; ++i ) {
+                struct lod_bucket_t bucket;
+                bucket.first_timestamp = summaries[i].first_timestamp;
+                bucket.last_timestamp = summaries[i].last_timestamp;
+                bucket.changes = summaries[i].changes;
+                bucket.unknown = summaries[i].unknown;
+                bucket.first_value = intern_value(writer,
+                    summaries[i].first_value, summaries[i].first_length);
+                bucket.last_value = intern_value(writer,
+                    summaries[i].last_value, summaries[i].last_length);
+                fwrite(&bucket, sizeof(bucket), 1, writer->to);
+            }
+            writer->nb_buckets += size;
+            stored = bytes;
+        }
+        if( size == 1 ) break;
+        size = fold_level(summaries, size, level + 1);
+    }
+    free(summaries);
+    return 0;
+}
+
+
+static int
+write_summaries( struct lod_builder_t *lod, FILE *to,
+    struct lod_header_t *header )
+{
+    struct lod_writer_t writer;
+    struct lod_code_entry_t *codes;
+    struct lod_run_t *runs;
+    char *data = NULL;
+    size_t data_capacity = 0;
+    char buffer[BUFFER_SIZE];
+    int err = 0;
+
+    for( size_t i = 0; i < lod->nb_states; ++i ) {
+        if( lod->states[i].changes > 0 ) spill_bucket(lod, &lod->states[i]);
+    }
+    if( lod->run_size > 0 ) write_run(lod);
+    free(lod->run);
+    lod->run = NULL;
+    lod->run_capacity = 0;
+    if( lod->err || fflush(lod->spill) != 0 || ferror(lod->spill) ) return 1;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.to = to;
+    writer.pool = tmpfile();
+    codes = malloc((lod->nb_states + 1) * sizeof(struct lod_code_entry_t));
+    runs = calloc(lod->nb_runs + 1, sizeof(struct lod_run_t));
+    if( !writer.pool || !codes || !runs ) {
+        fprintf(stderr, "error: unable to allocate summaries\n");
+        if( writer.pool ) fclose(writer.pool);
+        free(codes);
+        free(runs);
+        return 1;
+    }
+    for( size_t i = 0; i < lod->nb_runs; ++i ) {
+        runs[i].offset = i > 0 ? lod->runs[i - 1] : 0;
+        runs[i].end = lod->runs[i];
+        runs[i].buffer = malloc(LOD_RUN_READ_SIZE);
+        if( !runs[i].buffer ) {
+            fprintf(stderr, "error: unable to allocate summaries\n");
+            err = 1;
+        }
+    }
+
+    /* Runs are sorted by code, so each is read once, from start to end. */
+    for( size_t i = 0; !err && i < lod->nb_states; ++i ) {
+        const struct lod_code_t *state = &lod->states[i];
+        if( state->spill_size > data_capacity ) {
+            char *grown = realloc(data, state->spill_size);
+            if( !grown ) {
+                fprintf(stderr, "error: unable to allocate summaries\n");
+                err = 1;
+                break;
+            }
+            data = grown;
+            data_capacity = state->spill_size;
+        }
+        err = read_runs(lod, runs, state, data);
+        if( err ) {
+            fprintf(stderr, "error: unable to read summaries back\n");
+            break;
+        }
+        const char *name = state->code->name;
+        codes[i].code = pool_append(&writer, name, strlen(name));
+        err = write_levels(&writer, state, data, &codes[i]);
+    }
+    for( size_t i = 0; i < lod->nb_runs; ++i ) free(runs[i].buffer);
+    free(runs);
+    free(data);
+
+    if( !err ) {
+        header->nb_buckets = writer.nb_buckets;
+        header->nb_codes = lod->nb_states;
+        header->codes_offset = sizeof(struct lod_header_t)
+            + writer.nb_buckets * sizeof(struct lod_bucket_t);
+        fwrite(codes, sizeof(struct lod_code_entry_t), lod->nb_states, to);
+        header->nb_levels = writer.nb_levels;
+        header->levels_offset = header->codes_offset
+            + lod->nb_states * sizeof(struct lod_code_entry_t);
+        fwrite(writer.levels, sizeof(struct lod_level_entry_t),
+            writer.nb_levels, to);
+        header->pool_offset = header->levels_offset
+            + writer.nb_levels * sizeof(struct lod_level_entry_t);
+        header->pool_size = writer.pool_size;
+        rewind(writer.pool);
+        size_t length;
+        while( (length = fread(buffer, 1, sizeof(buffer), writer.pool)) > 0 ) {
+            fwrite(buffer, 1, length, to);
+        }
+        if( ferror(writer.pool) ) err = 1;
+    }
+    fclose(writer.pool);
+    free(writer.levels);
+    free(writer.values);
+    free(codes);
+    return err;
+}
+
+
+int
+lod_build( FILE *from, FILE *to )
+{
+    struct vcd_file_stamp_t stamp;
+    struct lod_builder_t lod;
+    struct lod_header_t header;
+    struct tokenizer_t tokenizer;
+
+    if( vcd_file_stamp(fileno(from), &stamp) != 0 ) {
+        fprintf(stderr, "error: unable to stat VCD file\n");
+        return 1;
+    }
+    memset(&lod, 0, sizeof(lod));
+    lod.spill = tmpfile();
+    if( !lod.spill ) {
+        fprintf(stderr, "error: unable to create a temporary file\n");
+        return 1;
+    }
+    init_signal_map(&lod.codes);
+    init_tokenizer(&tokenizer, NULL, NULL);
+    tokenizer.parser.lod = &lod;
+
+    /* The header is written last, once the offsets are known. */
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, to);
+    int err = read_input(from, 0, write_tokens, &tokenizer)
+        || lod.header_end == 0 || lod.err;
+    destroy_tokenizer(&tokenizer);
+    if( !err ) err = write_summaries(&lod, to, &header);
+    if( !err ) {
+        memcpy(header.magic, LOD_MAGIC, sizeof(header.magic));
+        header.vcd = stamp;
+        header.header_end = lod.header_end;
+        header.last_timestamp = lod.last_timestamp;
+        if( fseek(to, 0, SEEK_SET) != 0 ) err = 1;
+        fwrite(&header, sizeof(header), 1, to);
+    }
+
+    for( size_t i = 0; i < lod.nb_states; ++i ) {
+        free(lod.states[i].first.value_change);
+        free(lod.states[i].last.value_change);
+    }
+    free(lod.states);
+    free(lod.run);
+    free(lod.runs);
+    fclose(lod.spill);
+    destroy_signal_map(&lod.codes);
+    return err || ferror(to) ? 1 : 0;
+}
+
+
+static unsigned int
+trailing_zeros( uint64_t value )
+{
+    unsigned int count = 0;
+    if( value == 0 ) return 64;
+    while( (value & 1) == 0 ) {
+        value >>= 1;
+        ++count;
+    }
+    return count;
+}
+
+
+/* Returns the value at *offset* in the pool, or an empty value when
+   a corrupted file points past the pool. */
+static const char *
+pool_value( const char *pool, uint64_t pool_size, uint64_t offset )
+{
+    return offset < pool_size ? &pool[offset] : "";
+}
+
+
+/* Adds the buckets of *level* in the time window of *sim* to *timeline*,
+   one pixel at a time. */
+static void
+filter_level( struct simulation_t *sim, signal_buf *timeline,
+    const struct lod_bucket_t *buckets, size_t nb_buckets, unsigned int level,
+    uint64_t last_bucket, const char *pool, uint64_t pool_size )
+{
+    uint64_t first_bucket = sim->start_time >> level;
+    uint64_t per_pixel = sim->resolution >> level;
+
+    /* First bucket in the time window. */
+    size_t low = 0, high = nb_buckets;
+    while( low < high ) {
+        size_t mid = low + (high - low) / 2;
+        if( (buckets[mid].first_timestamp >> level) < first_bucket ) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if( low > 0 ) {
+        /* Value of the signal before the time window. */
+        const struct lod_bucket_t *prev = &buckets[low - 1];
+        const char *value = pool_value(pool, pool_size, prev->last_value);
+        size_t length = strlen(value);
+        filter_value_change_summary(sim, timeline,
+            prev->last_timestamp, value, length,
+            prev->last_timestamp, value, length, 1, false);
+    }
+
+    size_t i = low;
+    while( i < nb_buckets
+        && (buckets[i].first_timestamp >> level) < last_bucket ) {
+        uint64_t pixel
+            = ((buckets[i].first_timestamp >> level) - first_bucket) / per_pixel;
+        uint64_t changes = buckets[i].changes;
+        bool unknown = buckets[i].unknown != 0;
+        size_t j = i + 1;
+        while( j < nb_buckets
+            && (buckets[j].first_timestamp >> level) < last_bucket
+            && ((buckets[j].first_timestamp >> level) - first_bucket)
+               / per_pixel == pixel ) {
+            changes += buckets[j].changes;
+            unknown |= buckets[j].unknown != 0;
+            ++j;
+        }
+        const char *first_value
+            = pool_value(pool, pool_size, buckets[i].first_value);
+        const char *last_value
+            = pool_value(pool, pool_size, buckets[j - 1].last_value);
+        filter_value_change_summary(sim, timeline,
+            buckets[i].first_timestamp, first_value, strlen(first_value),
+            buckets[j - 1].last_timestamp, last_value, strlen(last_value),
+            changes, unknown);
+        i = j;
+    }
+}
+
+
+/* Returns true when the section of *count* elements of *element_size*
+   bytes starts at *offset* and fits in the *size* bytes of the file.
+   *offset* is then moved to the end of the section. */
+static bool
+next_section( uint64_t *offset, uint64_t section_offset, uint64_t count,
+    size_t element_size, size_t size )
+{
+    if( section_offset != *offset || section_offset > size
+        || count > (size - section_offset) / element_size ) return false;
+    *offset = section_offset + count * element_size;
+    return true;
+}
+
+
+/* Checks the sections are laid out as written by write_summaries and
+   that the codes and levels point within them. Offsets of values
+   are checked as buckets are read (see pool_value). */
+static bool
+valid_lod( const char *data, size_t size )
+{
+    const struct lod_header_t *header = (const struct lod_header_t *)data;
+    uint64_t offset = sizeof(struct lod_header_t);
+    if( size < sizeof(struct lod_header_t)
+        || memcmp(header->magic, LOD_MAGIC, sizeof(header->magic)) != 0
+        || !next_section(&offset, offset, header->nb_buckets,
+            sizeof(struct lod_bucket_t), size)
+        || !next_section(&offset, header->codes_offset, header->nb_codes,
+            sizeof(struct lod_code_entry_t), size)
+        || !next_section(&offset, header->levels_offset, header->nb_levels,
+            sizeof(struct lod_level_entry_t), size)
+        || !next_section(&offset, header->pool_offset, header->pool_size,
+            1, size)
+        || offset != size || header->pool_size == 0
+        || data[size - 1] != '\0' ) return false;
+
+    const struct lod_code_entry_t *codes = (const struct lod_code_entry_t *)
+        &data[header->codes_offset];
+    const struct lod_level_entry_t *levels = (const struct lod_level_entry_t *)
+        &data[header->levels_offset];
+    for( uint64_t i = 0; i < header->nb_codes; ++i ) {
+        if( codes[i].code >= header->pool_size
+            || codes[i].first_level > header->nb_levels
+            || codes[i].nb_levels > header->nb_levels - codes[i].first_level ) {
+            return false;
+        }
+    }
+    for( uint64_t i = 0; i < header->nb_levels; ++i ) {
+        if( levels[i].level < LOD_MIN_LEVEL || levels[i].level > LOD_MAX_LEVEL
+            || levels[i].first_bucket > header->nb_buckets
+            || levels[i].nb_buckets
+               > header->nb_buckets - levels[i].first_bucket ) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/* Returns the coarsest level stored for *code* that is not coarser
+   than *level*, or NULL. */
+static const struct lod_level_entry_t *
+find_level( const struct lod_level_entry_t *levels,
+    const struct lod_code_entry_t *code, unsigned int level )
+{
+    const struct lod_level_entry_t *entry = NULL;
+    for( size_t k = 0; k < code->nb_levels; ++k ) {
+        if( levels[code->first_level + k].level > level ) break;
+        entry = &levels[code->first_level + k];
+    }
+    return entry;
+}
+
+
+int
+trace_filter_write_lod( struct trace_filter_t *trace,
+    FILE *from, FILE *lod )
+{
+    struct simulation_t *sim = &trace->sim;
+    size_t size;
+
+    if( sim->format == ndjson_trace_format || sim->resolution <= 1 ) {
+        return 1;
+    }
+    const char *data = map_input(fileno(lod), &size);
+    if( !data ) return 1;
+
+    const struct lod_header_t *header = (const struct lod_header_t *)data;
+    if( !valid_lod(data, size)
+        || !vcd_file_stamp_matches(fileno(from), &header->vcd)
+        || header->header_end > header->vcd.size ) {
+        unmap_input(data, size);
+        return 1;
+    }
+
+    /* The buckets of the coarsest level that aligns with the time window
+       and the pixels. */
+    unsigned int level = trailing_zeros(sim->start_time);
+    if( trailing_zeros(sim->resolution) < level ) {
+        level = trailing_zeros(sim->resolution);
+    }
+    bool bounded = sim->end_time <= header->last_timestamp;
+    if( bounded && trailing_zeros(sim->end_time) < level ) {
+        level = trailing_zeros(sim->end_time);
+    }
+    if( level < LOD_MIN_LEVEL ) {
+        unmap_input(data, size);
+        return 1;
+    }
+
+    /* The header definitions bind the selected signals to their
+       identifier codes (unless they were loaded from a hierarchy cache).
+       The parser stops right after $enddefinitions. */
+    if( trace->definitions_end == 0 ) {
+        read_input_range(from, 0, header->header_end, 0, write_trace, trace);
+        trace_filter_write(trace, "\n", 1);
+    }
+
+    const struct lod_bucket_t *buckets = (const struct lod_bucket_t *)
+        &data[sizeof(struct lod_header_t)];
+    const struct lod_code_entry_t *codes = (const struct lod_code_entry_t *)
+        &data[header->codes_offset];
+    const struct lod_level_entry_t *levels = (const struct lod_level_entry_t *)
+        &data[header->levels_offset];
+    const char *pool = &data[header->pool_offset];
+
+    /* Levels finer than the pixels are not stored for codes whose value
+       changes take barely more bytes than their buckets. */
+    for( size_t i = 0; i < header->nb_codes; ++i ) {
+        const char *code = &pool[codes[i].code];
+        if( find_timeline(sim->map, code, strlen(code))
+            && codes[i].nb_buckets > 0
+            && !find_level(levels, &codes[i], level) ) {
+            read_input_range(from, header->header_end, SIZE_MAX, 0,
+                write_trace, trace);
+            unmap_input(data, size);
+            return 0;
+        }
+    }
+
+    for( size_t i = 0; i < header->nb_codes; ++i ) {
+        const char *code = &pool[codes[i].code];
+        signal_buf *timeline = find_timeline(sim->map, code, strlen(code));
+        if( !timeline || codes[i].nb_levels == 0 ) continue;
+
+        const struct lod_level_entry_t *entry
+            = find_level(levels, &codes[i], level);
+        filter_level(sim, timeline,
+            &buckets[entry->first_bucket], entry->nb_buckets, entry->level,
+            bounded ? sim->end_time >> entry->level : UINT64_MAX,
+            pool, header->pool_size);
+    }
+    unmap_input(data, size);
+    return 0;
+}
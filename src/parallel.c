@@ -0,0 +1,307 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libvcd.h"
+
+/* Each thread is handed chunks of the value changes section in turn.
+   There are a few more chunks than threads to even out the load. */
+#define CHUNKS_PER_THREAD   4
+
+
+struct parse_chunk_t {
+    const char *first;
+    const char *last;
+    struct change_log_t log;
+};
+
+
+struct parse_pool_t {
+    pthread_mutex_t lock;
+    const struct simulation_t *sim;
+    size_t nb_signals;
+    struct parse_chunk_t *chunks;
+    size_t nb_chunks;
+    size_t next_chunk;
+    size_t done_chunk;          /* first chunk that reached end_time. */
+    struct vcd_stats_t *stats;  /* times are summed over threads. */
+};
+
+
+/* Adds the counts of a thread in *from* to *to*. */
+static void
+add_stats( struct vcd_stats_t *to, const struct vcd_stats_t *from )
+{
+    to->bytes += from->bytes;
+    for( size_t i = 0; i < VCD_TOKEN_TYPES; ++i ) {
+        to->tokens[i] += from->tokens[i];
+    }
+    to->broken_tokens += from->broken_tokens;
+    to->value_changes_matched += from->value_changes_matched;
+    to->value_changes_skipped += from->value_changes_skipped;
+    to->tokenize_time += from->tokenize_time;
+    to->parse_time += from->parse_time;
+}
+
+
+/* Returns a pointer to the first line starting with a '#' simulation time
+   in [first, last[, or *last* if there are none. */
+static const char *
+find_simulation_time( const char *first, const char *last )
+{
+    while( first != last ) {
+        const char *eol = memchr(first, '\n', last - first);
+        if( !eol || eol + 1 == last ) return last;
+        if( eol[1] == '#' ) return eol + 1;
+        first = eol + 1;
+    }
+    return last;
+}
+
+
+/* Returns a pointer to the first *keyword* token in [first, last[,
+   or *last* if there are none. */
+static const char *
+find_keyword( const char *first, const char *last, const char *keyword )
+{
+    const char *begin = first;
+    const size_t keyword_len = strlen(keyword);
+    while( (size_t)(last - first) >= keyword_len ) {
+        const char *p = memchr(first, '$', last - first - keyword_len + 1);
+        if( !p ) return last;
+        if( memcmp(p, keyword, keyword_len) == 0
+            && (p == begin || isspace(p[-1]))
+            && (p + keyword_len == last || isspace(p[keyword_len])) ) {
+            return p;
+        }
+        first = p + 1;
+    }
+    return last;
+}
+
+
+/* Returns a pointer to the first line starting with a '#' simulation time
+   in [first, last[ which is not inside a $comment block, or *last* if
+   there are none. Comments are tracked from *from*, a position before
+   *first* which is outside of any block. */
+static const char *
+find_split_point( const char *from, const char *first, const char *last )
+{
+    const char *split = find_simulation_time(first, last);
+    while( split != last ) {
+        const char *comment = find_keyword(from, split, "$comment");
+        if( comment == split ) break;
+        const char *end = find_keyword(comment, last, "$end");
+        if( end == last ) return last;
+        from = end + 4;
+        if( split < from ) {
+            split = find_simulation_time(from, last);
+        }
+    }
+    return split;
+}
+
+
+/* Returns a pointer to the first simulation time after the header
+   definitions, or *last* if there are none. */
+static const char *
+find_header_end( const char *first, const char *last )
+{
+    static const char keyword[] = "$enddefinitions";
+    const size_t keyword_len = sizeof(keyword) - 1;
+    while( (size_t)(last - first) >= keyword_len ) {
+        const char *p = memchr(first, '$', last - first - keyword_len + 1);
+        if( !p ) return last;
+        if( memcmp(p, keyword, keyword_len) == 0 ) {
+            return find_simulation_time(p, last);
+        }
+        first = p + 1;
+    }
+    return last;
+}
+
+
+static void *
+parse_worker( void *arg )
+{
+    struct parse_pool_t *pool = (struct parse_pool_t *)arg;
+    struct vcd_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+    size_t *slots = calloc(pool->nb_signals + 1, sizeof(size_t));
+    if( !slots ) {
+        fprintf(stderr, "error: unable to allocate change log\n");
+        return NULL;
+    }
+    for( ; ; ) {
+        pthread_mutex_lock(&pool->lock);
+        size_t next = pool->next_chunk++;
+        bool skip = next > pool->done_chunk;
+        pthread_mutex_unlock(&pool->lock);
+        if( next >= pool->nb_chunks ) break;
+        /* No need to tokenize chunks after the end of the time window. */
+        if( skip ) continue;
+
+        struct parse_chunk_t *chunk = &pool->chunks[next];
+        struct simulation_t sim = *pool->sim;
+        struct tokenizer_t tokenizer;
+        sim.current_timestamp = 0;
+        sim.done = false;
+        sim.log = &chunk->log;
+        sim.next = NULL;
+        chunk->log.slots = slots;
+        init_tokenizer(&tokenizer, NULL, &sim);
+        if( pool->stats ) tokenizer.parser.stats = &stats;
+        tokenize_header_and_definitions(&tokenizer,
+            chunk->first, chunk->last - chunk->first);
+        destroy_tokenizer(&tokenizer);
+        for( size_t i = 0; i < chunk->log.before_size; ++i ) {
+            slots[chunk->log.before[i].position] = 0;
+        }
+        chunk->log.slots = NULL;
+
+        if( sim.done ) {
+            pthread_mutex_lock(&pool->lock);
+            if( next < pool->done_chunk ) pool->done_chunk = next;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    free(slots);
+    if( pool->stats ) {
+        pthread_mutex_lock(&pool->lock);
+        add_stats(pool->stats, &stats);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+
+int
+trace_filter_write_parallel( struct trace_filter_t *trace,
+    int fd, int nb_threads )
+{
+    size_t size;
+    const char *data = map_input(fd, &size);
+    if( !data ) {
+        return 1;
+    }
+    const char *last = data + size;
+    /* When the header definitions were loaded from a hierarchy cache,
+       the tokenizer resumes right after them. */
+    const char *begin = data
+        + (trace->definitions_end < size ? trace->definitions_end : size);
+    const char *header_end = trace->definitions_end > 0 ?
+        find_simulation_time(begin, last) : find_header_end(data, last);
+    if( nb_threads <= 1 || header_end == last ) {
+        trace_filter_write(trace, begin, last - begin);
+        unmap_input(data, size);
+        return 0;
+    }
+
+    /* The header definitions fill in the signal map. */
+    size_t header_len = header_end - begin;
+    if( trace_filter_write(trace, begin, header_len) != header_len ) {
+        unmap_input(data, size);
+        return 0;
+    }
+
+    size_t nb_signals = 0;
+    signal_buf *curr;
+    for( curr = trace->map.head; curr; curr = curr->next ) {
+        curr->position = nb_signals++;
+    }
+    struct parse_pool_t pool;
+    pool.sim = &trace->sim;
+    pool.nb_signals = nb_signals;
+    pool.nb_chunks = nb_threads * CHUNKS_PER_THREAD;
+    pool.next_chunk = 0;
+    pool.done_chunk = pool.nb_chunks;
+    pool.stats = trace->tokenizer.parser.stats;
+    pool.chunks = calloc(pool.nb_chunks, sizeof(struct parse_chunk_t));
+    signal_buf **timelines = malloc((nb_signals + 1) * sizeof(signal_buf*));
+    pthread_t *threads = malloc(nb_threads * sizeof(pthread_t));
+    if( !pool.chunks || !timelines || !threads ) {
+        fprintf(stderr, "error: unable to allocate %d threads\n", nb_threads);
+        free(pool.chunks);
+        free(timelines);
+        free(threads);
+        trace_filter_write(trace, header_end, last - header_end);
+        unmap_input(data, size);
+        return 0;
+    }
+    for( curr = trace->map.head; curr; curr = curr->next ) {
+        timelines[curr->position] = curr;
+    }
+
+    /* Split value changes at simulation times, outside of comments. */
+    const char *first = header_end;
+    size_t chunk_size = (last - header_end) / pool.nb_chunks + 1;
+    for( size_t i = 0; i < pool.nb_chunks; ++i ) {
+        pool.chunks[i].first = first;
+        if( (size_t)(last - first) > chunk_size ) {
+            first = find_split_point(first, first + chunk_size, last);
+        } else {
+            first = last;
+        }
+        pool.chunks[i].last = first;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    int nb_started = 0;
+    for( ; nb_started < nb_threads; ++nb_started ) {
+        if( pthread_create(&threads[nb_started], NULL,
+                parse_worker, &pool) != 0 ) {
+            break;
+        }
+    }
+    if( nb_started == 0 ) {
+        parse_worker(&pool);
+    }
+    for( int i = 0; i < nb_started; ++i ) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    /* Replay value changes in the order they appear in the file. */
+    for( size_t i = 0; i < pool.nb_chunks; ++i ) {
+        struct parse_chunk_t *chunk = &pool.chunks[i];
+        if( i <= pool.done_chunk ) {
+            replay_change_log(&trace->sim, timelines, &chunk->log);
+        }
+        free(chunk->log.before);
+        free(chunk->log.events);
+    }
+    if( pool.done_chunk < pool.nb_chunks ) {
+        trace->sim.done = true;
+    }
+    free(pool.chunks);
+    free(timelines);
+    free(threads);
+    unmap_input(data, size);
+    return 0;
+}
@@ -22,13 +22,20 @@
    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include "libvcd.h"
 
 #define NAMESPACE_SEP        '/'
 
+/* Value of *mark* while the tokenizer has not found the delimiter
+   between a value and an identifier code in the current token. */
+#define NO_MARK              ((size_t)-1)
+
 static int
 append_to_prefix( char *scope_prefix, const char *src, size_t len )
 {
@@ -60,7 +67,7 @@ remove_last_prefix( char *scope_prefix ) {
 }
 
 
-static void
+void
 init_tokenizer( struct tokenizer_t *tokenizer,
     struct definitions_t *defs, struct simulation_t *sim )
 {
@@ -68,11 +75,50 @@ init_tokenizer( struct tokenizer_t *tokenizer,
     tokenizer->tok = err_vcd_token;
     tokenizer->last_significant_tok = err_vcd_token;
     tokenizer->line_num = 0;
+    tokenizer->offset = 0;
     tokenizer->parser.state = NULL;
-    tokenizer->parser.identifier_code[0] = '\0';
+    tokenizer->parser.identifier_code = NULL;
+    tokenizer->parser.identifier_code_capacity = 0;
+    tokenizer->parser.broken_token = NULL;
+    tokenizer->parser.broken_token_capacity = 0;
     tokenizer->parser.broken_token_len = 0;
+    tokenizer->parser.broken_token_mark = NO_MARK;
     tokenizer->parser.defs = defs;
     tokenizer->parser.sim = sim;
+    tokenizer->parser.index = NULL;
+    tokenizer->parser.lod = NULL;
+    tokenizer->parser.stats = NULL;
+}
+
+
+void
+destroy_tokenizer( struct tokenizer_t *tokenizer )
+{
+    free(tokenizer->parser.identifier_code);
+    tokenizer->parser.identifier_code = NULL;
+    tokenizer->parser.identifier_code_capacity = 0;
+    free(tokenizer->parser.broken_token);
+    tokenizer->parser.broken_token = NULL;
+    tokenizer->parser.broken_token_capacity = 0;
+}
+
+
+/** Makes room for *size* bytes in *buffer*. */
+static bool
+reserve_buffer( char **buffer, size_t *capacity, size_t size )
+{
+    if( size <= *capacity ) return true;
+    size_t new_capacity = *capacity > 0 ? *capacity : BUFFER_SIZE;
+    while( new_capacity < size ) new_capacity *= 2;
+    char *new_buffer = realloc(*buffer, new_capacity);
+    if( !new_buffer ) {
+        fprintf(stderr, "error: unable to allocate %zu bytes for a token\n",
+            new_capacity);
+        return false;
+    }
+    *buffer = new_buffer;
+    *capacity = new_capacity;
+    return true;
 }
 
 
@@ -86,6 +132,8 @@ init_definitions( struct definitions_t *defs,
     defs->map = map;
     defs->print = print;
     defs->obj = obj;
+    defs->next = NULL;
+    defs->hierarchy = NULL;
     memset(defs->scope_prefix, 0, FILENAME_MAX);
 }
 
@@ -99,33 +147,31 @@ init_simulation( struct simulation_t *sim, const signal_map *map,
     sim->start_time = start_time;
     sim->end_time = end_time;
     sim->resolution = resolution;
+    sim->done = false;
+    sim->log = NULL;
+    sim->format = json_trace_format;
+    sim->print = NULL;
+    sim->obj = NULL;
+    sim->window_open = false;
+    sim->held = NULL;
+    sim->bucket = 0;
+    sim->next = NULL;
 }
 
-static void
+static bool
 set_identifier_code( struct parser_t *parser,
     const char *buffer, size_t start, size_t last )
 {
     size_t length = last - start;
-    assert( length < sizeof(parser->identifier_code) - 1);
-    strncpy(parser->identifier_code, &buffer[start], length);
+    if( !reserve_buffer(&parser->identifier_code,
+            &parser->identifier_code_capacity, length + 1) ) {
+        return false;
+    }
+    memcpy(parser->identifier_code, &buffer[start], length);
     parser->identifier_code[length] = '\0';
+    return true;
 }
 
-static void
-set_value_change( signal_buf *timeline,
-    size_t timestamp, const char *buffer, size_t start, size_t last )
-{
-    timeline->initial_change_record_timestamp = timestamp;
-    timeline->initial_change_record_length = last - start;
-    assert( timeline->initial_change_record_length
-        < sizeof(timeline->initial_change_record_value_change) - 1);
-    strncpy(timeline->initial_change_record_value_change,
-        &buffer[start], timeline->initial_change_record_length);
-    timeline->initial_change_record_value_change[
-        timeline->initial_change_record_length] = '\0';
-}
-
-
 static size_t
 as_timestamp( const char *buffer, size_t start, size_t last )
 {
@@ -139,18 +185,176 @@ as_timestamp( const char *buffer, size_t start, size_t last )
 }
 
 
+/** Appends a [timestamp, value] record to *timeline*. When *changes*
+    is not zero, it is appended as a third element to the record,
+    followed by true when *unknown*.
+ */
 static void
 print_timestamp_and_value( signal_buf *timeline,
-    size_t timestamp, const char *value_change, size_t length )
+    size_t timestamp, const char *value_change, size_t length,
+    size_t changes, bool unknown )
+{
+    char record[40];
+    int len = snprintf(record, sizeof(record), "[%zu, \"", timestamp);
+    signal_buf_append(timeline, record, len);
+    signal_buf_append(timeline, value_change, length);
+    if( changes > 0 ) {
+        len = snprintf(record, sizeof(record), "\", %zu%s]", changes,
+            unknown ? ", true" : "");
+        signal_buf_append(timeline, record, len);
+    } else {
+        signal_buf_append(timeline, "\"]", 2);
+    }
+}
+
+
+static void
+stream_print( struct simulation_t *sim, const char *buffer, size_t length )
+{
+    if( sim->held ) {
+        signal_buf_append(sim->held, buffer, length);
+    } else {
+        sim->print(sim->obj, buffer, length);
+    }
+}
+
+
+/** Streams a value change of *timeline* as a line of JSON,
+    once for each alias of its identifier code.
+ */
+static void
+stream_timestamp_and_value( struct simulation_t *sim,
+    const signal_buf *timeline, size_t timestamp,
+    const char *value_change, size_t length, size_t changes, bool unknown )
+{
+    char record[112];
+    int len = snprintf(record, sizeof(record), "{\"t\": %zu, \"name\": \"",
+        timestamp);
+    int changes_len = changes > 0 ? snprintf(&record[len],
+        sizeof(record) - len, "\", \"n\": %zu%s}\n", changes,
+        unknown ? ", \"x\": true" : "") : 0;
+    for( ; timeline; timeline = timeline->next_alias ) {
+        stream_print(sim, record, len);
+        stream_print(sim, timeline->name, strlen(timeline->name));
+        stream_print(sim, "\", \"v\": \"", 9);
+        stream_print(sim, value_change, length);
+        if( changes > 0 ) {
+            stream_print(sim, &record[len], changes_len);
+        } else {
+            stream_print(sim, "\"}\n", 3);
+        }
+    }
+}
+
+
+/** Writes a value change of *timeline* in the format of *sim*.
+ */
+static void
+print_record( struct simulation_t *sim, signal_buf *timeline,
+    size_t timestamp, const char *value_change, size_t length,
+    size_t changes, bool unknown )
+{
+    if( sim->format == ndjson_trace_format ) {
+        stream_timestamp_and_value(sim, timeline,
+            timestamp, value_change, length, changes, unknown);
+        return;
+    }
+    if( sim->format == bin_trace_format ) {
+        binary_record_append(timeline,
+            timestamp, value_change, length, changes, unknown);
+        return;
+    }
+    if( timeline->text_head ) {
+        signal_buf_append(timeline, ",\n", 2);
+    }
+    print_timestamp_and_value(timeline,
+        timestamp, value_change, length, changes, unknown);
+}
+
+
+/** Prints the last value change folded into the current pixel
+    of a decimated *timeline*.
+ */
+static void
+print_last_change_record( struct simulation_t *sim, signal_buf *timeline )
+{
+    if( timeline->bucket_changes > 1 ) {
+        change_record *record = &timeline->last_change_record;
+        /* When value changes were skipped, mark the record
+           with the number of changes in the pixel, and whether
+           one of them was unknown. */
+        bool skipped = timeline->bucket_changes > 2;
+        print_record(sim, timeline,
+            record->timestamp, record->value_change, record->length,
+            skipped ? timeline->bucket_changes : 0,
+            skipped && timeline->bucket_unknown);
+    }
+    timeline->bucket_changes = 0;
+}
+
+
+static void
+print_last_change_records( struct simulation_t *sim )
+{
+    signal_buf *curr = sim->map->head;
+    while( curr ) {
+        print_last_change_record(sim, curr);
+        curr = curr->next;
+    }
+}
+
+
+/** Returns true when a signal has a value from before the time window
+    to be streamed.
+ */
+static bool
+has_initial_change_records( const struct simulation_t *sim )
+{
+    const signal_buf *curr;
+    for( curr = sim->map->head; curr; curr = curr->next ) {
+        if( curr->initial_change_record.value_change ) return true;
+    }
+    return false;
+}
+
+
+/** Streams the value before the time window of every signal which
+    did not change at start_time (as in json_trace_format), then
+    the records held at start_time.
+ */
+static void
+print_initial_change_records( struct simulation_t *sim )
+{
+    signal_buf *held = sim->held;
+    sim->held = NULL;
+    signal_buf *curr = sim->map->head;
+    while( curr ) {
+        change_record *record = &curr->initial_change_record;
+        if( record->value_change && !curr->not_first_record ) {
+            print_record(sim, curr, record->timestamp,
+                record->value_change, record->length, 0, false);
+        }
+        curr = curr->next;
+    }
+    if( held ) {
+        signal_buf_print(held, sim->print, sim->obj);
+        text_chunk *chunk = held->text_head;
+        while( chunk ) {
+            text_chunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
+        }
+        free(held);
+    }
+}
+
+
+static void
+discard_print( void *obj, const char *buffer, size_t length )
 {
-    // XXX Inefficient code here!
-    size_t len = strlen(timeline->text);
-    snprintf(&timeline->text[len], BUFFER_SIZE - len, "[%zd, \"", timestamp);
-    len = strlen(timeline->text);
-    if( !(length > BUFFER_SIZE - len) ) {
-        memcpy(&timeline->text[len], value_change, length);
-    }
-    strncat(timeline->text, "\"]", BUFFER_SIZE);
+    (void)obj;
+    (void)buffer;
+    (void)length;
 }
 
 
@@ -175,8 +379,14 @@ escape_identifier_code( const char *ident,
            "identifier code is a code composed of the printable characters
            which are in the ASCII character set from ! to ~ (decimal 33
            to 126)" and escaped characters from http://json.org.  */
-        if( (*p == '"') | (*p == '\\') | (*p == '/') ) print(obj, "\\", 1);
-        print(obj, p++, 1);
+        const char *run = p;
+        while( *p && (*p != '"') & (*p != '\\') & (*p != '/') ) ++p;
+        if( p > run ) {
+            print(obj, run, p - run);
+        } else {
+            print(obj, "\\", 1);
+            print(obj, p++, 1);
+        }
     }
     print(obj, "\"", 1);
 }
@@ -185,7 +395,14 @@ escape_identifier_code( const char *ident,
 static void
 print_identifier_code( struct definitions_t *defs, const char *ident )
 {
+    const struct definitions_t *next;
     insert_short_key(defs->map, defs->scope_prefix, ident);
+    for( next = defs->next; next; next = next->next ) {
+        insert_short_key(next->map, defs->scope_prefix, ident);
+    }
+    if( defs->hierarchy ) {
+        hierarchy_add_var(defs->hierarchy, defs->scope_prefix, ident);
+    }
     escape_identifier_code(ident, defs->print, defs->obj);
     remove_last_prefix(defs->scope_prefix);
 }
@@ -234,6 +451,21 @@ print_exit_field_value(  struct definitions_t *defs )
 }
 
 
+/** Indents the next line by *scope_depth* tabs.
+ */
+static void
+print_indent( struct definitions_t *defs )
+{
+    static const char tabs[] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+    int depth = defs->scope_depth;
+    while( depth > 0 ) {
+        int len = depth < (int)sizeof(tabs) - 1 ? depth : (int)sizeof(tabs) - 1;
+        defs->print(defs->obj, tabs, len);
+        depth -= len;
+    }
+}
+
+
 static void
 print_enter_scope( struct definitions_t *defs,
     const char *buffer, size_t start, size_t last )
@@ -246,11 +478,13 @@ print_enter_scope( struct definitions_t *defs,
         defs->print(defs->obj, "\"definitions\": {\n", 17);
         ++defs->scope_depth;
     }
-    for( int i = 0; i < defs->scope_depth; ++i )
-        defs->print(defs->obj, "\t", 1);
+    print_indent(defs);
 
     append_to_prefix(defs->scope_prefix, &buffer[start], last - start);
     ++defs->scope_depth;
+    if( defs->hierarchy ) {
+        hierarchy_enter_scope(defs->hierarchy, &buffer[start], last - start);
+    }
 
     defs->print(defs->obj, "\"", 1);
     defs->print(defs->obj, &buffer[start], last - start);
@@ -263,10 +497,10 @@ print_exit_scope( struct definitions_t *defs )
 {
     --defs->scope_depth;
     remove_last_prefix(defs->scope_prefix);
+    if( defs->hierarchy ) hierarchy_exit_scope(defs->hierarchy);
 
     defs->print(defs->obj, "\n", 1);
-    for( int i = 0; i < defs->scope_depth; ++i )
-        defs->print(defs->obj, "\t", 1);
+    print_indent(defs);
     defs->print(defs->obj, "}", 1);
 }
 
@@ -279,8 +513,7 @@ print_enter_var( struct definitions_t *defs,
         defs->print(defs->obj, ",\n", 2);
     }
     defs->enter_scope = false;
-    for( int i = 0; i < defs->scope_depth; ++i )
-        defs->print(defs->obj, "\t", 1);
+    print_indent(defs);
     defs->print(defs->obj, "\"", 1);
     defs->print(defs->obj, &buffer[start], last - start);
     append_to_prefix(defs->scope_prefix, &buffer[start], last - start);
@@ -298,22 +531,26 @@ print_exit_var( struct definitions_t *defs,
 }
 
 
-static void
-print_value_change( struct simulation_t *sim,
-    const char *buffer, size_t start, size_t last, size_t mark )
+bool
+value_change_is_unknown( const char *value_change, size_t length )
 {
-    /* mark indicates the end of the value and there is a space
-       delimiter between the value and symbol name for bit vector changes. */
-    assert( last >= mark );
-    size_t len = last - mark;
-    if( buffer[mark] == ' ' ) {
-        assert( len >= 1 );
-        --len;
+    for( size_t i = 0; i < length; ++i ) {
+        switch( value_change[i] ) {
+        case 'x': case 'X': case 'z': case 'Z':
+            return true;
+        }
     }
-    signal_buf *timeline = find_timeline(
-        sim->map, &buffer[last - len], len);
-    if( !timeline ) return;
+    return false;
+}
 
+
+/** Adds the change of *timeline* to *value_change* at the current
+    simulation time to the trace being filtered.
+ */
+static void
+filter_value_change( struct simulation_t *sim, signal_buf *timeline,
+    const char *value_change, size_t length )
+{
     /* At this point we have a filtered variable.
        -----------------------------------> time
        ^              ^              ^
@@ -321,28 +558,183 @@ print_value_change( struct simulation_t *sim,
     */
     if( (sim->start_time <= sim->current_timestamp)
         & (sim->current_timestamp < sim->end_time)  ) {
-        if( timeline->not_first_record ) {
-            // XXX Inefficient
-            strncat(timeline->text, ",\n", BUFFER_SIZE);
-        } else {
-            if( sim->start_time < sim->current_timestamp ) {
-                print_timestamp_and_value(timeline,
-                    timeline->initial_change_record_timestamp,
-                    timeline->initial_change_record_value_change,
-                    timeline->initial_change_record_length);
-                /* We are going to print two records back-to-back here. */
-                // XXX Inefficient
-                strncat(timeline->text, ",\n", BUFFER_SIZE);
+        bool streaming = (sim->format == ndjson_trace_format);
+        if( streaming && !sim->window_open ) {
+            /* Records are streamed in time order, so the values
+               before the time window go first. Signals which change
+               at start_time have none, which is only known once
+               the simulation time moves past start_time. */
+            sim->window_open = true;
+            if( sim->current_timestamp == sim->start_time
+                && has_initial_change_records(sim) ) {
+                sim->held = calloc(1, sizeof(signal_buf));
+                if( sim->held ) sim->held->name = "start_time";
             }
+            if( !sim->held ) print_initial_change_records(sim);
+        } else if( sim->held && sim->start_time < sim->current_timestamp ) {
+            print_initial_change_records(sim);
+        }
+        if( sim->resolution > 1 ) {
+            /* Decimation: we keep the first and last changes in a pixel. */
+            size_t bucket
+                = (sim->current_timestamp - sim->start_time) / sim->resolution;
+            if( streaming && bucket != sim->bucket ) {
+                /* Flush the pixels left behind by all signals. */
+                print_last_change_records(sim);
+                sim->bucket = bucket;
+            }
+            bool unknown = value_change_is_unknown(value_change, length);
+            if( timeline->not_first_record && bucket == timeline->bucket ) {
+                ++timeline->bucket_changes;
+                timeline->bucket_unknown |= unknown;
+                set_change_record(&timeline->last_change_record,
+                    sim->current_timestamp, value_change, length);
+                return;
+            }
+            print_last_change_record(sim, timeline);
+            timeline->bucket = bucket;
+            timeline->bucket_changes = 1;
+            timeline->bucket_unknown = unknown;
+        }
+        if( !timeline->not_first_record && !streaming
+            && sim->start_time < sim->current_timestamp ) {
+            change_record *record = &timeline->initial_change_record;
+            print_record(sim, timeline, record->timestamp,
+                record->value_change, record->length, 0, false);
         }
         /* No need to buffer here. */
-        print_timestamp_and_value(timeline,
-            sim->current_timestamp, &buffer[start], mark - start);
+        print_record(sim, timeline,
+            sim->current_timestamp, value_change, length, 0, false);
         timeline->not_first_record = true;
 
     } else {
-        set_value_change(timeline,
-            sim->current_timestamp, buffer, start, mark);
+        set_change_record(&timeline->initial_change_record,
+            sim->current_timestamp, value_change, length);
+    }
+}
+
+
+/** Records the change of *timeline* to *value_change* in *log*,
+    to be replayed later through filter_value_change.
+ */
+static void
+log_value_change( struct change_log_t *log, size_t timestamp, bool before,
+    const signal_buf *timeline, const char *value_change, size_t length )
+{
+    struct change_event_t *event;
+    if( before && log->slots[timeline->position] > 0 ) {
+        /* Only the last change before the time window matters. */
+        event = &log->before[log->slots[timeline->position] - 1];
+    } else {
+        struct change_event_t **events = before ? &log->before : &log->events;
+        size_t *size = before ? &log->before_size : &log->events_size;
+        size_t *capacity = before ? &log->before_capacity
+            : &log->events_capacity;
+        if( *size == *capacity ) {
+            size_t new_capacity = *capacity > 0 ? 2 * *capacity : 256;
+            struct change_event_t *new_events = realloc(*events,
+                new_capacity * sizeof(struct change_event_t));
+            if( !new_events ) {
+                fprintf(stderr, "error: unable to allocate change log\n");
+                return;
+            }
+            *events = new_events;
+            *capacity = new_capacity;
+        }
+        event = &(*events)[(*size)++];
+        if( before ) log->slots[timeline->position] = *size;
+    }
+    event->position = timeline->position;
+    event->timestamp = timestamp;
+    event->value_change = value_change;
+    event->length = length;
+}
+
+
+/** Filters a value change through *sim* and the batched simulations
+    after it. This function returns true when the identifier code
+    of the value change belongs to a selected signal.
+ */
+static bool
+print_value_change( struct simulation_t *sim,
+    const char *buffer, size_t start, size_t last, size_t mark )
+{
+    bool matched = false;
+    /* mark indicates the end of the value and there is a space
+       delimiter between the value and symbol name for bit vector changes. */
+    assert( last >= mark );
+    size_t len = last - mark;
+    if( buffer[mark] == ' ' ) {
+        assert( len >= 1 );
+        --len;
+    }
+    /* Batched queries each filter the value change through
+       their own simulation. */
+    for( ; sim; sim = sim->next ) {
+        if( sim->done ) continue;
+        signal_buf *timeline = find_timeline(
+            sim->map, &buffer[last - len], len);
+        if( !timeline ) continue;
+        matched = true;
+
+        if( sim->log ) {
+            log_value_change(sim->log, sim->current_timestamp,
+                sim->current_timestamp < sim->start_time,
+                timeline, &buffer[start], mark - start);
+            continue;
+        }
+        filter_value_change(sim, timeline, &buffer[start], mark - start);
+    }
+    return matched;
+}
+
+
+static void
+count_value_change( struct vcd_stats_t *stats, bool matched )
+{
+    if( matched ) {
+        ++stats->value_changes_matched;
+    } else {
+        ++stats->value_changes_skipped;
+    }
+}
+
+
+void
+filter_value_change_summary( struct simulation_t *sim, signal_buf *timeline,
+    size_t first_timestamp, const char *first_value, size_t first_length,
+    size_t last_timestamp, const char *last_value, size_t last_length,
+    size_t changes, bool unknown )
+{
+    sim->current_timestamp = first_timestamp;
+    filter_value_change(sim, timeline, first_value, first_length);
+    if( changes > 1 ) {
+        /* The last change is pending until the next pixel,
+           as if the changes in between had been folded in. */
+        timeline->bucket_changes = changes;
+        timeline->bucket_unknown = unknown;
+        set_change_record(&timeline->last_change_record,
+            last_timestamp, last_value, last_length);
+    }
+}
+
+
+void
+replay_change_log( struct simulation_t *sim, signal_buf **timelines,
+    const struct change_log_t *log )
+{
+    size_t i;
+    for( i = 0; i < log->before_size; ++i ) {
+        const struct change_event_t *event = &log->before[i];
+        sim->current_timestamp = event->timestamp;
+        filter_value_change(sim, timelines[event->position],
+            event->value_change, event->length);
+    }
+    for( i = 0; i < log->events_size; ++i ) {
+        const struct change_event_t *event = &log->events[i];
+        sim->current_timestamp = event->timestamp;
+        filter_value_change(sim, timelines[event->position],
+            event->value_change, event->length);
     }
 }
 
@@ -350,12 +742,16 @@ print_value_change( struct simulation_t *sim,
 #define advance(state) { trans = &&state; goto advancePointer; }
 
 /** push token into parser.
+
+    *offset* is the position of *buffer* in the VCD file.
 */
 static bool
 push_token( struct parser_t *parser, vcd_token token, const char *buffer,
-    size_t start, size_t last, size_t mark, bool broken, size_t line_num )
+    size_t start, size_t last, size_t mark, bool broken, size_t line_num,
+    size_t offset )
 {
     void *trans = parser->state;
+    size_t token_offset = offset + start;
 
 #if 0
     printf("%ld: token %d (%ld,%ld,%ld) %s\n",
@@ -365,20 +761,39 @@ push_token( struct parser_t *parser, vcd_token token, const char *buffer,
     /* Tokens which are broken over two input buffers must be
        reconstructed in a single linear block first. */
     if( broken ) {
+        if( parser->broken_token_len == 0 ) {
+            parser->broken_token_offset = token_offset;
+        }
+        if( !reserve_buffer(&parser->broken_token,
+                &parser->broken_token_capacity,
+                parser->broken_token_len + (last - start)) ) {
+            return true;
+        }
         memcpy(&parser->broken_token[parser->broken_token_len],
             &buffer[start], last - start);
+        if( mark != NO_MARK ) {
+            parser->broken_token_mark
+                = parser->broken_token_len + (mark - start);
+        }
         parser->broken_token_len += last - start;
-        parser->broken_token_mark = mark - start;
         return false;
 
     } else if( parser->broken_token_len > 0 ) {
+        if( !reserve_buffer(&parser->broken_token,
+                &parser->broken_token_capacity,
+                parser->broken_token_len + (last - start)) ) {
+            return true;
+        }
         memcpy(&parser->broken_token[parser->broken_token_len],
             &buffer[start], last - start);
         buffer = parser->broken_token;
-        mark = mark > start ? mark - start : parser->broken_token_mark;
+        mark = mark != NO_MARK ? parser->broken_token_len + (mark - start)
+            : parser->broken_token_mark;
         last = parser->broken_token_len + (last - start);
         start = 0;
+        token_offset = parser->broken_token_offset;
         parser->broken_token_len = 0;
+        parser->broken_token_mark = NO_MARK;
     }
 
     if( trans != NULL ) goto *trans; else goto value_change_dump_definitions;
@@ -401,11 +816,46 @@ value_change_dump_definitions:
     case var_vcd_token:
         advance(var_var_type);
     case enddefinitions_vcd_token:
-        if( parser->defs ) print_exit_scope(parser->defs);
+        if( parser->defs ) {
+            struct definitions_t *defs;
+            print_exit_scope(parser->defs);
+            for( defs = parser->defs; defs; defs = defs->next ) {
+                remove_signal_patterns(defs->map);
+            }
+        }
+        if( parser->lod ) {
+            parser->lod->header_end = token_offset + (last - start);
+        }
+        if( parser->defs && parser->defs->hierarchy ) {
+            hierarchy_enddefinitions(parser->defs->hierarchy,
+                token_offset + (last - start));
+        }
+        /* Only the header definitions were requested, we are done. */
+        if( !parser->sim && !parser->index && !parser->lod ) return true;
         advance(end_keyword);
     case sim_time_vcd_token:
         if( parser->sim ) {
-            parser->sim->current_timestamp = as_timestamp(buffer, start, last);
+            size_t timestamp = as_timestamp(buffer, start, last);
+            bool done = true;
+            struct simulation_t *sim;
+            for( sim = parser->sim; sim; sim = sim->next ) {
+                sim->current_timestamp = timestamp;
+                if( sim->held && sim->start_time < timestamp ) {
+                    print_initial_change_records(sim);
+                }
+                if( timestamp >= sim->end_time ) sim->done = true;
+                done &= sim->done;
+            }
+            /* All time windows are closed, there is nothing left
+               to filter in the rest of the file. */
+            if( done ) return true;
+        }
+        if( parser->index ) {
+            time_index_timestamp(parser->index,
+                as_timestamp(buffer, start, last), token_offset);
+        }
+        if( parser->lod ) {
+            lod_timestamp(parser->lod, as_timestamp(buffer, start, last));
         }
         /* We encountered a simulation time at the top level,
            we are definitely done with the declaration commands. */
@@ -413,14 +863,30 @@ value_change_dump_definitions:
 
     case value_change_bit_vcd_token:
         if( parser->sim ) {
-            print_value_change(parser->sim, buffer, start, last, mark);
+            bool matched = print_value_change(parser->sim,
+                buffer, start, last, mark);
+            if( parser->stats ) count_value_change(parser->stats, matched);
+        }
+        if( parser->index ) {
+            time_index_value_change(parser->index, buffer, start, last, mark);
+        }
+        if( parser->lod ) {
+            lod_value_change(parser->lod, buffer, start, last, mark);
         }
         advance(value_change_dump_definitions);
     case value_change_binary_vcd_token:
     case value_change_real_vcd_token:
         /* Remove the leading 'b', 'B', 'r' or 'R' */
         if( parser->sim ) {
-            print_value_change(parser->sim, buffer, start + 1, last, mark);
+            bool matched = print_value_change(parser->sim,
+                buffer, start + 1, last, mark);
+            if( parser->stats ) count_value_change(parser->stats, matched);
+        }
+        if( parser->index ) {
+            time_index_value_change(parser->index, buffer, start, last, mark);
+        }
+        if( parser->lod ) {
+            lod_value_change(parser->lod, buffer, start + 1, last, mark);
         }
         advance(value_change_dump_definitions);
     case dumpvars_vcd_token:
@@ -473,6 +939,10 @@ scope_scope_identifier:
 var_var_type:
     if( token == whitespace_vcd_token ) advance(var_var_type);
     if( token == data_vcd_token ) {
+        if( parser->defs && parser->defs->hierarchy ) {
+            hierarchy_var_type(parser->defs->hierarchy,
+                &buffer[start], last - start);
+        }
         advance(var_var_size);
     }
     goto error;
@@ -480,6 +950,10 @@ var_var_type:
 var_var_size:
     if( token == whitespace_vcd_token ) advance(var_var_size);
     if( token == data_vcd_token ) {
+        if( parser->defs && parser->defs->hierarchy ) {
+            hierarchy_var_width(parser->defs->hierarchy,
+                &buffer[start], last - start);
+        }
         advance(var_var_identifier);
     }
     goto error;
@@ -487,7 +961,7 @@ var_var_size:
 var_var_identifier:
     if( token == whitespace_vcd_token ) advance(var_var_identifier);
     if( is_data_token(token) ) {
-        set_identifier_code(parser, buffer, start, last);
+        if( !set_identifier_code(parser, buffer, start, last) ) return true;
         advance(var_var_reference);
     }
     goto error;
@@ -530,14 +1004,30 @@ dumpall_variables:
     switch( token ) {
     case value_change_bit_vcd_token:
         if( parser->sim ) {
-            print_value_change(parser->sim, buffer, start, last, mark);
+            bool matched = print_value_change(parser->sim,
+                buffer, start, last, mark);
+            if( parser->stats ) count_value_change(parser->stats, matched);
+        }
+        if( parser->index ) {
+            time_index_value_change(parser->index, buffer, start, last, mark);
+        }
+        if( parser->lod ) {
+            lod_value_change(parser->lod, buffer, start, last, mark);
         }
         advance(dumpall_variables);
     case value_change_binary_vcd_token:
     case value_change_real_vcd_token:
         /* Remove the leading 'b', 'B', 'r' or 'R' */
         if( parser->sim ) {
-            print_value_change(parser->sim, buffer, start + 1, last, mark);
+            bool matched = print_value_change(parser->sim,
+                buffer, start + 1, last, mark);
+            if( parser->stats ) count_value_change(parser->stats, matched);
+        }
+        if( parser->index ) {
+            time_index_value_change(parser->index, buffer, start, last, mark);
+        }
+        if( parser->lod ) {
+            lod_value_change(parser->lod, buffer, start + 1, last, mark);
         }
         advance(dumpall_variables);
     case end_vcd_token:
@@ -564,38 +1054,56 @@ advancePointer:
 }
 
 
-size_t tokenize_header_and_definitions( struct tokenizer_t *tokenizer,
+/** Same as push_token, counting and timing tokens in *parser->stats*. */
+static bool
+push_counted_token( struct parser_t *parser, vcd_token token,
+    const char *buffer, size_t start, size_t last, size_t mark, bool broken,
+    size_t line_num, size_t offset )
+{
+    struct vcd_stats_t *stats = parser->stats;
+    if( !stats ) {
+        return push_token(parser, token, buffer, start, last, mark, broken,
+            line_num, offset);
+    }
+    if( !broken ) {
+        ++stats->tokens[token];
+    } else if( parser->broken_token_len == 0 ) {
+        ++stats->broken_tokens;
+    }
+    double print_time = stats->print_time;
+    double started = vcd_stats_clock();
+    bool done = push_token(parser, token, buffer, start, last, mark, broken,
+        line_num, offset);
+    stats->parse_time += vcd_stats_clock() - started
+        - (stats->print_time - print_time);
+    return done;
+}
+
+
+static size_t
+tokenize( struct tokenizer_t *tokenizer,
     const char *buffer, size_t buffer_length )
 {
     size_t first = 0;
-    size_t mark = 0, last = first;
+    size_t mark = NO_MARK, last = first;
     void *trans = tokenizer->state;
     const char *ptr = buffer;
     if( buffer_length == 0 ) return buffer_length;
     if( trans != NULL ) goto *trans; else goto token;
 
 advancePointer:
-    last = ptr - buffer;
-    /* _ptr_ and _last_ point to the next character available for tokenization,
-       which is one past the end of the last token and one less than the number
-       of characters in the buffer (base at zero). */
-    switch( last >= (buffer_length - 1) ? '\0' : *ptr ) {
-    case '\0':
-        if( last - first > 0 ) {
-            if( tokenizer->tok != whitespace_vcd_token ) {
-                tokenizer->last_significant_tok = tokenizer->tok;
-            }
-            push_token(&tokenizer->parser,
-                tokenizer->tok, buffer, first, last, mark, true,
-                tokenizer->line_num);
-            first = mark = last;
-        }
+    /* _ptr_ points to the character just accepted by the current state.
+       When it is the last character in the buffer, the token continues
+       into the next buffer and is pushed as broken. */
+    if( *ptr == '\n' ) ++tokenizer->line_num;
+    if( ++ptr == buffer + buffer_length ) {
+        push_counted_token(&tokenizer->parser,
+            tokenizer->tok, buffer, first, buffer_length, mark, true,
+            tokenizer->line_num, tokenizer->offset);
         tokenizer->state = trans;
-        return last + 1;
-    case '\n':
-        ++tokenizer->line_num;
+        tokenizer->offset += buffer_length;
+        return buffer_length;
     }
-    ++ptr;
     goto *trans;
 
 error:
@@ -608,16 +1116,18 @@ error:
 
 token:
     last = ptr - buffer;
-    if( last - first > 0 ) {
+    if( last - first > 0 || tokenizer->parser.broken_token_len > 0 ) {
         if( tokenizer->tok != whitespace_vcd_token ) {
             tokenizer->last_significant_tok = tokenizer->tok;
         }
-        if( push_token(&tokenizer->parser, tokenizer->tok,
+        if( push_counted_token(&tokenizer->parser, tokenizer->tok,
                 buffer, first, last, mark, false,
-                tokenizer->line_num) ) {
+                tokenizer->line_num, tokenizer->offset) ) {
+            tokenizer->offset += last;
             return last;
         }
-        first = mark = last;
+        first = last;
+        mark = NO_MARK;
     }
     if( isspace(*ptr) ) {
         tokenizer->tok = whitespace_vcd_token;
@@ -1027,12 +1537,26 @@ version:
     }
     goto data;
 
+/* The whitespace, data, identifier and binary digits states jump over
+   a whole run of characters at once, accepting the last character of
+   the run through advancePointer. */
 whitespace:
-    while( isspace(*ptr) ) advance(whitespace);
+    if( isspace(*ptr) ) {
+        const char *next = scan_non_space(ptr, buffer + buffer_length) - 1;
+        while( (ptr = memchr(ptr, '\n', next - ptr)) != NULL ) {
+            ++tokenizer->line_num;
+            ++ptr;
+        }
+        ptr = next;
+        advance(whitespace);
+    }
     goto token;
 
 data:
-    while( !isspace(*ptr) ) advance(data);
+    if( !isspace(*ptr) ) {
+        ptr = scan_space(ptr, buffer + buffer_length) - 1;
+        advance(data);
+    }
     goto token;
 
 simulation_time:
@@ -1057,7 +1581,10 @@ scalar_value:
     goto data;
 
 scalar_value_identifier:
-    while( !isspace(*ptr) ) advance(scalar_value_identifier);
+    if( !isspace(*ptr) ) {
+        ptr = scan_space(ptr, buffer + buffer_length) - 1;
+        advance(scalar_value_identifier);
+    }
     goto token;
 
 vector_binary_value:
@@ -1086,6 +1613,7 @@ vector_binary_value_next:
     case 'X':
     case 'z':
     case 'Z':
+        ptr = scan_binary_digits(ptr, buffer + buffer_length) - 1;
         advance(vector_binary_value_next);
     }
     goto data;
@@ -1115,26 +1643,63 @@ vector_real_value_identifier:
 }
 
 
+size_t
+tokenize_header_and_definitions( struct tokenizer_t *tokenizer,
+    const char *buffer, size_t buffer_length )
+{
+    struct vcd_stats_t *stats = tokenizer->parser.stats;
+    if( !stats ) {
+        return tokenize(tokenizer, buffer, buffer_length);
+    }
+    double parse_time = stats->parse_time + stats->print_time;
+    double started = vcd_stats_clock();
+    size_t length = tokenize(tokenizer, buffer, buffer_length);
+    stats->bytes += length;
+    stats->tokenize_time += vcd_stats_clock() - started
+        - (stats->parse_time + stats->print_time - parse_time);
+    return length;
+}
+
+
+size_t
+write_tokens( void *obj, const char *buffer, size_t length )
+{
+    return tokenize_header_and_definitions(
+        (struct tokenizer_t *)obj, buffer, length);
+}
+
+
+size_t
+write_trace( void *obj, const char *buffer, size_t length )
+{
+    return trace_filter_write((struct trace_filter_t *)obj, buffer, length);
+}
+
+
+size_t
+write_batch( void *obj, const char *buffer, size_t length )
+{
+    return trace_batch_write((struct trace_batch_t *)obj, buffer, length);
+}
+
+
 void header_and_definitions( FILE *from, signal_map *map,
     vcd_print_callback print, void *obj )
 {
     struct definitions_t defs;
     struct tokenizer_t tokenizer;
-    size_t bytes_read = 1;
-    char buffer[BUFFER_SIZE];
+    struct vcd_emitter_t emitter;
 
-    init_definitions(&defs, map, print, obj);
+    vcd_emitter_init(&emitter, print, obj);
+    init_definitions(&defs, map, vcd_emitter_print, &emitter);
     init_tokenizer(&tokenizer, &defs, NULL);
 
     defs.print(defs.obj, "{\n", 2);
-    while( bytes_read > 0 ) {
-        bytes_read = fread(buffer, 1, BUFFER_SIZE, from);
-        if( tokenize_header_and_definitions(&tokenizer, buffer, bytes_read)
-            != bytes_read ){
-            break;
-        }
-    }
+    read_input(from, 0, write_tokens, &tokenizer);
+    destroy_tokenizer(&tokenizer);
     defs.print(defs.obj, "\n}\n", 3);
+    vcd_emitter_flush(&emitter);
+    vcd_emitter_destroy(&emitter);
 }
 
 
@@ -1143,21 +1708,14 @@ void value_changes( FILE *from, const signal_map *map,
 {
     struct simulation_t sim;
     struct tokenizer_t tokenizer;
-    size_t bytes_read = 1;
-    char buffer[BUFFER_SIZE];
 
     init_simulation(&sim, map, start_time, end_time, resolution);
     init_tokenizer(&tokenizer, NULL, &sim);
 
     /* XXX seek to first reference as described in toc. */
 
-    while( bytes_read > 0 ) {
-        bytes_read = fread(buffer, 1, BUFFER_SIZE, from);
-        if( tokenize_header_and_definitions(&tokenizer, buffer, bytes_read)
-            != bytes_read ){
-            break;
-        }
-    }
+    read_input(from, 0, write_tokens, &tokenizer);
+    destroy_tokenizer(&tokenizer);
 }
 
 
@@ -1169,34 +1727,34 @@ void filter_value_changes( FILE *from, signal_map *map,
     struct definitions_t defs;
     struct simulation_t sim;
     struct tokenizer_t tokenizer;
-    size_t bytes_read = 1;
-    char buffer[BUFFER_SIZE];
+    struct vcd_emitter_t emitter;
 
+    vcd_emitter_init(&emitter, print, obj);
+    print = vcd_emitter_print;
+    obj = &emitter;
     init_definitions(&defs, map, print, obj);
     init_simulation(&sim, map, start_time, end_time, resolution);
     init_tokenizer(&tokenizer, &defs, &sim);
 
     print(obj, "{\n", 2);
 
-    while( bytes_read > 0 ) {
-        bytes_read = fread(buffer, 1, BUFFER_SIZE, from);
-        if( tokenize_header_and_definitions(&tokenizer, buffer, bytes_read)
-            != bytes_read ){
-            break;
-        }
-    }
+    read_input(from, 0, write_tokens, &tokenizer);
+    destroy_tokenizer(&tokenizer);
 
+    print_last_change_records(&sim);
     curr = map->head;
     while( curr ) {
         /* Always append comma. First one is to close header information. */
         print(obj, ",\n\"", 3);
         print(obj, curr->name, strlen(curr->name));
         print(obj, "\": [\n", 5);
-        print(obj, curr->text, strlen(curr->text));
+        signal_buf_print(curr, print, obj);
         print(obj, "\n]", 2);
         curr = curr->next;
     }
     print(obj, "}\n", 2);
+    vcd_emitter_flush(&emitter);
+    vcd_emitter_destroy(&emitter);
 }
 
 
@@ -1204,29 +1762,89 @@ void trace_filter_init( struct trace_filter_t *trace,
     size_t start_time, size_t end_time, size_t resolution,
     vcd_print_callback print, void *obj )
 {
-    init_definitions(&trace->defs, &trace->map, print, obj);
+    trace_filter_init_format(trace, start_time, end_time, resolution,
+        json_trace_format, print, obj);
+}
+
+
+void
+trace_filter_init_format( struct trace_filter_t *trace,
+    size_t start_time, size_t end_time, size_t resolution,
+    trace_format format, vcd_print_callback print, void *obj )
+{
+    vcd_emitter_init(&trace->emitter, print, obj);
+    print = vcd_emitter_print;
+    obj = &trace->emitter;
+    /* The header definitions still go through the parser to fill
+       the signal map when they are not written. */
+    init_definitions(&trace->defs, &trace->map,
+        format == json_trace_format ? print : discard_print, obj);
     init_simulation(&trace->sim, &trace->map, start_time, end_time, resolution);
+    trace->sim.format = format;
+    trace->sim.print = print;
+    trace->sim.obj = obj;
     init_tokenizer(&trace->tokenizer, &trace->defs, &trace->sim);
     init_signal_map(&trace->map);
+    trace->definitions_end = 0;
 
-    print(obj, "{\n", 2);
+    if( format == json_trace_format ) print(obj, "{\n", 2);
+}
+
+
+/* Print callback timing the print callback of a trace. */
+static void
+stats_print( void *obj, const char *buffer, size_t length )
+{
+    struct vcd_stats_t *stats = (struct vcd_stats_t *)obj;
+    double started = vcd_stats_clock();
+    stats->print(stats->obj, buffer, length);
+    stats->print_time += vcd_stats_clock() - started;
+    stats->output_bytes += length;
+}
+
+
+void
+trace_filter_enable_stats( struct trace_filter_t *trace,
+    struct vcd_stats_t *stats )
+{
+    memset(stats, 0, sizeof(struct vcd_stats_t));
+    stats->print = trace->emitter.print;
+    stats->obj = trace->emitter.obj;
+    trace->emitter.print = stats_print;
+    trace->emitter.obj = stats;
+    trace->tokenizer.parser.stats = stats;
 }
 
 
 void
 trace_filter_flush( struct trace_filter_t *trace )
 {
-    signal_buf *curr = trace->map.head;
-    while( curr ) {
-        /* Always append comma. First one is to close header information. */
-        trace->defs.print(trace->defs.obj, ",\n\"", 3);
-        trace->defs.print(trace->defs.obj, curr->name, strlen(curr->name));
-        trace->defs.print(trace->defs.obj, "\": [\n", 5);
-        trace->defs.print(trace->defs.obj, curr->text, strlen(curr->text));
-        trace->defs.print(trace->defs.obj, "\n]", 2);
-        curr = curr->next;
+    destroy_tokenizer(&trace->tokenizer);
+    if( trace->tokenizer.parser.stats ) {
+        trace->tokenizer.parser.stats->signal_bytes
+            = signal_map_bytes(&trace->map);
+    }
+    if( trace->sim.held ) print_initial_change_records(&trace->sim);
+    print_last_change_records(&trace->sim);
+    if( trace->sim.format == bin_trace_format ) {
+        binary_trace_print(&trace->sim, trace->sim.print, trace->sim.obj);
+    }
+    if( trace->sim.format == json_trace_format ) {
+        signal_buf *curr = trace->map.head;
+        while( curr ) {
+            /* Always append comma. First one is to close header
+               information. */
+            trace->defs.print(trace->defs.obj, ",\n\"", 3);
+            trace->defs.print(trace->defs.obj, curr->name, strlen(curr->name));
+            trace->defs.print(trace->defs.obj, "\": [\n", 5);
+            signal_buf_print(curr, trace->defs.print, trace->defs.obj);
+            trace->defs.print(trace->defs.obj, "\n]", 2);
+            curr = curr->next;
+        }
+        trace->defs.print(trace->defs.obj, "}\n", 2);
     }
-    trace->defs.print(trace->defs.obj, "}\n", 2);
+    vcd_emitter_flush(&trace->emitter);
+    vcd_emitter_destroy(&trace->emitter);
     destroy_signal_map(&trace->map);
 }
 
@@ -1235,7 +1853,198 @@ size_t
 trace_filter_write( struct trace_filter_t *trace,
     const char *buffer, size_t buffer_length )
 {
-    return tokenize_header_and_definitions(
+    if( trace->sim.done ) return 0;
+    size_t length = tokenize_header_and_definitions(
         &trace->tokenizer, buffer, buffer_length);
+    /* Records reach *print* as the input is tokenized, not once
+       a block of the emitter is full. */
+    if( trace->sim.format == ndjson_trace_format ) {
+        vcd_emitter_flush(&trace->emitter);
+    }
+    return length;
 }
 
+
+void
+trace_batch_init( struct trace_batch_t *batch,
+    vcd_print_callback print, void *obj )
+{
+    batch->head = NULL;
+    batch->tail = NULL;
+    batch->started = false;
+    batch->print = print;
+    batch->obj = obj;
+}
+
+
+struct trace_query_t *
+trace_batch_add_query( struct trace_batch_t *batch, const char *id,
+    size_t start_time, size_t end_time, size_t resolution )
+{
+    assert( !batch->started );
+    struct trace_query_t *query = malloc(sizeof(struct trace_query_t));
+    char *query_id = malloc(strlen(id) + 1);
+    if( !query || !query_id ) {
+        free(query);
+        free(query_id);
+        fprintf(stderr, "error: unable to allocate query %s\n", id);
+        return NULL;
+    }
+    strcpy(query_id, id);
+    query->next = NULL;
+    query->id = query_id;
+    init_signal_map(&query->map);
+    /* Only the value changes are printed, in trace_batch_flush. */
+    init_definitions(&query->defs, &query->map, discard_print, NULL);
+    init_simulation(&query->sim, &query->map,
+        start_time, end_time, resolution);
+    if( batch->tail ) {
+        batch->tail->next = query;
+        batch->tail->defs.next = &query->defs;
+        batch->tail->sim.next = &query->sim;
+    } else {
+        batch->head = query;
+    }
+    batch->tail = query;
+    return query;
+}
+
+
+int
+trace_batch_read_queries( struct trace_batch_t *batch, FILE *from )
+{
+    char *line = NULL;
+    size_t line_capacity = 0;
+    size_t line_num = 0;
+    int err = 0;
+    static const char delimiters[] = " \t\r\n";
+
+    while( getline(&line, &line_capacity, from) >= 0 ) {
+        ++line_num;
+        char *id = strtok(line, delimiters);
+        if( !id || id[0] == '#' ) continue;
+        char *fields[3];
+        int i;
+        for( i = 0; i < 3; ++i ) {
+            fields[i] = strtok(NULL, delimiters);
+            if( !fields[i] ) break;
+        }
+        if( i < 3 ) {
+            fprintf(stderr, "queries:%zu: error: expected"\
+                " id start_time end_time resolution name [name ...]\n",
+                line_num);
+            err = 1;
+            break;
+        }
+        struct trace_query_t *query = trace_batch_add_query(batch, id,
+            strtoull(fields[0], NULL, 10), strtoull(fields[1], NULL, 10),
+            strtoull(fields[2], NULL, 10));
+        if( !query ) {
+            err = 1;
+            break;
+        }
+        char *name;
+        while( (name = strtok(NULL, delimiters)) ) {
+            query->map.head = insert_signal(query->map.head, name);
+        }
+    }
+    free(line);
+    return err || ferror(from) ? 1 : 0;
+}
+
+
+size_t
+trace_batch_write( struct trace_batch_t *batch,
+    const char *buffer, size_t buffer_length )
+{
+    if( !batch->head ) return 0;
+    if( !batch->started ) {
+        init_tokenizer(&batch->tokenizer,
+            &batch->head->defs, &batch->head->sim);
+        batch->started = true;
+    }
+    struct trace_query_t *query;
+    for( query = batch->head; query; query = query->next ) {
+        if( !query->sim.done ) break;
+    }
+    /* All time windows closed on a previous buffer. */
+    if( !query ) return 0;
+    return tokenize_header_and_definitions(
+        &batch->tokenizer, buffer, buffer_length);
+}
+
+
+/* Prints *str* as a JSON string. Query ids are chosen by the caller
+   and may contain any character. */
+static void
+print_json_string( const char *str, vcd_print_callback print, void *obj )
+{
+    static const char hex[] = "0123456789abcdef";
+    const char *p = str;
+    print(obj, "\"", 1);
+    while( *p ) {
+        const char *run = p;
+        while( *p && *p != '"' && *p != '\\'
+            && (unsigned char)*p >= 0x20 ) ++p;
+        if( p > run ) {
+            print(obj, run, p - run);
+        } else if( *p == '"' || *p == '\\' ) {
+            print(obj, "\\", 1);
+            print(obj, p++, 1);
+        } else {
+            char escaped[6] = { '\\', 'u', '0', '0',
+                hex[(unsigned char)*p >> 4], hex[*p & 0xf] };
+            print(obj, escaped, sizeof(escaped));
+            ++p;
+        }
+    }
+    print(obj, "\"", 1);
+}
+
+
+void
+trace_batch_flush( struct trace_batch_t *batch )
+{
+    struct vcd_emitter_t emitter;
+    vcd_print_callback print = vcd_emitter_print;
+    void *obj = &emitter;
+    struct trace_query_t *query = batch->head;
+
+    vcd_emitter_init(&emitter, batch->print, batch->obj);
+    print(obj, "{", 1);
+    while( query ) {
+        print_last_change_records(&query->sim);
+        if( query == batch->head ) {
+            print(obj, "\n", 1);
+        } else {
+            print(obj, ",\n", 2);
+        }
+        print_json_string(query->id, print, obj);
+        print(obj, ": {", 3);
+        signal_buf *curr = query->map.head;
+        while( curr ) {
+            if( curr == query->map.head ) {
+                print(obj, "\n\"", 2);
+            } else {
+                print(obj, ",\n\"", 3);
+            }
+            print(obj, curr->name, strlen(curr->name));
+            print(obj, "\": [\n", 5);
+            signal_buf_print(curr, print, obj);
+            print(obj, "\n]", 2);
+            curr = curr->next;
+        }
+        print(obj, "}", 1);
+        struct trace_query_t *next = query->next;
+        destroy_signal_map(&query->map);
+        free(query->id);
+        free(query);
+        query = next;
+    }
+    print(obj, "\n}\n", 3);
+    vcd_emitter_flush(&emitter);
+    vcd_emitter_destroy(&emitter);
+    if( batch->started ) destroy_tokenizer(&batch->tokenizer);
+    batch->head = NULL;
+    batch->tail = NULL;
+}
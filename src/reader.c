@@ -0,0 +1,529 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#include "libvcd.h"
+
+/* Input is read, and decompressed, on a separate thread ahead of the
+   tokenizer. The thread fills the buffers of a ring, in order, while
+   the caller hands filled buffers to the write callback. */
+#define INPUT_RING_BUFFERS      4
+
+/* Size of the reads from the input, compressed or not. Buffers are
+   filled by several reads such that the reader thread notices early
+   when the write callback stops. */
+#define INPUT_READ_SIZE         (1 << 16)
+
+struct input_ring_t {
+    pthread_mutex_t lock;
+    pthread_cond_t filled;     /* a buffer was filled, or input ended */
+    pthread_cond_t emptied;    /* a buffer was consumed, or reading stops */
+    char *buffers[INPUT_RING_BUFFERS];
+    size_t lengths[INPUT_RING_BUFFERS];
+    size_t buffer_size;
+    size_t head;               /* next buffer to consume */
+    size_t count;              /* number of filled buffers */
+    bool eof;
+    bool stop;                 /* the write callback needs no more input */
+    int err;
+    FILE *from;
+    size_t remaining;          /* bytes left to read from *from* */
+    vcd_compression compression;
+    const char *first;         /* bytes read to detect the compression */
+    size_t first_length;
+};
+
+
+const char *
+map_input( int fd, size_t *size )
+{
+    struct stat st;
+    if( fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ) {
+        return NULL;
+    }
+    *size = st.st_size;
+    if( st.st_size == 0 ) {
+        /* mmap does not accept empty mappings. */
+        return "";
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if( data == MAP_FAILED ) {
+        return NULL;
+    }
+    /* The tokenizer goes through the file once, front to back. */
+    posix_madvise(data, st.st_size, POSIX_MADV_SEQUENTIAL);
+    return (const char *)data;
+}
+
+
+void
+unmap_input( const char *data, size_t size )
+{
+    if( size > 0 ) munmap((void *)data, size);
+}
+
+
+int
+vcd_file_stamp( int fd, struct vcd_file_stamp_t *stamp )
+{
+    struct stat st;
+    if( fstat(fd, &st) != 0 ) return 1;
+    memset(stamp, 0, sizeof(struct vcd_file_stamp_t));
+    stamp->size = st.st_size;
+    stamp->mtime = st.st_mtim.tv_sec;
+    stamp->mtime_nsec = st.st_mtim.tv_nsec;
+    stamp->ino = st.st_ino;
+    stamp->dev = st.st_dev;
+    return 0;
+}
+
+
+bool
+vcd_file_stamp_matches( int fd, const struct vcd_file_stamp_t *stamp )
+{
+    struct vcd_file_stamp_t current;
+    return vcd_file_stamp(fd, &current) == 0
+        && current.size == stamp->size
+        && current.mtime == stamp->mtime
+        && current.mtime_nsec == stamp->mtime_nsec
+        && current.ino == stamp->ino
+        && current.dev == stamp->dev;
+}
+
+
+int
+trace_filter_write_mapped( struct trace_filter_t *trace, int fd )
+{
+    size_t size;
+    const char *data = map_input(fd, &size);
+    if( !data ) {
+        return 1;
+    }
+    /* The header definitions were loaded from a hierarchy cache. */
+    size_t begin = trace->definitions_end < size ? trace->definitions_end : size;
+    /* ndjson records are flushed after each write, so the mapping
+       is written a buffer at a time. */
+    size_t slice = trace->sim.format == ndjson_trace_format ?
+        READ_AHEAD_BUFFER_SIZE : size;
+    while( begin < size ) {
+        size_t length = size - begin < slice ? size - begin : slice;
+        if( trace_filter_write(trace, data + begin, length) != length ) break;
+        begin += length;
+    }
+    unmap_input(data, size);
+    return 0;
+}
+
+
+vcd_compression
+detect_compression( const char *buffer, size_t length )
+{
+    if( length >= 2 && (unsigned char)buffer[0] == 0x1f
+        && (unsigned char)buffer[1] == 0x8b ) {
+        return gzip_compression;
+    }
+    if( length >= 4 && (unsigned char)buffer[0] == 0x28
+        && (unsigned char)buffer[1] == 0xb5
+        && (unsigned char)buffer[2] == 0x2f
+        && (unsigned char)buffer[3] == 0xfd ) {
+        return zstd_compression;
+    }
+    return no_compression;
+}
+
+
+vcd_compression
+file_compression( int fd )
+{
+    char magic[4];
+    ssize_t length = pread(fd, magic, sizeof(magic), 0);
+    return length > 0 ? detect_compression(magic, length) : no_compression;
+}
+
+
+/* Returns the next buffer to fill, or NULL when reading stops. */
+static char *
+ring_acquire( struct input_ring_t *ring )
+{
+    char *buffer = NULL;
+    pthread_mutex_lock(&ring->lock);
+    while( ring->count == INPUT_RING_BUFFERS && !ring->stop ) {
+        pthread_cond_wait(&ring->emptied, &ring->lock);
+    }
+    if( !ring->stop ) {
+        buffer = ring->buffers[
+            (ring->head + ring->count) % INPUT_RING_BUFFERS];
+    }
+    pthread_mutex_unlock(&ring->lock);
+    return buffer;
+}
+
+
+static void
+ring_commit( struct input_ring_t *ring, size_t length )
+{
+    pthread_mutex_lock(&ring->lock);
+    ring->lengths[(ring->head + ring->count) % INPUT_RING_BUFFERS] = length;
+    ++ring->count;
+    pthread_cond_signal(&ring->filled);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+
+/* Reads input bytes into *buffer*, starting with the bytes
+   used to detect the compression. */
+static size_t
+ring_read( struct input_ring_t *ring, char *buffer, size_t length )
+{
+    if( ring->first_length > 0 ) {
+        size_t first_length = ring->first_length < length ?
+            ring->first_length : length;
+        memcpy(buffer, ring->first, first_length);
+        ring->first += first_length;
+        ring->first_length -= first_length;
+        return first_length;
+    }
+    if( length > ring->remaining ) length = ring->remaining;
+    if( length == 0 ) return 0;
+    size_t bytes_read = fread(buffer, 1, length, ring->from);
+    if( bytes_read == 0 && ferror(ring->from) ) {
+        fprintf(stderr, "error: unable to read input\n");
+        ring->err = 1;
+    }
+    ring->remaining -= bytes_read;
+    return bytes_read;
+}
+
+
+static bool
+ring_stopped( struct input_ring_t *ring )
+{
+    pthread_mutex_lock(&ring->lock);
+    bool stop = ring->stop;
+    pthread_mutex_unlock(&ring->lock);
+    return stop;
+}
+
+
+static void
+inflate_gzip( struct input_ring_t *ring )
+{
+    z_stream stream;
+    char input[INPUT_READ_SIZE];
+    bool pending = false;      /* output left in the stream */
+    bool ended = false;        /* the last gzip member is complete */
+
+    memset(&stream, 0, sizeof(stream));
+    /* 15 + 32 accepts both gzip and zlib headers. */
+    if( inflateInit2(&stream, 15 + 32) != Z_OK ) {
+        fprintf(stderr, "error: unable to initialize gzip decompression\n");
+        ring->err = 1;
+        return;
+    }
+    char *output = ring_acquire(ring);
+    stream.next_out = (Bytef *)output;
+    stream.avail_out = ring->buffer_size;
+    while( output ) {
+        if( stream.avail_in == 0 && !pending ) {
+            size_t bytes_read = ring_read(ring, input, sizeof(input));
+            if( bytes_read == 0 ) break;
+            stream.next_in = (Bytef *)input;
+            stream.avail_in = bytes_read;
+            if( ended ) {
+                /* Concatenated gzip members, as written by `cat a.gz b.gz`. */
+                inflateReset(&stream);
+                ended = false;
+            }
+        }
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if( ret == Z_STREAM_END ) {
+            ended = true;
+            if( stream.avail_in > 0 ) {
+                inflateReset(&stream);
+                ended = false;
+            }
+        } else if( ret != Z_OK && ret != Z_BUF_ERROR ) {
+            fprintf(stderr, "error: corrupted gzip input (%s)\n",
+                stream.msg ? stream.msg : "unknown error");
+            ring->err = 1;
+            break;
+        }
+        pending = (stream.avail_out == 0);
+        if( stream.avail_out == 0 ) {
+            ring_commit(ring, ring->buffer_size);
+            output = ring_acquire(ring);
+            stream.next_out = (Bytef *)output;
+            stream.avail_out = ring->buffer_size;
+        }
+    }
+    if( output ) {
+        if( !ended && !ring->err ) {
+            fprintf(stderr, "error: truncated gzip input\n");
+            ring->err = 1;
+        }
+        ring_commit(ring, ring->buffer_size - stream.avail_out);
+    }
+    inflateEnd(&stream);
+}
+
+
+#ifdef HAVE_ZSTD
+static void
+decompress_zstd( struct input_ring_t *ring )
+{
+    char input[INPUT_READ_SIZE];
+    bool pending = false;      /* output left in the stream */
+    size_t ret = 0;
+
+    ZSTD_DStream *stream = ZSTD_createDStream();
+    if( !stream ) {
+        fprintf(stderr, "error: unable to initialize zstd decompression\n");
+        ring->err = 1;
+        return;
+    }
+    ZSTD_initDStream(stream);
+    ZSTD_inBuffer in = { input, 0, 0 };
+    ZSTD_outBuffer out = { ring_acquire(ring), ring->buffer_size, 0 };
+    while( out.dst ) {
+        if( in.pos == in.size && !pending ) {
+            in.size = ring_read(ring, input, sizeof(input));
+            in.pos = 0;
+            if( in.size == 0 ) break;
+        }
+        ret = ZSTD_decompressStream(stream, &out, &in);
+        if( ZSTD_isError(ret) ) {
+            fprintf(stderr, "error: corrupted zstd input (%s)\n",
+                ZSTD_getErrorName(ret));
+            ring->err = 1;
+            break;
+        }
+        pending = (out.pos == out.size);
+        if( out.pos == out.size ) {
+            ring_commit(ring, out.pos);
+            out.dst = ring_acquire(ring);
+            out.pos = 0;
+        }
+    }
+    if( out.dst ) {
+        /* A non-zero hint means the last frame is incomplete. */
+        if( ret != 0 && !ring->err ) {
+            fprintf(stderr, "error: truncated zstd input\n");
+            ring->err = 1;
+        }
+        ring_commit(ring, out.pos);
+    }
+    ZSTD_freeDStream(stream);
+}
+#endif
+
+
+static void
+read_ahead( struct input_ring_t *ring )
+{
+    int fd = fileno(ring->from);
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+
+    /* Hints are best effort, they fail on pipes for example. */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for( ; ; ) {
+        char *buffer = ring_acquire(ring);
+        if( !buffer ) break;
+        /* Have the next ring worth of input on its way while this
+           buffer is being filled. */
+        offset += ring->buffer_size;
+        posix_fadvise(fd, offset,
+            (off_t)ring->buffer_size * INPUT_RING_BUFFERS,
+            POSIX_FADV_WILLNEED);
+        size_t length = 0;
+        while( length < ring->buffer_size && !ring_stopped(ring) ) {
+            size_t bytes_read = ring_read(ring, &buffer[length],
+                ring->buffer_size - length < INPUT_READ_SIZE ?
+                ring->buffer_size - length : INPUT_READ_SIZE);
+            if( bytes_read == 0 ) break;
+            length += bytes_read;
+        }
+        if( length > 0 ) ring_commit(ring, length);
+        if( length < ring->buffer_size ) break;
+    }
+}
+
+
+static void *
+fill_ring( void *arg )
+{
+    struct input_ring_t *ring = arg;
+    switch( ring->compression ) {
+    case no_compression:
+        read_ahead(ring);
+        break;
+    case gzip_compression:
+        inflate_gzip(ring);
+        break;
+    case zstd_compression:
+#ifdef HAVE_ZSTD
+        decompress_zstd(ring);
+#else
+        fprintf(stderr,
+            "error: zstd input is not supported by this build of libvcd\n");
+        ring->err = 1;
+#endif
+        break;
+    }
+    pthread_mutex_lock(&ring->lock);
+    ring->eof = true;
+    pthread_cond_signal(&ring->filled);
+    pthread_mutex_unlock(&ring->lock);
+    return NULL;
+}
+
+
+/* Hands the filled buffers of *ring* to *write*, in order. */
+static void
+write_ring( struct input_ring_t *ring,
+    vcd_write_callback write, void *obj )
+{
+    for( ; ; ) {
+        pthread_mutex_lock(&ring->lock);
+        while( ring->count == 0 && !ring->eof ) {
+            pthread_cond_wait(&ring->filled, &ring->lock);
+        }
+        if( ring->count == 0 ) {
+            pthread_mutex_unlock(&ring->lock);
+            break;
+        }
+        char *buffer = ring->buffers[ring->head];
+        size_t length = ring->lengths[ring->head];
+        pthread_mutex_unlock(&ring->lock);
+
+        size_t written = write(obj, buffer, length);
+
+        pthread_mutex_lock(&ring->lock);
+        ring->head = (ring->head + 1) % INPUT_RING_BUFFERS;
+        --ring->count;
+        if( written != length ) ring->stop = true;
+        pthread_cond_signal(&ring->emptied);
+        pthread_mutex_unlock(&ring->lock);
+        if( written != length ) return;
+    }
+    write(obj, "", 0);
+}
+
+
+/* Feeds *write* from a ring filled on a separate thread, starting with
+   the *first_length* bytes in *first*, then at most *length* bytes read
+   from *from*. */
+static int
+read_ring( FILE *from, vcd_compression compression,
+    const char *first, size_t first_length, size_t length,
+    size_t buffer_size, vcd_write_callback write, void *obj )
+{
+    struct input_ring_t ring;
+    pthread_t thread;
+    memset(&ring, 0, sizeof(ring));
+    ring.buffer_size = buffer_size > 0 ? buffer_size : READ_AHEAD_BUFFER_SIZE;
+    if( first_length == 0 && length < ring.buffer_size ) {
+        /* No need for large buffers to hold a small range. */
+        ring.buffer_size = length;
+    }
+    ring.from = from;
+    ring.remaining = length;
+    ring.compression = compression;
+    ring.first = first;
+    ring.first_length = first_length;
+    for( int i = 0; i < INPUT_RING_BUFFERS; ++i ) {
+        ring.buffers[i] = malloc(ring.buffer_size);
+        if( !ring.buffers[i] ) {
+            fprintf(stderr, "error: unable to allocate input buffers\n");
+            while( i > 0 ) free(ring.buffers[--i]);
+            return 1;
+        }
+    }
+    pthread_mutex_init(&ring.lock, NULL);
+    pthread_cond_init(&ring.filled, NULL);
+    pthread_cond_init(&ring.emptied, NULL);
+    if( pthread_create(&thread, NULL, fill_ring, &ring) != 0 ) {
+        fprintf(stderr, "error: unable to start reader thread\n");
+        ring.err = 1;
+    } else {
+        write_ring(&ring, write, obj);
+        pthread_join(thread, NULL);
+    }
+    pthread_cond_destroy(&ring.emptied);
+    pthread_cond_destroy(&ring.filled);
+    pthread_mutex_destroy(&ring.lock);
+    for( int i = 0; i < INPUT_RING_BUFFERS; ++i ) free(ring.buffers[i]);
+    return ring.err;
+}
+
+
+int
+read_input( FILE *from, size_t buffer_size,
+    vcd_write_callback write, void *obj )
+{
+    char buffer[BUFFER_SIZE];
+    size_t bytes_read = fread(buffer, 1, BUFFER_SIZE, from);
+    vcd_compression compression = detect_compression(buffer, bytes_read);
+
+    if( compression == no_compression && bytes_read < BUFFER_SIZE ) {
+        /* The whole input fit in the first read. */
+        if( write(obj, buffer, bytes_read) == bytes_read && bytes_read > 0 ) {
+            write(obj, buffer, 0);
+        }
+        return ferror(from) ? 1 : 0;
+    }
+    return read_ring(from, compression, buffer, bytes_read, SIZE_MAX,
+        buffer_size, write, obj);
+}
+
+
+int
+read_input_range( FILE *from, size_t offset, size_t length,
+    size_t buffer_size, vcd_write_callback write, void *obj )
+{
+    if( fseeko(from, (off_t)offset, SEEK_SET) != 0 ) {
+        fprintf(stderr, "error: unable to seek input to %zu\n", offset);
+        return 1;
+    }
+    if( length <= BUFFER_SIZE ) {
+        /* Not worth a thread. */
+        char buffer[BUFFER_SIZE];
+        size_t bytes_read = fread(buffer, 1, length, from);
+        write(obj, buffer, bytes_read);
+        return ferror(from) ? 1 : 0;
+    }
+    return read_ring(from, no_compression, NULL, 0, length,
+        buffer_size, write, obj);
+}
@@ -0,0 +1,258 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <pthread.h>
+#include <string.h>
+#include "libvcd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+/* The scan functions look for the first character in [first, last[ that
+   does not belong to a class (space, non-space or binary digit). The
+   scalar versions are used on the tail of a buffer, and on CPUs without
+   SSE2. The vector versions process 16 or 32 bytes at a time and are
+   selected at runtime, the first time a scan function is called. */
+
+typedef const char *(*scan_function)( const char *first, const char *last );
+
+static inline bool
+is_space( unsigned char c )
+{
+    /* ' ', '\t', '\n', '\v', '\f' and '\r', as isspace() in the C locale. */
+    return (c == ' ') | ((unsigned char)(c - '\t') <= '\r' - '\t');
+}
+
+static inline bool
+is_binary_digit( unsigned char c )
+{
+    return (c == '0') | (c == '1') | (c == 'x') | (c == 'X')
+        | (c == 'z') | (c == 'Z');
+}
+
+
+static const char *
+scan_space_scalar( const char *first, const char *last )
+{
+    while( first != last && !is_space(*first) ) ++first;
+    return first;
+}
+
+static const char *
+scan_non_space_scalar( const char *first, const char *last )
+{
+    while( first != last && is_space(*first) ) ++first;
+    return first;
+}
+
+static const char *
+scan_binary_digits_scalar( const char *first, const char *last )
+{
+    while( first != last && is_binary_digit(*first) ) ++first;
+    return first;
+}
+
+
+#ifdef SCAN_X86
+
+/* SSE2 is part of the x86-64 baseline but not of i386, so both SSE2
+   and AVX2 are compiled for their target and checked at runtime. */
+
+#define SSE2 __attribute__((target("sse2")))
+
+static inline SSE2 __m128i
+space_mask_sse2( __m128i v )
+{
+    __m128i offset = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    __m128i control = _mm_cmpeq_epi8(
+        _mm_min_epu8(offset, _mm_set1_epi8('\r' - '\t')), offset);
+    return _mm_or_si128(control, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+}
+
+static inline SSE2 __m128i
+binary_digit_mask_sse2( __m128i v )
+{
+    /* 'x' and 'z' are 'X' and 'Z' with the 0x20 bit set. */
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    return _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('0')),
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('1'))),
+        _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('x')),
+            _mm_cmpeq_epi8(lower, _mm_set1_epi8('z'))));
+}
+
+#define SCAN_SSE2(name, mask_expr, scalar)                              \
+static SSE2 const char *                                               \
+name( const char *first, const char *last )                            \
+{                                                                      \
+    while( last - first >= 16 ) {                                      \
+        __m128i v = _mm_loadu_si128((const __m128i *)first);           \
+        unsigned bits = (unsigned)_mm_movemask_epi8(mask_expr);        \
+        if( bits != 0 ) return first + __builtin_ctz(bits);            \
+        first += 16;                                                   \
+    }                                                                  \
+    return scalar(first, last);                                        \
+}
+
+SCAN_SSE2(scan_space_sse2,
+    space_mask_sse2(v), scan_space_scalar)
+SCAN_SSE2(scan_non_space_sse2,
+    _mm_xor_si128(space_mask_sse2(v), _mm_set1_epi8(-1)),
+    scan_non_space_scalar)
+SCAN_SSE2(scan_binary_digits_sse2,
+    _mm_xor_si128(binary_digit_mask_sse2(v), _mm_set1_epi8(-1)),
+    scan_binary_digits_scalar)
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline AVX2 __m256i
+space_mask_avx2( __m256i v )
+{
+    __m256i offset = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    __m256i control = _mm256_cmpeq_epi8(
+        _mm256_min_epu8(offset, _mm256_set1_epi8('\r' - '\t')), offset);
+    return _mm256_or_si256(control,
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+}
+
+static inline AVX2 __m256i
+binary_digit_mask_avx2( __m256i v )
+{
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    return _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('0')),
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('1'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('x')),
+            _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('z'))));
+}
+
+#define SCAN_AVX2(name, mask_expr, sse2)                                \
+static AVX2 const char *                                               \
+name( const char *first, const char *last )                            \
+{                                                                      \
+    while( last - first >= 32 ) {                                      \
+        __m256i v = _mm256_loadu_si256((const __m256i *)first);        \
+        unsigned bits = (unsigned)_mm256_movemask_epi8(mask_expr);     \
+        if( bits != 0 ) return first + __builtin_ctz(bits);            \
+        first += 32;                                                   \
+    }                                                                  \
+    return sse2(first, last);                                          \
+}
+
+SCAN_AVX2(scan_space_avx2,
+    space_mask_avx2(v), scan_space_sse2)
+SCAN_AVX2(scan_non_space_avx2,
+    _mm256_xor_si256(space_mask_avx2(v), _mm256_set1_epi8(-1)),
+    scan_non_space_sse2)
+SCAN_AVX2(scan_binary_digits_avx2,
+    _mm256_xor_si256(binary_digit_mask_avx2(v), _mm256_set1_epi8(-1)),
+    scan_binary_digits_sse2)
+
+#endif /* SCAN_X86 */
+
+
+static const char *scan_space_select( const char *, const char * );
+static const char *scan_non_space_select( const char *, const char * );
+static const char *scan_binary_digits_select( const char *, const char * );
+
+/* The implementations are picked once, under *scan_once*, and published
+   through atomic stores since the threads of trace_filter_write_parallel
+   call the scan functions concurrently. */
+static pthread_once_t scan_once = PTHREAD_ONCE_INIT;
+static scan_function scan_space_impl = scan_space_select;
+static scan_function scan_non_space_impl = scan_non_space_select;
+static scan_function scan_binary_digits_impl = scan_binary_digits_select;
+
+static void
+scan_publish( scan_function space, scan_function non_space,
+    scan_function binary_digits )
+{
+    __atomic_store_n(&scan_space_impl, space, __ATOMIC_RELEASE);
+    __atomic_store_n(&scan_non_space_impl, non_space, __ATOMIC_RELEASE);
+    __atomic_store_n(&scan_binary_digits_impl, binary_digits,
+        __ATOMIC_RELEASE);
+}
+
+/* Picks the widest implementation supported by the CPU. */
+static void
+scan_select( void )
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if( __builtin_cpu_supports("avx2") ) {
+        scan_publish(scan_space_avx2, scan_non_space_avx2,
+            scan_binary_digits_avx2);
+        return;
+    }
+    if( __builtin_cpu_supports("sse2") ) {
+        scan_publish(scan_space_sse2, scan_non_space_sse2,
+            scan_binary_digits_sse2);
+        return;
+    }
+#endif
+    scan_publish(scan_space_scalar, scan_non_space_scalar,
+        scan_binary_digits_scalar);
+}
+
+static const char *
+scan_space_select( const char *first, const char *last )
+{
+    pthread_once(&scan_once, scan_select);
+    return __atomic_load_n(&scan_space_impl, __ATOMIC_ACQUIRE)(first, last);
+}
+
+static const char *
+scan_non_space_select( const char *first, const char *last )
+{
+    pthread_once(&scan_once, scan_select);
+    return __atomic_load_n(&scan_non_space_impl, __ATOMIC_ACQUIRE)(first, last);
+}
+
+static const char *
+scan_binary_digits_select( const char *first, const char *last )
+{
+    pthread_once(&scan_once, scan_select);
+    return __atomic_load_n(&scan_binary_digits_impl, __ATOMIC_ACQUIRE)(first, last);
+}
+
+
+const char *
+scan_space( const char *first, const char *last )
+{
+    return __atomic_load_n(&scan_space_impl, __ATOMIC_ACQUIRE)(first, last);
+}
+
+const char *
+scan_non_space( const char *first, const char *last )
+{
+    return __atomic_load_n(&scan_non_space_impl, __ATOMIC_ACQUIRE)(first, last);
+}
+
+const char *
+scan_binary_digits( const char *first, const char *last )
+{
+    return __atomic_load_n(&scan_binary_digits_impl, __ATOMIC_ACQUIRE)(first, last);
+}
@@ -0,0 +1,438 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Answers queries on a VCD file over a Unix domain socket. The VCD file
+   is indexed once, and its definitions, hierarchy and checkpoints kept
+   in memory. Then each connection sends a single request line,
+   a JSON object:
+       {"signals": ["board/clock"], "start": 0, "end": 1000,
+        "resolution": 1, "format": "json"}
+   and receives the filtered trace, as vcd2json would write it, before
+   the server closes the connection. "start", "resolution" and "format"
+   are optional. A request without "signals" receives the header and
+   definitions of the VCD file. Errors are sent as {"error": "..."}.
+   Connections are answered one at a time, so a client that does not
+   send its request, or stops reading the answer, is dropped after
+   SERVE_TIMEOUT seconds. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "libvcd.h"
+
+#define SERVE_REQUEST_MAX   (1 << 20)
+
+/* Where send() cannot be told not to raise SIGPIPE, the connections
+   are set up not to (SO_NOSIGPIPE). */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL        0
+#endif
+
+/* The index stays in memory, it can afford more checkpoints than
+   a sidecar index for lower latency. */
+#define SERVE_INDEX_INTERVAL    (1 << 20)
+
+#define SERVE_TIMEOUT           10
+
+
+/* What the server keeps in memory across requests. */
+struct serve_state_t {
+    FILE *from;
+    struct vcd_file_stamp_t vcd; /* when the VCD file was indexed */
+    FILE *index;               /* value changes at the checkpoints */
+    struct time_checkpoint_t *checkpoints;
+    size_t nb_checkpoints;
+    struct hierarchy_t *hierarchy;
+    char *definitions;
+    size_t definitions_len;
+};
+
+
+struct serve_request_t {
+    signal_buf *signals;
+    bool has_signals;
+    size_t start_time;
+    size_t end_time;
+    size_t resolution;
+    trace_format format;
+};
+
+
+static void
+file_print( void *obj, const char *buffer, size_t len )
+{
+    fwrite(buffer, 1, len, (FILE *)obj);
+}
+
+
+/* A connection being answered. */
+struct serve_client_t {
+    int conn;
+    bool failed;               /* the client closed or stopped reading */
+};
+
+
+/* Sends the answer to a client. A client closing its end early must
+   not terminate the server, so SIGPIPE is not raised, and the rest
+   of the answer is dropped. */
+static void
+client_print( void *obj, const char *buffer, size_t len )
+{
+    struct serve_client_t *client = (struct serve_client_t *)obj;
+    while( len > 0 && !client->failed ) {
+        ssize_t count = send(client->conn, buffer, len, MSG_NOSIGNAL);
+        if( count < 0 && errno == EINTR ) continue;
+        if( count <= 0 ) {
+            client->failed = true;
+            break;
+        }
+        buffer += count;
+        len -= count;
+    }
+}
+
+
+static const char *
+skip_whitespace( const char *p )
+{
+    while( *p == ' ' || *p == '\t' || *p == '\r' || *p == '\n' ) ++p;
+    return p;
+}
+
+
+/* Parses a JSON string at *p* into *text* (at most *text_size* bytes,
+   including the terminating zero). Returns a pointer past the string
+   or NULL on error. */
+static const char *
+parse_string( const char *p, char *text, size_t text_size )
+{
+    size_t len = 0;
+    if( *p++ != '"' ) return NULL;
+    while( *p != '"' ) {
+        char c = *p++;
+        if( c == '\0' ) return NULL;
+        if( c == '\\' ) {
+            c = *p++;
+            switch( c ) {
+            case '"': case '\\': case '/': break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'n': c = '\n'; break;
+            case 'r': c = '\r'; break;
+            case 't': c = '\t'; break;
+            default:
+                /* \uXXXX never occurs in VCD identifiers. */
+                return NULL;
+            }
+        }
+        if( len + 1 >= text_size ) return NULL;
+        text[len++] = c;
+    }
+    text[len] = '\0';
+    return p + 1;
+}
+
+
+static const char *
+parse_number( const char *p, size_t *value )
+{
+    char *last;
+    if( *p < '0' || *p > '9' ) return NULL;
+    *value = strtoull(p, &last, 10);
+    return last;
+}
+
+
+static const char *
+parse_signals( const char *p, struct serve_request_t *request )
+{
+    char name[FILENAME_MAX];
+    if( *p++ != '[' ) return NULL;
+    p = skip_whitespace(p);
+    if( *p == ']' ) return p + 1;
+    for( ; ; ) {
+        p = parse_string(skip_whitespace(p), name, sizeof(name));
+        if( !p ) return NULL;
+        request->signals = insert_signal(request->signals, name);
+        p = skip_whitespace(p);
+        if( *p == ']' ) return p + 1;
+        if( *p++ != ',' ) return NULL;
+    }
+}
+
+
+/* Parses a request line. Returns NULL on success, or a description
+   of the error. */
+static const char *
+parse_request( const char *p, struct serve_request_t *request )
+{
+    char key[32], format[16];
+    p = skip_whitespace(p);
+    if( *p++ != '{' ) return "expected a JSON object";
+    p = skip_whitespace(p);
+    if( *p == '}' ) return NULL;
+    for( ; ; ) {
+        p = parse_string(skip_whitespace(p), key, sizeof(key));
+        if( !p ) return "expected a key";
+        p = skip_whitespace(p);
+        if( *p++ != ':' ) return "expected ':'";
+        p = skip_whitespace(p);
+        if( strcmp(key, "signals") == 0 ) {
+            p = parse_signals(p, request);
+            request->has_signals = true;
+        } else if( strcmp(key, "start") == 0 ) {
+            p = parse_number(p, &request->start_time);
+        } else if( strcmp(key, "end") == 0 ) {
+            p = parse_number(p, &request->end_time);
+        } else if( strcmp(key, "resolution") == 0 ) {
+            p = parse_number(p, &request->resolution);
+        } else if( strcmp(key, "format") == 0 ) {
+            p = parse_string(p, format, sizeof(format));
+            if( p && strcmp(format, "json") == 0 ) {
+                request->format = json_trace_format;
+            } else if( p && strcmp(format, "ndjson") == 0 ) {
+                request->format = ndjson_trace_format;
+            } else if( p && strcmp(format, "bin") == 0 ) {
+                request->format = bin_trace_format;
+            } else {
+                return "unknown format";
+            }
+        } else {
+            return "unknown key";
+        }
+        if( !p ) return "invalid value";
+        p = skip_whitespace(p);
+        if( *p == '}' ) return NULL;
+        if( *p++ != ',' ) return "expected ',' or '}'";
+    }
+}
+
+
+/* Reads a request line from *conn* into *request_line*. */
+static bool
+read_request( int conn, char *request_line, size_t size )
+{
+    size_t len = 0;
+    while( len + 1 < size ) {
+        ssize_t count = read(conn, &request_line[len], size - len - 1);
+        if( count < 0 && errno == EINTR ) continue;
+        if( count <= 0 ) break;
+        len += count;
+        if( memchr(&request_line[len - count], '\n', count) ) break;
+    }
+    request_line[len] = '\0';
+    return len > 0;
+}
+
+
+static void
+answer_request( const struct serve_state_t *state,
+    const char *request_line, struct serve_client_t *client )
+{
+    struct serve_request_t request;
+    struct trace_filter_t trace;
+
+    memset(&request, 0, sizeof(request));
+    request.end_time = (size_t)-1;
+    request.resolution = 1;
+    request.format = json_trace_format;
+    const char *error = parse_request(request_line, &request);
+    if( error ) {
+        char answer[256];
+        int len = snprintf(answer, sizeof(answer),
+            "{\"error\": \"%s\"}\n", error);
+        client_print(client, answer, len);
+        signal_map map;
+        init_signal_map(&map);
+        map.head = request.signals;
+        destroy_signal_map(&map);
+        return;
+    }
+    if( !request.has_signals ) {
+        client_print(client, state->definitions, state->definitions_len);
+        return;
+    }
+
+    trace_filter_init_format(&trace, request.start_time, request.end_time,
+        request.resolution > 0 ? request.resolution : 1,
+        request.format, client_print, client);
+    trace.map.head = request.signals;
+    if( vcd_file_stamp_matches(fileno(state->from), &state->vcd) ) {
+        trace_filter_bind_hierarchy(&trace, state->hierarchy);
+        if( state->nb_checkpoints == 0
+            || trace_filter_write_checkpoint(&trace, state->from,
+                state->index, state->checkpoints,
+                state->nb_checkpoints) != 0 ) {
+            read_input_range(state->from, trace.definitions_end, SIZE_MAX,
+                0, write_trace, &trace);
+        }
+    } else {
+        /* The VCD file changed since it was indexed. */
+        read_input_range(state->from, 0, SIZE_MAX, 0, write_trace, &trace);
+    }
+    trace_filter_flush(&trace);
+}
+
+
+/* Loads what the server keeps in memory. */
+static int
+load_state( struct serve_state_t *state, FILE *from, FILE *cache )
+{
+    memset(state, 0, sizeof(struct serve_state_t));
+    state->from = from;
+    if( vcd_file_stamp(fileno(from), &state->vcd) != 0 ) {
+        fprintf(stderr, "error: unable to stat VCD file\n");
+        return 1;
+    }
+
+    fseek(from, 0, SEEK_SET);
+    state->index = tmpfile();
+    if( !state->index
+        || time_index_build(from, state->index, SERVE_INDEX_INTERVAL) != 0
+        || fflush(state->index) != 0 ) {
+        fprintf(stderr, "error: unable to index VCD file\n");
+        return 1;
+    }
+    /* A VCD file without simulation times has no checkpoint. */
+    rewind(state->index);
+    if( time_index_load(from, state->index,
+            &state->checkpoints, &state->nb_checkpoints) != 0 ) {
+        state->nb_checkpoints = 0;
+    }
+
+    if( cache ) state->hierarchy = hierarchy_open(from, cache);
+    if( !state->hierarchy ) {
+        FILE *built = tmpfile();
+        fseek(from, 0, SEEK_SET);
+        if( built && hierarchy_build(from, built) == 0
+            && fflush(built) == 0 ) {
+            state->hierarchy = hierarchy_open(from, built);
+        }
+        if( built ) fclose(built);
+        if( !state->hierarchy ) {
+            fprintf(stderr, "error: unable to load VCD definitions\n");
+            return 1;
+        }
+    }
+
+    FILE *definitions_stream = tmpfile();
+    if( definitions_stream ) {
+        signal_map map;
+        init_signal_map(&map);
+        fseek(from, 0, SEEK_SET);
+        header_and_definitions(from, &map, file_print, definitions_stream);
+        destroy_signal_map(&map);
+        state->definitions_len = ftell(definitions_stream);
+        state->definitions = malloc(state->definitions_len + 1);
+        rewind(definitions_stream);
+        if( !state->definitions || fread(state->definitions, 1,
+                state->definitions_len, definitions_stream)
+            != state->definitions_len ) {
+            state->definitions_len = 0;
+        }
+        fclose(definitions_stream);
+    }
+    return 0;
+}
+
+
+static void
+destroy_state( struct serve_state_t *state )
+{
+    if( state->index ) fclose(state->index);
+    free(state->checkpoints);
+    hierarchy_close(state->hierarchy);
+    free(state->definitions);
+}
+
+
+int
+trace_serve( const char *socket_path, FILE *from, FILE *cache )
+{
+    struct sockaddr_un addr;
+    struct serve_state_t state;
+
+    if( strlen(socket_path) >= sizeof(addr.sun_path) ) {
+        fprintf(stderr, "error: socket path %s is too long\n", socket_path);
+        return 1;
+    }
+
+    /* Index the VCD file and keep its definitions once and for all. */
+    if( load_state(&state, from, cache) != 0 ) {
+        destroy_state(&state);
+        return 1;
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+    if( sock < 0
+        || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0
+        || listen(sock, 16) != 0 ) {
+        fprintf(stderr, "error: unable to listen on %s: %s\n",
+            socket_path, strerror(errno));
+        if( sock >= 0 ) close(sock);
+        destroy_state(&state);
+        return 1;
+    }
+    char *request_line = malloc(SERVE_REQUEST_MAX);
+    while( request_line ) {
+        int conn = accept(sock, NULL, NULL);
+        if( conn < 0 ) {
+            if( errno == EINTR ) continue;
+            fprintf(stderr, "error: accept: %s\n", strerror(errno));
+            break;
+        }
+        struct timeval timeout;
+        timeout.tv_sec = SERVE_TIMEOUT;
+        timeout.tv_usec = 0;
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef SO_NOSIGPIPE
+        int on = 1;
+        setsockopt(conn, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+        struct serve_client_t client;
+        client.conn = conn;
+        client.failed = false;
+        if( read_request(conn, request_line, SERVE_REQUEST_MAX) ) {
+            answer_request(&state, request_line, &client);
+        }
+        close(conn);
+    }
+    free(request_line);
+    close(sock);
+    unlink(socket_path);
+    destroy_state(&state);
+    return 1;
+}
@@ -22,9 +22,13 @@
 # OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
 # ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-from distutils.core import setup, Extension
 import os, sys
 
+try:
+    from setuptools import setup, Extension
+except ImportError:
+    from distutils.core import setup, Extension
+
 __version__ = '0.2'
 
 vcd_lib_dir = '/usr/lib64'
@@ -52,4 +56,5 @@ setup(name='vcd2json',
       download_url='https://github.com/fortylines/vcd2json/tarball/%s'
           % __version__,
       license='BSD',
+      python_requires='>=3',
       description='This is a wrapper for libvcd')
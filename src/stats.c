@@ -0,0 +1,127 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libvcd.h"
+
+static const char *vcd_token_names[VCD_TOKEN_TYPES] = {
+    "err",
+    "whitespace",
+    "keyword",
+    "comment",
+    "date",
+    "enddefinitions",
+    "scope",
+    "timescale",
+    "upscope",
+    "var",
+    "version",
+    "end",
+    "data",
+    "dumpall",
+    "dumpoff",
+    "dumpon",
+    "dumpvars",
+    "sim_time",
+    "value_change_bit",
+    "value_change_binary",
+    "value_change_real"
+};
+
+
+const char *
+vcd_token_name( vcd_token tok )
+{
+    return (size_t)tok < VCD_TOKEN_TYPES ? vcd_token_names[tok] : "unknown";
+}
+
+
+double
+vcd_stats_clock( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+static size_t
+change_record_bytes( const change_record *record )
+{
+    return record->value_change ? record->capacity : 0;
+}
+
+
+size_t
+signal_map_bytes( const signal_map *map )
+{
+    size_t bytes = 0;
+    const signal_buf *curr;
+    for( curr = map->head; curr; curr = curr->next ) {
+        const text_chunk *chunk;
+        bytes += sizeof(signal_buf) + strlen(curr->name) + 1;
+        bytes += change_record_bytes(&curr->initial_change_record);
+        bytes += change_record_bytes(&curr->last_change_record);
+        for( chunk = curr->text_head; chunk; chunk = chunk->next ) {
+            bytes += sizeof(text_chunk) + chunk->capacity;
+        }
+    }
+    return bytes;
+}
+
+
+void
+vcd_stats_print( const struct vcd_stats_t *stats,
+    vcd_print_callback print, void *obj )
+{
+    char text[256];
+    int len = snprintf(text, sizeof(text),
+        "{\n\"bytes\": %zu,\n\"tokens\": {", stats->bytes);
+    print(obj, text, len);
+    for( size_t i = 0; i < VCD_TOKEN_TYPES; ++i ) {
+        len = snprintf(text, sizeof(text), "%s\"%s\": %zu",
+            i > 0 ? ", " : "", vcd_token_names[i], stats->tokens[i]);
+        print(obj, text, len);
+    }
+    len = snprintf(text, sizeof(text),
+        "},\n\"broken_tokens\": %zu,\n"
+        "\"value_changes\": {\"matched\": %zu, \"skipped\": %zu},\n",
+        stats->broken_tokens,
+        stats->value_changes_matched, stats->value_changes_skipped);
+    print(obj, text, len);
+    len = snprintf(text, sizeof(text),
+        "\"seconds\": {\"tokenize\": %.6f, \"parse\": %.6f,"
+        " \"print\": %.6f},\n",
+        stats->tokenize_time, stats->parse_time, stats->print_time);
+    print(obj, text, len);
+    len = snprintf(text, sizeof(text),
+        "\"output_bytes\": %zu,\n\"signal_bytes\": %zu\n}\n",
+        stats->output_bytes, stats->signal_bytes);
+    print(obj, text, len);
+}
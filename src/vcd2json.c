@@ -22,6 +22,10 @@
    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#define _POSIX_C_SOURCE 200112L
+
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -33,18 +37,97 @@ stdout_print( void* obj, const char *buffer, size_t len )
     fwrite(buffer, 1, len, stdout);
 }
 
+static void
+stderr_print( void* obj, const char *buffer, size_t len )
+{
+    fwrite(buffer, 1, len, stderr);
+}
+
+/* Parses *arg*, the argument of *option*, as a decimal integer
+   no larger than *max*. Returns 0 on success and 1 on error. */
+static int
+parse_integer( const char *option, const char *arg, size_t max,
+    size_t *value )
+{
+    char *end;
+    errno = 0;
+    unsigned long long parsed = strtoull(arg, &end, 10);
+    if( end == arg || *end != '\0' || arg[0] == '-'
+        || errno == ERANGE || parsed > max ) {
+        fprintf(stderr, "error: %s expects an integer in [0, %zu], not %s\n",
+            option, max, arg);
+        return 1;
+    }
+    *value = parsed;
+    return 0;
+}
+
+/* Runs the queries in *queries_path* in a single pass over *from*. */
+static int
+run_queries( const char *queries_path, FILE *from, bool use_mmap,
+    size_t buffer_size )
+{
+    struct trace_batch_t batch;
+    bool read_whole_input = true;
+
+    FILE *queries = fopen(queries_path, "r");
+    if( !queries ) {
+        fprintf(stderr, "error: unable to open %s\n", queries_path);
+        return 1;
+    }
+    trace_batch_init(&batch, stdout_print, NULL);
+    int err = trace_batch_read_queries(&batch, queries);
+    fclose(queries);
+    if( err ) return err;
+
+    if( use_mmap ) {
+        size_t size;
+        const char *data = file_compression(fileno(from)) == no_compression ?
+            map_input(fileno(from), &size) : NULL;
+        if( data ) {
+            trace_batch_write(&batch, data, size);
+            unmap_input(data, size);
+            read_whole_input = false;
+        } else {
+            fprintf(stderr,
+                "warning: unable to map input in memory, reading it instead.\n");
+        }
+    }
+    if( read_whole_input ) {
+        err = read_input(from, buffer_size, write_batch, &batch);
+    }
+    trace_batch_flush(&batch);
+    return err;
+}
+
+
 int main( int argc, char *argv[] )
 {
     size_t end_time = 0;
     size_t start_time = 0;
     size_t resolution = 1;
-    size_t bytes_read = 1;
+    bool read_whole_input = true;
+    size_t buffer_size = READ_AHEAD_BUFFER_SIZE;
+    bool use_mmap = false;
+    int nb_threads = 1;
+    trace_format format = json_trace_format;
+    bool build_index = false;
+    bool build_lod = false;
+    bool build_hierarchy = false;
+    bool print_stats = false;
+    struct vcd_stats_t stats;
     struct trace_filter_t trace;
-    char buffer[BUFFER_SIZE];
+    signal_buf *names = NULL;
     char input_path[FILENAME_MAX];
+    char queries_path[FILENAME_MAX];
+    char socket_path[FILENAME_MAX];
+    char index_path[FILENAME_MAX + 4];
+    char lod_path[FILENAME_MAX + 4];
+    char hierarchy_path[FILENAME_MAX + 5];
 
     input_path[0] = 0;
-    trace_filter_init(&trace, 0, 0, 1, stdout_print, NULL);
+    queries_path[0] = 0;
+    socket_path[0] = 0;
 
     int argi = 1;
     while( argi < argc ) {
@@ -54,13 +137,36 @@ int main( int argc, char *argv[] )
             printf("version %s\n", __VCD2JSON_VERSION__);
             printf("Copyright (c) 2015, Sebastien Mirolo\n\n");
             printf("-n, --name str        "\
-                "variable name to include in json output\n");
+                "variable name to include in json output, '*' and '?'\n"\
+                "                      match within a scope, '**' across scopes\n");
             printf("-s, --start int       "\
                 "start of timeframe to include in json output\n");
             printf("-e, --end int         "\
                 "end of timeframe to include in json output\n");
             printf("-r, --resolution int  "\
                 "number of timestamps per pixel\n");
+            printf("-f, --format str      "\
+                "json (default), ndjson (one change per line) or bin\n");
+            printf("-b, --buffer-size int "\
+                "bytes per read-ahead buffer (default %d)\n",
+                READ_AHEAD_BUFFER_SIZE);
+            printf("-m, --mmap            "\
+                "map the input file in memory instead of reading it\n");
+            printf("-j, --jobs int        "\
+                "number of threads tokenizing value changes (implies -m)\n");
+            printf("-q, --queries file    "\
+                "run the queries in file, one per line, in a single pass:\n"\
+                "                      id start end resolution name [name ...]\n");
+            printf("-S, --serve path      "\
+                "answer JSON requests for traces on a Unix socket\n");
+            printf("-i, --index           "\
+                "write a vcdfile.idx index used to seek to --start\n");
+            printf("-l, --lod             "\
+                "write vcdfile.lod summaries used at coarse --resolution\n");
+            printf("-H, --hierarchy       "\
+                "write a vcdfile.hier cache of the header definitions\n");
+            printf("    --stats           "\
+                "print parsing statistics as JSON on stderr\n");
             return 0;
         }
         if( strncmp(argv[argi], "-n", 2) == 0
@@ -71,7 +177,7 @@ int main( int argc, char *argv[] )
                     "error: missing symbol argument after %s", argv[argi - 1]);
                 return 1;
             }
-            trace.map.head = insert_signal(trace.map.head, argv[argi++]);
+            names = insert_signal(names, argv[argi++]);
         } else if( strncmp(argv[argi], "-s", 2) == 0
             || strncmp(argv[argi], "--start", 7) == 0 ) {
             ++argi;
@@ -80,7 +186,11 @@ int main( int argc, char *argv[] )
                     "error: missing time argument after %s", argv[argi - 1]);
                 return 1;
             }
-            start_time = atoi(argv[argi++]);
+            if( parse_integer(argv[argi - 1], argv[argi],
+                    SIZE_MAX, &start_time) != 0 ) {
+                return 1;
+            }
+            ++argi;
         } else if( strncmp(argv[argi], "-e", 2) == 0
             || strncmp(argv[argi], "--end", 5) == 0 ) {
             ++argi;
@@ -89,7 +199,11 @@ int main( int argc, char *argv[] )
                     "error: missing time argument after %s", argv[argi - 1]);
                 return 1;
             }
-            end_time = atoi(argv[argi++]);
+            if( parse_integer(argv[argi - 1], argv[argi],
+                    SIZE_MAX, &end_time) != 0 ) {
+                return 1;
+            }
+            ++argi;
         } else if( strncmp(argv[argi], "-r", 2) == 0
             || strncmp(argv[argi], "--resolution", 12) == 0 ) {
             ++argi;
@@ -99,7 +213,106 @@ int main( int argc, char *argv[] )
                     argv[argi - 1]);
                 return 1;
             }
-            resolution = atoi(argv[argi++]);
+            if( parse_integer(argv[argi - 1], argv[argi],
+                    SIZE_MAX, &resolution) != 0 ) {
+                return 1;
+            }
+            ++argi;
+        } else if( strncmp(argv[argi], "-f", 2) == 0
+            || strncmp(argv[argi], "--format", 8) == 0 ) {
+            ++argi;
+            if( argi >= argc ) {
+                fprintf(stderr,
+                    "error: missing format argument after %s", argv[argi - 1]);
+                return 1;
+            }
+            if( strcmp(argv[argi], "json") == 0 ) {
+                format = json_trace_format;
+            } else if( strcmp(argv[argi], "ndjson") == 0 ) {
+                format = ndjson_trace_format;
+            } else if( strcmp(argv[argi], "bin") == 0 ) {
+                format = bin_trace_format;
+            } else {
+                fprintf(stderr, "error: unknown format %s\n", argv[argi]);
+                return 1;
+            }
+            ++argi;
+        } else if( strncmp(argv[argi], "-b", 2) == 0
+            || strncmp(argv[argi], "--buffer-size", 13) == 0 ) {
+            ++argi;
+            if( argi >= argc ) {
+                fprintf(stderr,
+                    "error: missing integer argument after %s",
+                    argv[argi - 1]);
+                return 1;
+            }
+            if( parse_integer(argv[argi - 1], argv[argi],
+                    SIZE_MAX, &buffer_size) != 0 ) {
+                return 1;
+            }
+            ++argi;
+            if( buffer_size < BUFFER_SIZE ) {
+                fprintf(stderr,
+                    "error: buffer size must be at least %d bytes\n",
+                    BUFFER_SIZE);
+                return 1;
+            }
+        } else if( strncmp(argv[argi], "-m", 2) == 0
+            || strncmp(argv[argi], "--mmap", 6) == 0 ) {
+            ++argi;
+            use_mmap = true;
+        } else if( strncmp(argv[argi], "-j", 2) == 0
+            || strncmp(argv[argi], "--jobs", 6) == 0 ) {
+            ++argi;
+            if( argi >= argc ) {
+                fprintf(stderr,
+                    "error: missing integer argument after %s",
+                    argv[argi - 1]);
+                return 1;
+            }
+            size_t jobs;
+            if( parse_integer(argv[argi - 1], argv[argi],
+                    INT_MAX, &jobs) != 0 ) {
+                return 1;
+            }
+            ++argi;
+            nb_threads = (int)jobs;
+            use_mmap = true;
+        } else if( strncmp(argv[argi], "-q", 2) == 0
+            || strncmp(argv[argi], "--queries", 9) == 0 ) {
+            ++argi;
+            if( argi >= argc ) {
+                fprintf(stderr,
+                    "error: missing file argument after %s", argv[argi - 1]);
+                return 1;
+            }
+            strncpy(queries_path, argv[argi++], FILENAME_MAX - 1);
+            queries_path[FILENAME_MAX - 1] = '\0';
+        } else if( strncmp(argv[argi], "-S", 2) == 0
+            || strncmp(argv[argi], "--serve", 7) == 0 ) {
+            ++argi;
+            if( argi >= argc ) {
+                fprintf(stderr,
+                    "error: missing path argument after %s", argv[argi - 1]);
+                return 1;
+            }
+            strncpy(socket_path, argv[argi++], FILENAME_MAX - 1);
+            socket_path[FILENAME_MAX - 1] = '\0';
+        } else if( strncmp(argv[argi], "-i", 2) == 0
+            || strncmp(argv[argi], "--index", 7) == 0 ) {
+            ++argi;
+            build_index = true;
+        } else if( strncmp(argv[argi], "-l", 2) == 0
+            || strncmp(argv[argi], "--lod", 5) == 0 ) {
+            ++argi;
+            build_lod = true;
+        } else if( strncmp(argv[argi], "-H", 2) == 0
+            || strncmp(argv[argi], "--hierarchy", 11) == 0 ) {
+            ++argi;
+            build_hierarchy = true;
+        } else if( strcmp(argv[argi], "--stats") == 0 ) {
+            ++argi;
+            print_stats = true;
         } else {
             strncpy(input_path, argv[argi++], FILENAME_MAX);
             if( argi < argc ) {
@@ -116,28 +329,146 @@ int main( int argc, char *argv[] )
         return 1;
     }
 
+    /* Indices, summaries and memory mapping all read the VCD file
+       at random offsets. */
+    bool compressed = file_compression(fileno(from)) != no_compression;
+    snprintf(index_path, sizeof(index_path), "%s.idx", input_path);
+    if( build_index ) {
+        if( strlen(input_path) == 0 || compressed ) {
+            fprintf(stderr,
+                "error: an index requires an uncompressed input filename\n");
+            return 1;
+        }
+        FILE *to = fopen(index_path, "w");
+        if( !to ) {
+            fprintf(stderr, "error: unable to open %s\n", index_path);
+            return 1;
+        }
+        int err = time_index_build(from, to, TIME_INDEX_INTERVAL);
+        if( fclose(to) != 0 ) err = 1;
+        return err;
+    }
+
+    snprintf(lod_path, sizeof(lod_path), "%s.lod", input_path);
+    if( build_lod ) {
+        if( strlen(input_path) == 0 || compressed ) {
+            fprintf(stderr,
+                "error: summaries require an uncompressed input filename\n");
+            return 1;
+        }
+        FILE *to = fopen(lod_path, "w");
+        if( !to ) {
+            fprintf(stderr, "error: unable to open %s\n", lod_path);
+            return 1;
+        }
+        int err = lod_build(from, to);
+        if( fclose(to) != 0 ) err = 1;
+        return err;
+    }
+
+    snprintf(hierarchy_path, sizeof(hierarchy_path), "%s.hier", input_path);
+    if( build_hierarchy ) {
+        if( strlen(input_path) == 0 || compressed ) {
+            fprintf(stderr, "error: a hierarchy cache requires"\
+                " an uncompressed input filename\n");
+            return 1;
+        }
+        FILE *to = fopen(hierarchy_path, "w");
+        if( !to ) {
+            fprintf(stderr, "error: unable to open %s\n", hierarchy_path);
+            return 1;
+        }
+        int err = hierarchy_build(from, to);
+        if( fclose(to) != 0 ) err = 1;
+        return err;
+    }
+
+    if( strlen(socket_path) > 0 ) {
+        if( strlen(input_path) == 0 || compressed ) {
+            fprintf(stderr,
+                "error: serving requires an uncompressed input filename\n");
+            return 1;
+        }
+        FILE *cache = fopen(hierarchy_path, "r");
+        int err = trace_serve(socket_path, from, cache);
+        if( cache ) fclose(cache);
+        return err;
+    }
+
+    if( strlen(queries_path) > 0 ) {
+        return run_queries(queries_path, from, use_mmap, buffer_size);
+    }
+
 #ifdef LOGENABLE
     fprintf(stderr,
         "(timestamp, value) in [%ld, %ld[ with resolution %ld for\n",
         start_time, end_time, resolution);
-    signal_buf *curr = trace.map.head;
+    signal_buf *curr = names;
     while( curr ) {
         fprintf(stderr, "\t%s\n", curr->name);
         curr = curr->next;
     }
 #endif
 
-    trace.sim.start_time = start_time;
-    trace.sim.end_time = end_time;
-    trace.sim.resolution = resolution;
+    trace_filter_init_format(&trace, start_time, end_time, resolution,
+        format, stdout_print, NULL);
+    trace.map.head = names;
+    if( print_stats ) trace_filter_enable_stats(&trace, &stats);
 
-    while( bytes_read > 0 ) {
-        bytes_read = fread(buffer, 1, BUFFER_SIZE, from);
-        if( trace_filter_write(&trace, buffer, bytes_read) != bytes_read ){
-            break;
+    FILE *hierarchy = strlen(input_path) > 0 && !compressed ?
+        fopen(hierarchy_path, "r") : NULL;
+    if( hierarchy ) {
+        if( trace_filter_load_hierarchy(&trace, from, hierarchy) == 0 ) {
+            fprintf(stderr, "notice: using %s.\n", hierarchy_path);
+        } else {
+            fprintf(stderr,
+                "warning: %s is out-of-date, reading definitions.\n",
+                hierarchy_path);
         }
+        fclose(hierarchy);
+    }
+    FILE *lod = strlen(input_path) > 0 && !compressed && resolution > 1 ?
+        fopen(lod_path, "r") : NULL;
+    if( lod ) {
+        if( trace_filter_write_lod(&trace, from, lod) == 0 ) {
+            fprintf(stderr, "notice: using %s.\n", lod_path);
+            read_whole_input = false;
+        }
+        fclose(lod);
+    }
+    FILE *index = strlen(input_path) > 0 && !compressed && read_whole_input ?
+        fopen(index_path, "r") : NULL;
+    if( index ) {
+        if( trace_filter_write_indexed(&trace, from, index) == 0 ) {
+            fprintf(stderr, "notice: using %s.\n", index_path);
+            read_whole_input = false;
+        } else {
+            fprintf(stderr,
+                "warning: %s is out-of-date, reading whole input.\n",
+                index_path);
+        }
+        fclose(index);
+    }
+    if( use_mmap && compressed ) {
+        fprintf(stderr,
+            "warning: compressed input cannot be mapped, reading it instead.\n");
+    } else if( use_mmap && read_whole_input ) {
+        int err = nb_threads > 1 ?
+            trace_filter_write_parallel(&trace, fileno(from), nb_threads)
+            : trace_filter_write_mapped(&trace, fileno(from));
+        if( err == 0 ) {
+            read_whole_input = false;
+        } else {
+            fprintf(stderr,
+                "warning: unable to map input in memory, reading it instead.\n");
+        }
+    }
+    int err = 0;
+    if( read_whole_input ) {
+        err = read_input(from, buffer_size, write_trace, &trace);
     }
 
     trace_filter_flush(&trace);
-    return 0;
+    if( print_stats ) vcd_stats_print(&stats, stderr_print, NULL);
+    return err;
 }
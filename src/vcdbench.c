@@ -0,0 +1,197 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Reports the throughput of the library entry points, and optionally
+   of the vcd2json command, on a VCD file. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "libvcd.h"
+
+static const size_t chunk_sizes[] = { 4096, 65536, 1 << 20 };
+
+
+static void
+discard_print( void *obj, const char *buffer, size_t len )
+{
+}
+
+
+static double
+now( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/* Number of value changes in *from*, i.e. lines starting with
+   a value, outside of the header. */
+static size_t
+count_value_changes( FILE *from )
+{
+    char line[BUFFER_SIZE];
+    size_t nb_changes = 0;
+    bool begin_of_line = true;
+    while( fgets(line, sizeof(line), from) ) {
+        if( begin_of_line && line[0] && strchr("01xXzZbBrR", line[0]) ) {
+            ++nb_changes;
+        }
+        begin_of_line = (line[strlen(line) - 1] == '\n');
+    }
+    rewind(from);
+    return nb_changes;
+}
+
+
+static void
+report( const char *name, size_t size, size_t nb_changes, double elapsed )
+{
+    printf("%-36s %8.3f s %10.1f MB/s %12.0f changes/s\n", name, elapsed,
+        size / elapsed / (1 << 20), nb_changes / elapsed);
+}
+
+
+static signal_buf *
+select_signals( int argc, char *argv[] )
+{
+    signal_buf *head = NULL;
+    for( int i = 0; i < argc; ++i ) {
+        head = insert_signal(head, argv[i]);
+    }
+    return head;
+}
+
+
+int main( int argc, char *argv[] )
+{
+    const char *command = NULL;
+    int argi = 1;
+    while( argi < argc && argv[argi][0] == '-' ) {
+        if( strcmp(argv[argi], "-x") == 0 && argi + 1 < argc ) {
+            command = argv[argi + 1];
+            argi += 2;
+        } else {
+            fprintf(stderr, "usage: %s [-x vcd2json] vcdfile [name ...]\n",
+                argv[0]);
+            return 1;
+        }
+    }
+    if( argi >= argc ) {
+        fprintf(stderr, "usage: %s [-x vcd2json] vcdfile [name ...]\n",
+            argv[0]);
+        return 1;
+    }
+    const char *input_path = argv[argi++];
+    int nb_names = argc - argi;
+    char **names = &argv[argi];
+    FILE *from = fopen(input_path, "r");
+    if( !from ) {
+        fprintf(stderr, "error: unable to open %s\n", input_path);
+        return 1;
+    }
+    fseek(from, 0, SEEK_END);
+    size_t size = ftell(from);
+    rewind(from);
+    size_t nb_changes = count_value_changes(from);
+    printf("%s: %zu bytes, %zu value changes, %d signals selected\n",
+        input_path, size, nb_changes, nb_names);
+
+    double start;
+    signal_map map;
+    init_signal_map(&map);
+    start = now();
+    header_and_definitions(from, &map, discard_print, NULL);
+    report("header_and_definitions", ftell(from), 0, now() - start);
+    destroy_signal_map(&map);
+    rewind(from);
+
+    init_signal_map(&map);
+    map.head = select_signals(nb_names, names);
+    start = now();
+    filter_value_changes(from, &map, 0, (size_t)-1, 1, discard_print, NULL);
+    report("filter_value_changes", size, nb_changes, now() - start);
+    destroy_signal_map(&map);
+    rewind(from);
+
+    for( size_t i = 0; i < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); ++i ) {
+        char name[64];
+        struct trace_filter_t trace;
+        char *buffer = malloc(chunk_sizes[i]);
+        size_t bytes_read;
+        trace_filter_init(&trace, 0, (size_t)-1, 1, discard_print, NULL);
+        trace.map.head = select_signals(nb_names, names);
+        start = now();
+        while( (bytes_read = fread(buffer, 1, chunk_sizes[i], from)) > 0 ) {
+            if( trace_filter_write(&trace, buffer, bytes_read)
+                != bytes_read ) {
+                break;
+            }
+        }
+        trace_filter_flush(&trace);
+        snprintf(name, sizeof(name), "trace_filter_write (%zu bytes)",
+            chunk_sizes[i]);
+        report(name, size, nb_changes, now() - start);
+        free(buffer);
+        rewind(from);
+    }
+
+    {
+        struct trace_filter_t trace;
+        trace_filter_init(&trace, 0, (size_t)-1, 1, discard_print, NULL);
+        trace.map.head = select_signals(nb_names, names);
+        start = now();
+        if( trace_filter_write_mapped(&trace, fileno(from)) == 0 ) {
+            trace_filter_flush(&trace);
+            report("trace_filter_write_mapped", size, nb_changes, now() - start);
+        } else {
+            trace_filter_flush(&trace);
+        }
+    }
+
+    if( command ) {
+        /* The command line tool writes JSON, discarded by the shell. */
+        char cmdline[FILENAME_MAX * 4];
+        int len = snprintf(cmdline, sizeof(cmdline),
+            "%s -e %zu", command, (size_t)-1);
+        for( int i = 0; i < nb_names; ++i ) {
+            len += snprintf(&cmdline[len], sizeof(cmdline) - len,
+                " -n '%s'", names[i]);
+        }
+        snprintf(&cmdline[len], sizeof(cmdline) - len,
+            " '%s' > /dev/null", input_path);
+        start = now();
+        if( system(cmdline) != 0 ) {
+            fprintf(stderr, "error: %s failed\n", cmdline);
+            return 1;
+        }
+        report("vcd2json", size, nb_changes, now() - start);
+    }
+    fclose(from);
+    return 0;
+}
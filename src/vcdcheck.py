@@ -0,0 +1,467 @@
+# Copyright (c) 2019, Sebastien Mirolo
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice,
+#    this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+# PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+# CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+# EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+# PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+# OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+# WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+# OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+# ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Checks that every way vcd2json answers a query gives the same trace
+as the plain JSON output, tokenized serially from the start of the file.
+
+    usage: vcdcheck.py [--zstd] [--python builddir] vcd2json vcdfile
+               name [name ...]
+
+Each query (a time window and resolution) is run through: ndjson and bin
+formats, a sidecar index, level-of-detail summaries, a hierarchy cache,
+gzip (and zstd) compressed input, several threads, a memory mapped input,
+standard input, --stats, and the query server. ndjson and bin outputs are
+compared on the records of each signal. Each query also selects signals
+through '*' and '**' patterns, and through the names that share
+an identifier code with another name (aliases), if any. All queries then
+run together as a batch (-q).
+
+With --python, the vcd module built in *builddir* (see the _vcd.so target
+of the Makefile) is checked as well: vcd.values, vcd.queries, vcd.Trace fed
+in chunks until write() returns early, the GIL released while parsing,
+and a Trace used without __init__."""
+
+import glob, json, os, re, shutil, socket, subprocess, sys, tempfile
+import threading, time
+
+# Largest time vcd2json accepts (SIZE_MAX on 64-bit hosts).
+END_OF_TIME = 2 ** 64 - 1
+
+# (start, end, resolution). Summaries only apply when all three are
+# multiples of 16. The last queries start past the first checkpoints
+# of an index on a few megabytes file.
+QUERIES = [
+    (0, END_OF_TIME, 1),
+    (100, 300, 1),
+    (1000, 2000, 7),
+    (0, END_OF_TIME, 16),
+    (160, 4800, 32),
+    (0, 1024, 256),
+    (100000, 110000, 1),
+    (50000, END_OF_TIME, 160),
+]
+
+
+def run(command, input_path=None, stdin=None):
+    if input_path:
+        with open(input_path, 'rb') as input_file:
+            result = subprocess.run(command, stdin=input_file,
+                stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    else:
+        result = subprocess.run(command, input=stdin,
+            stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+    # Notices that a sidecar file was used are expected.
+    for line in result.stderr.decode('utf-8').splitlines():
+        if not line.startswith('notice:'):
+            sys.stderr.write(line + '\n')
+    result.check_returncode()
+    return result.stdout
+
+
+def run_stats(command):
+    """Runs *command* with --stats. Returns its output and the statistics
+    printed on stderr."""
+    result = subprocess.run(command[:1] + ['--stats'] + command[1:],
+        stdout=subprocess.PIPE, stderr=subprocess.PIPE, check=True)
+    return result.stdout, json.loads(result.stderr.decode('utf-8'))
+
+
+def query_args(names, query):
+    start, end, resolution = query
+    args = ['-s', str(start), '-e', str(end), '-r', str(resolution)]
+    for name in names:
+        args += ['-n', name]
+    return args
+
+
+def records(output):
+    """Returns the records of each signal in a JSON trace."""
+    trace = json.loads(output.decode('utf-8'))
+    return {key: value for key, value in trace.items()
+        if isinstance(value, list)}
+
+
+def definitions(scope, prefix=''):
+    """Yields the (name, identifier code) of each signal declared
+    in *scope*, the "definitions" of a JSON trace."""
+    for key, value in scope.items():
+        if isinstance(value, dict):
+            yield from definitions(value, prefix + key + '/')
+        else:
+            yield prefix + key, value
+
+
+def find_aliases(output):
+    """Returns the names declared with the first identifier code shared
+    by several names in a JSON trace, or an empty list."""
+    codes = {}
+    trace = json.loads(output.decode('utf-8'))
+    for name, code in definitions(trace.get('definitions', {})):
+        codes.setdefault(code, []).append(name)
+    for names in codes.values():
+        if len(names) > 1:
+            return names
+    return []
+
+
+def patterns(names):
+    """Returns patterns that match at least *names*: the scope of each
+    name followed by '*', and the last name under '**'."""
+    return sorted(set([name.rsplit('/', 1)[0] + '/*'
+        for name in names if '/' in name])) + [
+            '**/' + names[-1].rsplit('/', 1)[-1]]
+
+
+def ndjson_records(output):
+    """Returns the records of each signal in a ndjson trace."""
+    result = {}
+    for line in output.decode('utf-8').splitlines():
+        record = json.loads(line)
+        value = [record['t'], record['v']]
+        if 'n' in record:
+            value += [record['n']]
+        if record.get('x'):
+            value += [True]
+        result.setdefault(record['name'], []).append(value)
+    return result
+
+
+def varint(data, pos):
+    result = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        result |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return result, pos
+
+
+def bin_records(output):
+    """Returns the records of each signal in a bin trace
+    (see src/binary.c)."""
+    if output[:4] != b'VCDB':
+        raise ValueError("not a VCDB trace")
+    pos = 5
+    for _ in range(3):
+        _, pos = varint(output, pos)
+    result = {}
+    nb_signals, pos = varint(output, pos)
+    for _ in range(nb_signals):
+        length, pos = varint(output, pos)
+        name = output[pos:pos + length].decode('utf-8')
+        pos += length
+        values = []
+        nb_values, pos = varint(output, pos)
+        for _ in range(nb_values):
+            kind = output[pos]
+            length, pos = varint(output, pos + 1)
+            if kind == 1:
+                values += [output[pos:pos + length].decode('utf-8')]
+                pos += length
+            else:
+                values += [''.join(['01xz'[
+                    (output[pos + idx // 4] >> (6 - 2 * (idx % 4))) & 3]
+                    for idx in range(length)])]
+                pos += (length + 3) // 4
+        timestamp = 0
+        timeline = []
+        nb_records, pos = varint(output, pos)
+        for _ in range(nb_records):
+            delta, pos = varint(output, pos)
+            index, pos = varint(output, pos)
+            timestamp += delta
+            record = [timestamp, values[index >> 1]]
+            if index & 1:
+                changes, pos = varint(output, pos)
+                record += [changes >> 1]
+                if changes & 1:
+                    record += [True]
+            timeline += [record]
+        result[name] = timeline
+    if pos != len(output):
+        raise ValueError("trailing bytes in VCDB trace")
+    return result
+
+
+def ask(socket_path, request):
+    conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    conn.connect(socket_path)
+    conn.sendall((json.dumps(request) + '\n').encode('utf-8'))
+    output = b''
+    while True:
+        data = conn.recv(1 << 16)
+        if not data:
+            break
+        output += data
+    conn.close()
+    return output
+
+
+def start_server(vcd2json, socket_path, vcd_path):
+    server = subprocess.Popen([vcd2json, '--serve', socket_path, vcd_path])
+    for _ in range(600):
+        if server.poll() is not None:
+            raise RuntimeError("vcd2json --serve exited")
+        if os.path.exists(socket_path):
+            try:
+                # Waits for the server to listen. It reads an empty request.
+                conn = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                conn.connect(socket_path)
+                conn.close()
+                return server
+            except OSError:
+                pass
+        time.sleep(0.1)
+    server.terminate()
+    raise RuntimeError("vcd2json --serve did not listen")
+
+
+def import_vcd(build_dir):
+    for path in glob.glob(os.path.join(build_dir, 'lib*', 'vcd*.so')):
+        sys.path.insert(0, os.path.dirname(path))
+        break
+    import vcd
+    return vcd
+
+
+def trace_output(vcd, data, names, query, chunk_size=4096):
+    """Feeds *data* to a vcd.Trace in chunks. Returns the trace and
+    whether write() returned early."""
+    trace = vcd.Trace(names, *query)
+    for offset in range(0, len(data), chunk_size):
+        chunk = data[offset:offset + chunk_size]
+        if trace.write(chunk) < len(chunk):
+            return str(trace).encode('utf-8'), True
+    return str(trace).encode('utf-8'), False
+
+
+def releases_gil(vcd, data, names):
+    """Returns True when another thread runs while vcd.values parses
+    *data*, which must take a while to parse."""
+    parsing = threading.Event()
+    done = []
+
+    def parse():
+        parsing.set()
+        vcd.values(data, names, 0, END_OF_TIME, 1)
+        done.append(True)
+
+    # Without a switch of thread on timeout, the main thread only runs
+    # again before *parse* is done if the GIL is released.
+    switch_interval = sys.getswitchinterval()
+    sys.setswitchinterval(100)
+    try:
+        thread = threading.Thread(target=parse)
+        thread.start()
+        parsing.wait()
+        released = not done
+        thread.join()
+    finally:
+        sys.setswitchinterval(switch_interval)
+    return released
+
+
+def uninitialized_trace_fails(vcd):
+    """Returns True when a Trace used without __init__ raises."""
+    trace = vcd.Trace.__new__(vcd.Trace)
+    for method in (lambda: str(trace), lambda: trace.write(b'#0\n')):
+        try:
+            method()
+            return False
+        except RuntimeError:
+            pass
+    return True
+
+
+def copy_input(work_dir, vcd_path, name):
+    """Copies *vcd_path* such that the sidecars of each path do not
+    apply to the others."""
+    path = os.path.join(work_dir, name, os.path.basename(vcd_path))
+    os.makedirs(os.path.dirname(path))
+    shutil.copyfile(vcd_path, path)
+    return path
+
+
+def main(args):
+    use_zstd = False
+    vcd = None
+    while args and args[0].startswith('--'):
+        if args[0] == '--zstd':
+            use_zstd = True
+            args = args[1:]
+        elif args[0] == '--python' and len(args) > 1:
+            vcd = import_vcd(args[1])
+            args = args[2:]
+        else:
+            break
+    if len(args) < 3:
+        sys.stderr.write(__doc__.split('\n\n')[1] + '\n')
+        return 1
+    vcd2json = os.path.abspath(args[0])
+    vcd_path = args[1]
+    names = args[2:]
+
+    work_dir = tempfile.mkdtemp(prefix='vcdcheck')
+    server = None
+    nb_checks = 0
+    failures = []
+    try:
+        plain = copy_input(work_dir, vcd_path, 'plain')
+        indexed = copy_input(work_dir, vcd_path, 'index')
+        summarized = copy_input(work_dir, vcd_path, 'lod')
+        cached = copy_input(work_dir, vcd_path, 'hier')
+        run([vcd2json, '--index', indexed])
+        run([vcd2json, '--lod', summarized])
+        run([vcd2json, '--hierarchy', cached])
+        compressed = [('gzip', plain + '.gz',
+            run(['gzip', '-c'], input_path=plain))]
+        if use_zstd:
+            compressed += [('zstd', plain + '.zst',
+                run(['zstd', '-c'], input_path=plain))]
+        for _, path, compressed_data in compressed:
+            with open(path, 'wb') as compressed_file:
+                compressed_file.write(compressed_data)
+        socket_path = os.path.join(work_dir, 'vcdcheck.sock')
+        server = start_server(vcd2json, socket_path,
+            copy_input(work_dir, vcd_path, 'serve'))
+        with open(plain, 'rb') as plain_file:
+            data = plain_file.read()
+        last_timestamp = max([int(timestamp) for timestamp
+            in re.findall(rb'^#(\d+)', data, re.MULTILINE)] + [0])
+        aliases = find_aliases(run([vcd2json, plain]))
+        # Ids are escaped in the output of a batch.
+        batch = [('q"%d' % i, names) + query
+            for i, query in enumerate(QUERIES)]
+        batch_path = os.path.join(work_dir, 'queries')
+        with open(batch_path, 'w') as batch_file:
+            for query_id, _, start, end, resolution in batch:
+                batch_file.write("%s %d %d %d %s\n" % (
+                    query_id, start, end, resolution, ' '.join(names)))
+        expected_batch = {}
+        if vcd:
+            checks = [('python uninitialized', uninitialized_trace_fails(vcd))]
+            if len(data) >= (1 << 20):
+                checks += [('python gil', releases_gil(vcd, data, names))]
+            for name, passed in checks:
+                nb_checks += 1
+                if not passed:
+                    failures += [name]
+
+        for query_id, _, start, end, resolution in batch:
+            query = (start, end, resolution)
+            args = query_args(names, query)
+            expected = run([vcd2json] + args + [plain])
+            expected_batch[query_id] = records(expected)
+            output, stats = run_stats([vcd2json] + args + [plain])
+            outputs = [
+                ('index', run([vcd2json] + args + [indexed])),
+                ('lod', run([vcd2json] + args + [summarized])),
+                ('hier', run([vcd2json] + args + [cached])),
+                ('jobs', run([vcd2json, '-j', '3'] + args + [plain])),
+                ('mmap', run([vcd2json, '-m'] + args + [plain])),
+                ('stdin', run([vcd2json] + args, input_path=plain)),
+                ('stats', output),
+                ('serve', ask(socket_path, {'signals': names,
+                    'start': query[0], 'end': query[1],
+                    'resolution': query[2]}))]
+            for name, path, compressed_data in compressed:
+                outputs += [(name, run([vcd2json] + args + [path]))]
+                outputs += [(name + ' stdin',
+                    run([vcd2json] + args, stdin=compressed_data))]
+            nb_checks += 1
+            if stats['output_bytes'] != len(output):
+                failures += ["stats output_bytes %s" % str(query)]
+            if vcd:
+                output, early = trace_output(vcd, data, names, query)
+                outputs += [('python', output),
+                    ('python values',
+                        vcd.values(data, names, *query).encode('utf-8'))]
+                # write() returns early once a timestamp reaches the end
+                # of the time window.
+                nb_checks += 1
+                if early != (query[1] <= last_timestamp):
+                    failures += ["python early exit %s" % str(query)]
+            for name, output in outputs:
+                nb_checks += 1
+                if output != expected:
+                    failures += ["%s %s" % (name, query)]
+
+            # ndjson has no line for a signal without records.
+            expected_records = {key: value
+                for key, value in records(expected).items() if value}
+            for name, output, decode in [
+                    ('ndjson', run([vcd2json, '-f', 'ndjson'] + args
+                        + [plain]), ndjson_records),
+                    ('bin', run([vcd2json, '-f', 'bin'] + args + [plain]),
+                        bin_records)]:
+                nb_checks += 1
+                if {key: value for key, value in decode(output).items()
+                        if value} != expected_records:
+                    failures += ["%s %s" % (name, query)]
+
+            # Patterns select the same traces as the names they match.
+            matched = records(run([vcd2json]
+                + query_args(patterns(names), query) + [plain]))
+            nb_checks += 1
+            if (not set(names) <= set(matched)
+                or matched != records(run([vcd2json]
+                    + query_args(sorted(matched), query) + [plain]))):
+                failures += ["patterns %s" % str(query)]
+
+            # Aliases get the trace of their identifier code.
+            if aliases:
+                traces = records(run([vcd2json]
+                    + query_args(aliases, query) + [plain]))
+                alone = records(run([vcd2json]
+                    + query_args(aliases[:1], query) + [plain]))
+                nb_checks += 1
+                if any(traces.get(alias) != alone[aliases[0]]
+                        for alias in aliases):
+                    failures += ["aliases %s" % str(query)]
+
+        # A batch answers all queries in a single pass.
+        output = run([vcd2json, '-q', batch_path, plain])
+        nb_checks += 1
+        if json.loads(output.decode('utf-8')) != expected_batch:
+            failures += ["queries"]
+        if vcd:
+            nb_checks += 1
+            if vcd.queries(data, batch).encode('utf-8') != output:
+                failures += ["python queries"]
+    finally:
+        if server:
+            server.terminate()
+            server.wait()
+        shutil.rmtree(work_dir)
+
+    for failure in failures:
+        sys.stderr.write("error: %s: %s failed\n" % (vcd_path, failure))
+    sys.stdout.write("%s: %d of %d checks passed\n" % (
+        vcd_path, nb_checks - len(failures), nb_checks))
+    return 1 if failures else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,202 @@
+/* Copyright (c) 2019, Sebastien Mirolo
+   All rights reserved.
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are met:
+
+   1. Redistributions of source code must retain the above copyright notice,
+      this list of conditions and the following disclaimer.
+   2. Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+   TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+   PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+   CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+   EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+   PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+   OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+   WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+   OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+   ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Writes a synthetic VCD file on stdout, used to benchmark the parser
+   on dumps larger than the fixtures. The same options always produce
+   the same file. */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IDENTIFIER_CODE_MAX   16
+
+
+static unsigned long long seed = 88172645463325252ULL;
+
+/* xorshift64 */
+static unsigned long long
+next_random( void )
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+
+/* Identifier codes are the bijective base-94 numbers, least significant
+   character first, padded to at least *code_len* characters. */
+static void
+make_identifier_code( char *code, size_t index, size_t code_len )
+{
+    size_t len = 0;
+    size_t n = index + 1;
+    while( n > 0 && len < IDENTIFIER_CODE_MAX ) {
+        --n;
+        code[len++] = '!' + n % 94;
+        n /= 94;
+    }
+    while( len < code_len ) code[len++] = '!';
+    code[len] = '\0';
+}
+
+
+static bool
+is_vector( size_t index, int vector_percent )
+{
+    return (int)(index % 100) < vector_percent;
+}
+
+
+static size_t
+print_value_change( size_t index, const char *code,
+    int vector_percent, size_t vector_width )
+{
+    static const char scalar_values[] = "0101010101xz";
+    if( is_vector(index, vector_percent) ) {
+        char value[vector_width + 1];
+        unsigned long long bits = next_random();
+        size_t i, first = vector_width - 1;
+        for( i = 0; i < vector_width; ++i ) {
+            if( i % 64 == 63 ) bits = next_random();
+            value[vector_width - 1 - i] = '0' + (bits & 1);
+            if( bits & 1 ) first = vector_width - 1 - i;
+            bits >>= 1;
+        }
+        value[vector_width] = '\0';
+        /* Leading zeros are dropped, as most simulators do. */
+        return printf("b%s %s\n", &value[first], code);
+    }
+    return printf("%c%s\n",
+        scalar_values[next_random() % (sizeof(scalar_values) - 1)], code);
+}
+
+
+int main( int argc, char *argv[] )
+{
+    size_t nb_signals = 1000;
+    size_t code_len = 0;
+    size_t vector_width = 32;
+    int vector_percent = 25;
+    int density = 10;
+    size_t size = 64 << 20;
+    char code[IDENTIFIER_CODE_MAX + 1];
+
+    int argi = 1;
+    while( argi < argc ) {
+        if( strcmp(argv[argi], "-h") == 0
+            || strcmp(argv[argi], "--help") == 0 ) {
+            printf("%s [options]\n\n", argv[0]);
+            printf("-n, --signals int     "\
+                "number of signals (default: %zu)\n", nb_signals);
+            printf("-c, --code-length int "\
+                "minimum identifier code length (default: shortest)\n");
+            printf("-w, --width int       "\
+                "width of vector signals (default: %zu)\n", vector_width);
+            printf("-v, --vectors int     "\
+                "percent of vector signals (default: %d)\n", vector_percent);
+            printf("-d, --density int     "\
+                "percent of signals changing per timestamp (default: %d)\n",
+                density);
+            printf("-s, --size int        "\
+                "approximate file size in bytes (default: %zu)\n", size);
+            printf("\nSignals are named top/s<n>, or top/v<n>[<width-1>:0]"\
+                " for vectors,\nwhere vectors are the ones with n %% 100"\
+                " below --vectors.\n");
+            return 0;
+        }
+        if( argi + 1 >= argc ) {
+            fprintf(stderr,
+                "error: missing integer argument after %s\n", argv[argi]);
+            return 1;
+        }
+        size_t value = strtoull(argv[argi + 1], NULL, 10);
+        if( strcmp(argv[argi], "-n") == 0
+            || strcmp(argv[argi], "--signals") == 0 ) {
+            nb_signals = value;
+        } else if( strcmp(argv[argi], "-c") == 0
+            || strcmp(argv[argi], "--code-length") == 0 ) {
+            code_len = value;
+        } else if( strcmp(argv[argi], "-w") == 0
+            || strcmp(argv[argi], "--width") == 0 ) {
+            vector_width = value;
+        } else if( strcmp(argv[argi], "-v") == 0
+            || strcmp(argv[argi], "--vectors") == 0 ) {
+            vector_percent = value;
+        } else if( strcmp(argv[argi], "-d") == 0
+            || strcmp(argv[argi], "--density") == 0 ) {
+            density = value;
+        } else if( strcmp(argv[argi], "-s") == 0
+            || strcmp(argv[argi], "--size") == 0 ) {
+            size = value;
+        } else {
+            fprintf(stderr, "error: unknown option %s\n", argv[argi]);
+            return 1;
+        }
+        argi += 2;
+    }
+    if( nb_signals == 0 || vector_width == 0
+        || code_len > IDENTIFIER_CODE_MAX || density <= 0 ) {
+        fprintf(stderr, "error: invalid options\n");
+        return 1;
+    }
+
+    size_t written = printf("$date\n\tgenerated by %s\n$end\n"\
+        "$version\n\tvcdgen\n$end\n$timescale 1ns $end\n"\
+        "$scope module top $end\n", argv[0]);
+    for( size_t i = 0; i < nb_signals; ++i ) {
+        make_identifier_code(code, i, code_len);
+        if( is_vector(i, vector_percent) ) {
+            written += printf("$var wire %zu %s v%zu [%zu:0] $end\n",
+                vector_width, code, i, vector_width - 1);
+        } else {
+            written += printf("$var wire 1 %s s%zu $end\n", code, i);
+        }
+    }
+    written += printf("$upscope $end\n$enddefinitions $end\n");
+
+    written += printf("$dumpvars\n");
+    for( size_t i = 0; i < nb_signals; ++i ) {
+        make_identifier_code(code, i, code_len);
+        written += print_value_change(i, code, vector_percent, vector_width);
+    }
+    written += printf("$end\n");
+
+    /* Each timestamp changes about *density* percent of the signals,
+       picked at random so every identifier code shows up. */
+    size_t nb_changes = nb_signals * density / 100;
+    if( nb_changes == 0 ) nb_changes = 1;
+    for( size_t timestamp = 1; written < size; ++timestamp ) {
+        written += printf("#%zu\n", timestamp * 10);
+        for( size_t n = 0; n < nb_changes; ++n ) {
+            size_t i = next_random() % nb_signals;
+            make_identifier_code(code, i, code_len);
+            written += print_value_change(i, code,
+                vector_percent, vector_width);
+        }
+    }
+    return 0;
+}
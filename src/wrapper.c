@@ -22,76 +22,241 @@
    OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
    ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
-#include <stdio.h>
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <stdio.h>
+#include <unistd.h>
 #include "libvcd.h"
 
 
-typedef struct _write_string_stream_t {
-    Py_ssize_t write_index;
-    PyObject *buffer;
-} write_string_stream_t;
+/* Output of a trace. Parsing runs without the GIL, so text is kept
+   in a native buffer that doubles in size as needed, and becomes
+   a Python object only once parsing is done. */
+typedef struct _write_buffer_t {
+    char *data;
+    size_t length;
+    size_t capacity;
+    bool failed;
+} write_buffer_t;
 
 
 typedef struct {
     PyObject_HEAD
     struct trace_filter_t trace;
-    write_string_stream_t write_stream;
+    write_buffer_t write_stream;
+    bool initialized;           /* __init__ set up *trace*. */
+    bool flushed;
+    bool busy;                  /* write() runs on another thread. */
+    bool has_stats;
+    struct vcd_stats_t stats;
 } PyVCDTrace;
 
 
 static void
-write_string_stream_append( void* ptr, const char *buffer, size_t len )
+write_buffer_append( void* ptr, const char *buffer, size_t len )
 {
-    write_string_stream_t *stream = (write_string_stream_t *)ptr;
-
-    PyObject *newstr = PyString_FromStringAndSize(buffer, len);
-    if( newstr ) {
-        PyObject *obj = stream->buffer;
-        if( obj ) {
-            PyString_ConcatAndDel(&obj, newstr);
-            if( obj ) stream->buffer = obj;
-        } else {
-            stream->buffer = newstr;
+    write_buffer_t *stream = (write_buffer_t *)ptr;
+
+    if( stream->length + len > stream->capacity ) {
+        size_t capacity = stream->capacity > 0 ? stream->capacity : 4096;
+        while( capacity < stream->length + len ) capacity *= 2;
+        char *data = realloc(stream->data, capacity);
+        if( !data ) {
+            stream->failed = true;
+            return;
         }
+        stream->data = data;
+        stream->capacity = capacity;
     }
+    memcpy(&stream->data[stream->length], buffer, len);
+    stream->length += len;
 }
 
 
+static void
+discard_print( void* ptr, const char *buffer, size_t len )
+{
+    (void)ptr;
+    (void)buffer;
+    (void)len;
+}
+
+
+/* Returns the text in *stream* as a str, or *empty* when there is none. */
+static PyObject *
+write_buffer_str( const write_buffer_t *stream, const char *empty )
+{
+    if( stream->failed ) {
+        return PyErr_NoMemory();
+    } else if( stream->length > 0 ) {
+        return PyUnicode_DecodeUTF8(stream->data, stream->length, "replace");
+    }
+    return PyUnicode_FromString(empty);
+}
+
+
+/* Same as write_buffer_str, then releases *stream*. */
+static PyObject *
+write_buffer_result( write_buffer_t *stream, const char *empty )
+{
+    PyObject *result = write_buffer_str(stream, empty);
+    free(stream->data);
+    return result;
+}
+
+
+/* Input of a VCD file, either an open file or a bytes-like object. */
+typedef struct _vcd_input_t {
+    int fd;
+    off_t prevpos;
+    Py_buffer view;
+    bool has_view;
+} vcd_input_t;
+
+
+/* Pins the VCD content of *obj*. The bytes of a bytes-like object stay
+   valid without the GIL for as long as the view is held. */
 static int
-PyVCDTrace_init(PyVCDTrace *self, PyObject *args, PyObject *kwds)
+open_vcd_input( vcd_input_t *input, PyObject *obj )
+{
+    input->fd = -1;
+    input->has_view = false;
+    if( PyObject_CheckBuffer(obj) ) {
+        if( PyObject_GetBuffer(obj, &input->view, PyBUF_SIMPLE) < 0 ) {
+            return -1;
+        }
+        input->has_view = true;
+        return 0;
+    }
+    int fd = PyObject_AsFileDescriptor(obj);
+    if( fd < 0 ) {
+        return -1;
+    }
+    input->prevpos = lseek(fd, 0, SEEK_CUR);
+    input->fd = dup(fd);
+    if( input->fd < 0 ) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Returns a stream on *input* from its first byte. This function
+   does not touch Python objects and is called without the GIL. */
+static FILE *
+fopen_vcd_input( vcd_input_t *input )
+{
+    if( input->has_view ) {
+        if( input->view.len == 0 ) return NULL;
+        return fmemopen(input->view.buf, input->view.len, "r");
+    }
+    FILE *fp = fdopen(input->fd, "r");
+    if( fp ) {
+        /* The file descriptor was dup'ed, we are done with it. */
+        input->fd = -1;
+        fseek(fp, 0, SEEK_SET);
+    }
+    return fp;
+}
+
+
+static void
+close_vcd_input( vcd_input_t *input, FILE *fp )
+{
+    if( fp ) fclose(fp);
+    if( input->fd >= 0 ) close(input->fd);
+    if( input->has_view ) {
+        PyBuffer_Release(&input->view);
+    }
+}
+
+
+/* The file offset is shared with the Python file object. We put it back
+   where it was such that the object is unaware we read the file. */
+static void
+restore_vcd_input( vcd_input_t *input, PyObject *obj )
+{
+    if( !input->has_view ) {
+        int fd = PyObject_AsFileDescriptor(obj);
+        if( fd >= 0 ) lseek(fd, input->prevpos, SEEK_SET);
+    }
+}
+
+
+static int
+insert_variables( signal_map *map, PyObject *variables )
 {
     Py_ssize_t i;
+    PyObject *seq = PySequence_Fast(variables, "variables must be a list");
+    if( !seq ) return -1;
+    for( i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i ) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+        const char *name = PyUnicode_AsUTF8(item);
+        if( !name ) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        map->head = insert_signal(map->head, (char *)name);
+    }
+    Py_DECREF(seq);
+    return 0;
+}
+
+
+/* Releases the memory held by the trace filter of *self*. */
+static void
+destroy_trace(PyVCDTrace *self)
+{
+    if( !self->initialized ) return;
+    destroy_tokenizer(&self->trace.tokenizer);
+    vcd_emitter_destroy(&self->trace.emitter);
+    destroy_signal_map(&self->trace.map);
+    free(self->write_stream.data);
+    self->write_stream.data = NULL;
+    self->initialized = false;
+}
+
+
+static int
+PyVCDTrace_init(PyVCDTrace *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"variables", "start_time", "end_time",
+        "resolution", "stats", NULL};
     PyObject *variables;
     unsigned long start_time, end_time, resolution;
+    int has_stats = 0;
 
-    if( !PyArg_ParseTuple(args, "Okkk", &variables,
-            &start_time, &end_time, &resolution) ) {
-        return 1;
+    if( !PyArg_ParseTupleAndKeywords(args, kwds, "Okkk|p", kwlist,
+            &variables, &start_time, &end_time, &resolution, &has_stats) ) {
+        return -1;
     }
+    if( self->busy ) {
+        PyErr_SetString(PyExc_RuntimeError,
+            "trace is being written from another thread");
+        return -1;
+    }
+    /* __init__ called again starts a new trace. */
+    destroy_trace(self);
 
-    self->write_stream.write_index = 0;
-    self->write_stream.buffer = NULL;
+    memset(&self->write_stream, 0, sizeof(self->write_stream));
+    self->flushed = false;
+    self->busy = false;
+    self->has_stats = has_stats;
     trace_filter_init(&self->trace, start_time, end_time, resolution,
-        write_string_stream_append, &self->write_stream);
+        write_buffer_append, &self->write_stream);
+    if( has_stats ) trace_filter_enable_stats(&self->trace, &self->stats);
+    self->initialized = true;
 
-    for( i = 0; i < PyList_Size(variables); ++i ) {
-        PyObject *item = PyList_GetItem(variables, 0);
-        char *name = PyString_AsString(item);
-        if( name ) {
-            self->trace.map.head = insert_signal(self->trace.map.head, name);
-        }
-    }
-
-    return 0;
+    return insert_variables(&self->trace.map, variables);
 }
 
 static void
 PyVCDTrace_dealloc(PyObject *obj)
 {
     PyVCDTrace *self = (PyVCDTrace*)obj;
-    destroy_signal_map(&self->trace.map);
-    PyMem_DEL(self);
+    destroy_trace(self);
+    Py_TYPE(obj)->tp_free(obj);
 }
 
 
@@ -104,26 +269,84 @@ PyVCDTrace_write(PyVCDTrace *self, PyObject *args)
     if( !PyArg_ParseTuple(args, "O", &arg1) ) {
         return 0;
     }
+    if( !self->initialized ) {
+        PyErr_SetString(PyExc_RuntimeError, "trace was not initialized");
+        return 0;
+    }
+    if( self->busy || self->flushed ) {
+        PyErr_SetString(PyExc_RuntimeError, self->flushed ?
+            "trace was already converted to str"
+            : "trace is being written from another thread");
+        return 0;
+    }
     if( PyObject_GetBuffer(arg1, &buffer, PyBUF_SIMPLE) < 0 ) {
         return 0;
     }
 
-    size_t bytes_used = trace_filter_write(
-        &self->trace, buffer.buf, buffer.len);
+    size_t bytes_used;
+    self->busy = true;
+    Py_BEGIN_ALLOW_THREADS;
+    bytes_used = trace_filter_write(&self->trace, buffer.buf, buffer.len);
+    Py_END_ALLOW_THREADS;
+    self->busy = false;
 
     PyBuffer_Release(&buffer);
-    return PyInt_FromSize_t(bytes_used);
+    return PyLong_FromSize_t(bytes_used);
+}
+
+/* Returns the statistics of a trace as a dict, or None when
+   the trace was created without stats=True. */
+static PyObject *
+PyVCDTrace_stats(PyVCDTrace *self, PyObject *args)
+{
+    if( !self->has_stats ) {
+        Py_RETURN_NONE;
+    }
+    PyObject *tokens = PyDict_New();
+    if( !tokens ) return NULL;
+    for( size_t i = 0; i < VCD_TOKEN_TYPES; ++i ) {
+        PyObject *count = PyLong_FromSize_t(self->stats.tokens[i]);
+        if( !count || PyDict_SetItemString(tokens,
+                vcd_token_name((vcd_token)i), count) < 0 ) {
+            Py_XDECREF(count);
+            Py_DECREF(tokens);
+            return NULL;
+        }
+        Py_DECREF(count);
+    }
+    return Py_BuildValue("{s:n,s:N,s:n,s:{s:n,s:n},s:{s:d,s:d,s:d},s:n,s:n}",
+        "bytes", (Py_ssize_t)self->stats.bytes,
+        "tokens", tokens,
+        "broken_tokens", (Py_ssize_t)self->stats.broken_tokens,
+        "value_changes",
+        "matched", (Py_ssize_t)self->stats.value_changes_matched,
+        "skipped", (Py_ssize_t)self->stats.value_changes_skipped,
+        "seconds",
+        "tokenize", self->stats.tokenize_time,
+        "parse", self->stats.parse_time,
+        "print", self->stats.print_time,
+        "output_bytes", (Py_ssize_t)self->stats.output_bytes,
+        "signal_bytes", (Py_ssize_t)self->stats.signal_bytes);
 }
 
 static PyObject *
 PyVCDTrace_str(PyObject *obj)
 {
     PyVCDTrace *self = (PyVCDTrace*)obj;
-    trace_filter_flush(&self->trace);
-
-    if( self->write_stream.buffer )
-        return self->write_stream.buffer;
-    return PyString_FromString("");
+    if( !self->initialized ) {
+        PyErr_SetString(PyExc_RuntimeError, "trace was not initialized");
+        return 0;
+    }
+    if( self->busy ) {
+        PyErr_SetString(PyExc_RuntimeError,
+            "trace is being written from another thread");
+        return 0;
+    }
+    if( !self->flushed ) {
+        trace_filter_flush(&self->trace);
+        self->flushed = true;
+    }
+    return write_buffer_str(&self->write_stream, "");
 }
 
 
@@ -131,39 +354,39 @@ static PyObject*
 wrapper_definitions( PyObject *self, PyObject *args )
 {
     signal_map map;
-    PyFileObject *read_file_descr;
+    PyObject *read_file_descr;
     if( !PyArg_ParseTuple(args, "O", &read_file_descr) ) {
         return NULL;
     }
 
-    write_string_stream_t write_stream;
-    write_stream.write_index = 0;
-    write_stream.buffer = NULL;
+    vcd_input_t input;
+    if( open_vcd_input(&input, read_file_descr) < 0 ) {
+        return NULL;
+    }
 
-    FILE *fp = PyFile_AsFile((PyObject*)read_file_descr);
-    PyFile_IncUseCount(read_file_descr);
-#if 0
+    write_buffer_t write_stream;
+    memset(&write_stream, 0, sizeof(write_stream));
+
+    FILE *fp;
     Py_BEGIN_ALLOW_THREADS;
-#endif
-    init_signal_map(&map);
-    header_and_definitions(fp, &map, write_string_stream_append, &write_stream);
-    destroy_signal_map(&map);
-#if 0
+    fp = fopen_vcd_input(&input);
+    if( fp ) {
+        init_signal_map(&map);
+        header_and_definitions(fp, &map, write_buffer_append, &write_stream);
+        destroy_signal_map(&map);
+    }
     Py_END_ALLOW_THREADS;
-#endif
-    PyFile_DecUseCount(read_file_descr);
+    close_vcd_input(&input, fp);
+    restore_vcd_input(&input, read_file_descr);
 
-    if( write_stream.buffer )
-        return write_stream.buffer;
-    return PyString_FromString("{}");
+    return write_buffer_result(&write_stream, "{}");
 }
 
 static PyObject*
 wrapper_values( PyObject *self, PyObject *args )
 {
-    Py_ssize_t i;
     PyObject *variables;
-    PyFileObject *read_file_descr;
+    PyObject *read_file_descr;
     unsigned long start_time, end_time, resolution;
 
     if( !PyArg_ParseTuple(args, "OOkkk", &read_file_descr, &variables,
@@ -172,107 +395,163 @@ wrapper_values( PyObject *self, PyObject *args )
     }
 
     signal_map map;
-    write_string_stream_t write_stream;
-    write_stream.write_index = 0;
-    write_stream.buffer = NULL;
+    init_signal_map(&map);
+    if( insert_variables(&map, variables) < 0 ) {
+        destroy_signal_map(&map);
+        return NULL;
+    }
+
+    vcd_input_t input;
+    if( open_vcd_input(&input, read_file_descr) < 0 ) {
+        destroy_signal_map(&map);
+        return NULL;
+    }
 
-    FILE *fp = PyFile_AsFile((PyObject*)read_file_descr);
-    PyFile_IncUseCount(read_file_descr);
+    write_buffer_t write_stream;
+    memset(&write_stream, 0, sizeof(write_stream));
 
-    long prevpos = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
-#if 0
+    FILE *fp;
     Py_BEGIN_ALLOW_THREADS;
-#endif
-    init_signal_map(&map);
-    for( i = 0; i < PyList_Size(variables); ++i ) {
-        PyObject *item = PyList_GetItem(variables, 0);
-        char *name = PyString_AsString(item);
-        if( name ) {
-            map.head = insert_signal(map.head, name);
-        }
+    fp = fopen_vcd_input(&input);
+    if( fp ) {
+        filter_value_changes(fp, &map, start_time, end_time, resolution,
+            write_buffer_append, &write_stream);
     }
-    filter_value_changes(fp, &map, start_time, end_time, resolution,
-        write_string_stream_append, &write_stream);
     destroy_signal_map(&map);
-#if 0
     Py_END_ALLOW_THREADS;
-#endif
-    fseek(fp, prevpos, SEEK_SET);
-    PyFile_DecUseCount(read_file_descr);
+    close_vcd_input(&input, fp);
+    restore_vcd_input(&input, read_file_descr);
+
+    return write_buffer_result(&write_stream, "{}");
+}
+
+
+static PyObject*
+wrapper_queries( PyObject *self, PyObject *args )
+{
+    Py_ssize_t i;
+    PyObject *queries;
+    PyObject *read_file_descr;
+
+    if( !PyArg_ParseTuple(args, "OO", &read_file_descr, &queries) ) {
+        return NULL;
+    }
+
+    write_buffer_t write_stream;
+    memset(&write_stream, 0, sizeof(write_stream));
+    struct trace_batch_t batch;
+    trace_batch_init(&batch, write_buffer_append, &write_stream);
+
+    PyObject *seq = PySequence_Fast(queries, "queries must be a list");
+    if( !seq ) return NULL;
+    for( i = 0; i < PySequence_Fast_GET_SIZE(seq); ++i ) {
+        const char *id;
+        PyObject *variables;
+        unsigned long start_time, end_time, resolution;
+        if( !PyArg_ParseTuple(PySequence_Fast_GET_ITEM(seq, i), "sOkkk",
+                &id, &variables, &start_time, &end_time, &resolution) ) {
+            break;
+        }
+        struct trace_query_t *query = trace_batch_add_query(&batch, id,
+            start_time, end_time, resolution);
+        if( !query ) {
+            PyErr_NoMemory();
+            break;
+        }
+        if( insert_variables(&query->map, variables) < 0 ) break;
+    }
+    Py_DECREF(seq);
+
+    vcd_input_t input;
+    if( PyErr_Occurred()
+        || open_vcd_input(&input, read_file_descr) < 0 ) {
+        batch.print = discard_print;
+        trace_batch_flush(&batch);
+        free(write_stream.data);
+        return NULL;
+    }
+
+    FILE *fp;
+    Py_BEGIN_ALLOW_THREADS;
+    fp = fopen_vcd_input(&input);
+    if( fp ) read_input(fp, 0, write_batch, &batch);
+    trace_batch_flush(&batch);
+    Py_END_ALLOW_THREADS;
+    close_vcd_input(&input, fp);
+    restore_vcd_input(&input, read_file_descr);
 
-    if( write_stream.buffer )
-        return write_stream.buffer;
-    return PyString_FromString("{}");
+    return write_buffer_result(&write_stream, "{}");
 }
 
 
 static PyMethodDef VCDMethods[] = {
     {"definitions",  wrapper_definitions, METH_VARARGS,
-     "Returns header and definitions of a VCD file."},
+     "Returns header and definitions of a VCD file, given as an open file"
+     " or a bytes-like object. The GIL is released while parsing."},
     {"values",  wrapper_values, METH_VARARGS,
-     "Retrieve value change dumps for a set of variables over a time period."},
+     "Retrieve value change dumps for a set of variables over a time period."
+     " The GIL is released while parsing."},
+    {"queries",  wrapper_queries, METH_VARARGS,
+     "Runs a list of (id, variables, start_time, end_time, resolution)"
+     " queries in a single pass over a VCD file. Returns the value change"
+     " dumps keyed by query id. The GIL is released while parsing."},
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
 static PyMethodDef PyVCDTrace_methods[] = {
     {"write", (PyCFunction)PyVCDTrace_write, METH_VARARGS,
-     "Write a chuck of VCD bytes into the trace filter."
+     "Write a chuck of VCD bytes into the trace filter. Returns the number"
+     " of bytes used, less than written once the time window is closed."
+     " The GIL is released while parsing."
+    },
+    {"stats", (PyCFunction)PyVCDTrace_stats, METH_NOARGS,
+     "Returns parsing statistics as a dict when the trace was created with"
+     " stats=True, None otherwise. They are complete once the trace"
+     " was converted to str."
     },
     {NULL}
 };
 
 static PyTypeObject PyVCDTrace_t = {
-    PyObject_HEAD_INIT(NULL)
-    0,                      /* ob_size */
-    "vcd.Trace",            /* tp_name */
-    sizeof(PyVCDTrace),     /* tp_basicsize */
-    0,                      /* tp_itemsize    */
-    PyVCDTrace_dealloc,     /* tp_dealloc     */
-    0,                      /* tp_print       */
-    0,                      /* tp_getattr     */
-    0,                      /* tp_setattr     */
-    0,                      /* tp_compare     */
-    0,                      /* tp_repr        */
-    0,                      /* tp_as_number   */
-    0,                      /* tp_as_sequence */
-    0,                      /* tp_as_mapping  */
-    0,                      /* tp_hash        */
-    0,                      /* tp_call        */
-    PyVCDTrace_str,         /* tp_str         */
-    0,                      /* tp_getattro    */
-    0,                      /* tp_setattro    */
-    0,                      /* tp_as_buffer   */
-    Py_TPFLAGS_DEFAULT,     /* tp_flags       */
-    "VCD Trace.",           /* tp_doc         */
-    0,                      /* tp_traverse    */
-    0,                      /* tp_clear          */
-    0,                      /* tp_richcompare    */
-    0,                      /* tp_weaklistoffset */
-    0,                      /* tp_iter           */
-    0,                      /* tp_iternext       */
-    PyVCDTrace_methods,     /* tp_methods        */
-    0,                      /* tp_members        */
-    0,                      /* tp_getset         */
-    0,                      /* tp_base           */
-    0,                      /* tp_dict           */
-    0,                      /* tp_descr_get      */
-    0,                      /* tp_descr_set      */
-    0,                      /* tp_dictoffset     */
-    (initproc)PyVCDTrace_init, /* tp_init         */
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "vcd.Trace",
+    .tp_basicsize = sizeof(PyVCDTrace),
+    .tp_dealloc = PyVCDTrace_dealloc,
+    .tp_str = PyVCDTrace_str,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "VCD Trace.",
+    .tp_methods = PyVCDTrace_methods,
+    .tp_init = (initproc)PyVCDTrace_init,
+    .tp_new = PyType_GenericNew,
+};
+
+static struct PyModuleDef VCDModule = {
+    PyModuleDef_HEAD_INIT,
+    "vcd",
+    "Value change dumps to JSON.",
+    -1,
+    VCDMethods,
+    NULL,
+    NULL,
+    NULL,
+    NULL
 };
 
 
 PyMODINIT_FUNC
-initvcd(void)
+PyInit_vcd(void)
 {
-    PyVCDTrace_t.tp_new = PyType_GenericNew;
     if (PyType_Ready(&PyVCDTrace_t) < 0)
-        return;
+        return NULL;
 
-    PyObject *m = Py_InitModule("vcd", VCDMethods);
-    if( m == NULL ) return;
+    PyObject *m = PyModule_Create(&VCDModule);
+    if( m == NULL ) return NULL;
 
     Py_INCREF(&PyVCDTrace_t);
-    PyModule_AddObject(m, "Trace", (PyObject *)&PyVCDTrace_t);
+    if( PyModule_AddObject(m, "Trace", (PyObject *)&PyVCDTrace_t) < 0 ) {
+        Py_DECREF(&PyVCDTrace_t);
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
 }